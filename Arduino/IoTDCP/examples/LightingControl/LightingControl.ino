@@ -18,11 +18,135 @@
 //#define IoTMaxPasswordLength 32
 //**************************************
 
+//**************************************
+// If the device requires encryption
+// (IoTEncryptionKey must be shared with
+// the clients, and must be exactly 32
+// bytes long)
+//#define IoTEncryptionRequired
+//#define IoTEncryptionKey {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F}
+//#define IoTRandom32() RANDOM_REG32
+//**************************************
+
 #define IoTInterfaceCount 1
 #define IoTMaxPayloadLength 256
 
+//**************************************
+// If the device must also listen to
+// MessageGroup (joinGroup() must be
+// called for every group)
+//#define IoTGroupCount 4
+//**************************************
+
+//**************************************
+// If the device must also answer
+// MessageQueryDevice sent to
+// IoTMulticastGroupAddress, spreading
+// the responses over time when clients
+// send a fleet size estimate
+// (IoTRandom32() must be defined)
+//#define IoTMulticastDiscovery
+//**************************************
+
+//**************************************
+// If repeated MessageGetProperty must
+// be answered by IoTServer, for up to
+// IoTPropertyCacheTime milliseconds,
+// without calling getProperty()
+//#define IoTPropertyCacheCount 4
+//#define IoTPropertyCacheTime 1000
+//#define IoTMillis() millis()
+//**************************************
+
+//**************************************
+// If MessageHandshake must first be
+// answered with a cookie, so that only
+// clients that prove they own their
+// address get a client slot (IoTMillis()
+// and IoTRandom32() must be defined)
+//#define IoTHandshakeCookies
+//#define IoTHandshakeCookieTime 10000
+//**************************************
+
+//**************************************
+// If clients that have been quiet for
+// IoTClientTimeout milliseconds must
+// lose their client ids (IoTMillis()
+// must be defined, and tick() must be
+// called periodically)
+//#define IoTClientTimeout 60000
+//**************************************
+
+//**************************************
+// If client sessions (along with the
+// name and the password, when they are
+// not read-only) must survive restarts
+// (they are stored in the EEPROM)
+//#define IoTPersistentState
+//**************************************
+
+//**************************************
+// If Set/Execute must be answered
+// before the hardware is updated, in
+// loop(), so that values received
+// faster than they can be applied are
+// coalesced (only the latest value of
+// each property is applied)
+//#define IoTActuatorQueue 4
+//#define IoTActuatorValueLength 180 // Pixels (60 RGB triplets) is the longest property
+//**************************************
+
+//**************************************
+// If the last requests must be traced
+// (read them with tracedEvent())
+//#define IoTTrace 64
+//#define IoTTraceTimestamp() ESP.getCycleCount()
+//**************************************
+
+//**************************************
+// If properties must also accept
+// unacknowledged streams of values
+// (MessageOpenStream), for animations
+// and other high-rate updates
+// (IoTMillis() must be defined)
+//#define IoTSetpointStreamCount 2
+//**************************************
+
+//**************************************
+// If clients must be able to schedule
+// scenes for a given time (their clocks
+// are synchronized through
+// MessagePing), so that many devices
+// switch at the same moment, or to
+// schedule recurring scenes that keep
+// running without any clients
+// (IoTMillis() must be defined)
+//#define IoTScheduleCount 4
+//**************************************
+
+//**************************************
+// If clients must be able to upload
+// rules, which apply scenes as soon as
+// the properties given to
+// propertyChanged() meet a condition
+//#define IoTRuleCount 4
+//**************************************
+
+//**************************************
+// If responses must be written to the
+// packet while they are built, in small
+// chunks, instead of being kept whole in
+// RAM (IoTEncryptionRequired cannot be
+// used along with it)
+//#define IoTStreamingResponse
+//#define IoTStreamingChunkLength 32
+//**************************************
+
 #include <ESP8266WiFi.h>
 #include <WiFiUdp.h>
+#ifdef IoTPersistentState
+#include <EEPROM.h>
+#endif
 #include <IoTDCP.h>
 
 // Just to make it easier to reference the interfaces and properties
@@ -30,11 +154,14 @@
 #define PropState 0
 #define PropColor 1
 #define PropSampleEnum 2
+#define PropPixels 3
+#define PixelCount 60
 
 const IoTPropertyDescriptor IoTInterface0Properties[] = {
   { "State", IoTProperty.ModeReadOnly, IoTProperty.DataTypeU8, 1, IoTProperty.UnitEnum, IoTProperty.UnitOne, 0 },
   { "Color", IoTProperty.ModeReadWrite, IoTProperty.DataTypeRGBTriplet, 1, IoTProperty.UnitRGB, IoTProperty.UnitOne, 0 },
-  { "Sample Enum", IoTProperty.ModeReadWrite, IoTProperty.DataTypeS16, 1, IoTProperty.UnitEnum, IoTProperty.UnitOne, 0 }
+  { "Sample Enum", IoTProperty.ModeReadWrite, IoTProperty.DataTypeS16, 1, IoTProperty.UnitEnum, IoTProperty.UnitOne, 0 },
+  { "Pixels", IoTProperty.ModeReadWrite, IoTProperty.DataTypeRGBTriplet, PixelCount, IoTProperty.UnitRGB, IoTProperty.UnitOne, 0 }
 };
 
 const IoTInterfaceDescriptor IoTInterfaces[IoTInterfaceCount] = {
@@ -54,16 +181,26 @@ const char* password = "WIFI_PASSWORD";
 uint8_t wifiConnected, wifiConnecting, onOff, color[3];
 uint8_t receivedBuffer[256];
 uint16_t enumValue;
+IoTRGBTriplet pixels[PixelCount];
 uint32_t wifiConnectionStartTime;
 WiFiUDP udpServer;
 
-void describeEnum(IoTMessageDescribeEnum* msg) {
-  if (msg->interfaceIndex) {
+#ifdef IoTStreamingResponse
+// The packet is already open when the response starts to be built (responses
+// that are never sent, such as the ones of scheduled scenes, are dropped)
+void IoTResponseSinkWrite(const uint8_t* srcBuffer, uint16_t length) {
+  if (IoTServer.responseRequired())
+    udpServer.write(srcBuffer, length);
+}
+#endif
+
+void describeEnum(IoTDescribeEnumView msg) {
+  if (msg.interfaceIndex()) {
     IoTServer.buildResponse(IoTServer.ResponseInvalidInterface);
     return;
   }
 
-  if (msg->propertyIndex != 2) {
+  if (msg.propertyIndex() != 2) {
     // Since describing state's enum is not necessary and we do not have any other enums...
     IoTServer.buildResponse(IoTServer.ResponseInvalidInterfaceProperty);
   } else {
@@ -71,16 +208,56 @@ void describeEnum(IoTMessageDescribeEnum* msg) {
   }
 }
 
-void executeCommand(IoTMessageExecute* msg) {
-  if (msg->interfaceIndex) {
+#ifdef IoTActuatorQueue
+void applyActuation(const IoTActuation& actuation);
+
+// Values are applied right away when they cannot be queued (every mailbox is
+// still waiting to be applied), instead of being lost
+void actuateCommand(uint8_t interfaceCommand) {
+  if (IoTServer.queueCommand(Interface0, interfaceCommand))
+    return;
+  IoTActuation actuation;
+  actuation.operation = IoTServer.SceneExecute;
+  actuation.interfaceIndex = Interface0;
+  actuation.interfaceCommand = interfaceCommand;
+  actuation.propertyIndex = 0;
+  actuation.propertyValueLength = 0;
+  applyActuation(actuation);
+}
+
+void actuateProperty(uint8_t propertyIndex, const void* value, uint16_t length) {
+  if (IoTServer.queueProperty(Interface0, propertyIndex, value, length))
+    return;
+  if (length > IoTActuatorValueLength) {
+    // IoTActuatorValueLength is too short for this property, so any other
+    // commands should go here
+    return;
+  }
+  IoTActuation actuation;
+  actuation.operation = IoTServer.SceneSetProperty;
+  actuation.interfaceIndex = Interface0;
+  actuation.interfaceCommand = 0;
+  actuation.propertyIndex = propertyIndex;
+  actuation.propertyValueLength = (uint8_t)length;
+  memcpy(actuation.propertyValue, value, length);
+  applyActuation(actuation);
+}
+#endif
+
+void executeCommand(IoTExecuteView msg) {
+  if (msg.interfaceIndex()) {
     IoTServer.buildResponse(IoTServer.ResponseInvalidInterface);
     return;
   }
-  switch (msg->interfaceCommand) {
+  switch (msg.interfaceCommand()) {
   case IoTInterfaceOnOff.CommandOff:
     if (!IoTServer.isMessageRepeated()) {
       onOff = IoTInterfaceOnOff.StateOff;
+#ifdef IoTActuatorQueue
+      actuateCommand(IoTInterfaceOnOff.CommandOff);
+#else
       // Any other commands should go here
+#endif
     }
     IoTServer.writeResponseProperty8(Interface0, PropState, onOff);
     IoTServer.buildResponse(IoTServer.ResponseOK);
@@ -88,7 +265,11 @@ void executeCommand(IoTMessageExecute* msg) {
   case IoTInterfaceOnOff.CommandOn:
     if (!IoTServer.isMessageRepeated()) {
       onOff = IoTInterfaceOnOff.StateOn;
+#ifdef IoTActuatorQueue
+      actuateCommand(IoTInterfaceOnOff.CommandOn);
+#else
       // Any other commands should go here
+#endif
     }
     IoTServer.writeResponseProperty8(Interface0, PropState, onOff);
     IoTServer.buildResponse(IoTServer.ResponseOK);
@@ -99,12 +280,12 @@ void executeCommand(IoTMessageExecute* msg) {
   }
 }
 
-void getProperty(IoTMessageGetProperty* msg) {
-  if (msg->interfaceIndex) {
+void getProperty(IoTGetPropertyView msg) {
+  if (msg.interfaceIndex()) {
     IoTServer.buildResponse(IoTServer.ResponseInvalidInterface);
     return;
   }
-  switch (msg->propertyIndex) {
+  switch (msg.propertyIndex()) {
   case PropState:
     IoTServer.writeResponseProperty8(Interface0, PropState, onOff);
     IoTServer.buildResponse(IoTServer.ResponseOK);
@@ -117,45 +298,57 @@ void getProperty(IoTMessageGetProperty* msg) {
     IoTServer.writeResponseProperty16(Interface0, PropSampleEnum, enumValue);
     IoTServer.buildResponse(IoTServer.ResponseOK);
     break;
+  case PropPixels:
+    IoTServer.writeResponseProperty(Interface0, PropPixels, pixels, PixelCount);
+    IoTServer.buildResponse(IoTServer.ResponseOK);
+    break;
   default:
     IoTServer.buildResponse(IoTServer.ResponseInvalidInterfaceProperty);
     return;
   }
 }
 
-void setProperty(IoTMessageSetProperty* msg, uint16_t payloadLength) {
-  if (msg->interfaceIndex) {
+void setProperty(IoTSetPropertyView msg) {
+  if (msg.interfaceIndex()) {
     IoTServer.buildResponse(IoTServer.ResponseInvalidInterface);
     return;
   }
 
-  switch (msg->propertyIndex) {
+  switch (msg.propertyIndex()) {
   case PropState:
     IoTServer.buildResponse(IoTServer.ResponseInterfacePropertyReadOnly);
     break;
   case PropColor:
-    if (msg->propertyValueLength != 3) {
+    if (msg.valueLength() != 3) {
       IoTServer.buildResponse(IoTServer.ResponseInvalidInterfacePropertyValue);
     } else {
-      color[0] = msg->propertyValue[0];
-      color[1] = msg->propertyValue[1];
-      color[2] = msg->propertyValue[2];
+      color[0] = msg.value()[0];
+      color[1] = msg.value()[1];
+      color[2] = msg.value()[2];
+#ifdef IoTActuatorQueue
+      actuateProperty(PropColor, color, 3);
+#else
       // Any other commands should go here
+#endif
       IoTServer.writeResponsePropertyRGB(Interface0, PropColor, color);
       IoTServer.buildResponse(IoTServer.ResponseOK);
     }
     break;
   case PropSampleEnum:
-    if (msg->propertyValueLength != 2) {
+    if (msg.valueLength() != 2) {
       IoTServer.buildResponse(IoTServer.ResponseInvalidInterfacePropertyValue);
     } else {
-      switch (*((uint16_t*)msg->propertyValue)) {
+      switch (msg.value16()) {
       case 0:
       case 1:
       case 2:
       case 255:
-        enumValue = *((uint16_t*)msg->propertyValue);
+        enumValue = msg.value16();
+#ifdef IoTActuatorQueue
+        actuateProperty(PropSampleEnum, &enumValue, 2);
+#else
         // Any other commands should go here
+#endif
         IoTServer.writeResponseProperty16(Interface0, PropSampleEnum, enumValue);
         IoTServer.buildResponse(IoTServer.ResponseOK);
         break;
@@ -165,32 +358,235 @@ void setProperty(IoTMessageSetProperty* msg, uint16_t payloadLength) {
       }
     }
     break;
+  case PropPixels:
+    if (msg.valueLength() != sizeof(pixels)) {
+      IoTServer.buildResponse(IoTServer.ResponseInvalidInterfacePropertyValue);
+    } else {
+      memcpy(pixels, msg.value(), sizeof(pixels));
+      // Any other commands should go here
+      IoTServer.writeResponseProperty(Interface0, PropPixels, pixels, PixelCount);
+      IoTServer.buildResponse(IoTServer.ResponseOK);
+    }
+    break;
   default:
     IoTServer.buildResponse(IoTServer.ResponseInvalidInterfaceProperty);
     return;
   }
 }
 
+// Ranges have already been validated against PixelCount, so only the
+// property itself must be checked
+void getPropertyRange(IoTGetPropertyRangeView msg) {
+  if (msg.interfaceIndex() || msg.propertyIndex() != PropPixels) {
+    IoTServer.buildResponse(msg.interfaceIndex() ? IoTServer.ResponseInvalidInterface : IoTServer.ResponseInvalidInterfaceProperty);
+    return;
+  }
+  IoTServer.writeResponsePropertyRange(Interface0, PropPixels, msg.offset(), pixels + msg.offset(), msg.count());
+  IoTServer.buildResponse(IoTServer.ResponseOK);
+}
+
+void setPropertyRange(IoTSetPropertyRangeView msg) {
+  if (msg.interfaceIndex() || msg.propertyIndex() != PropPixels) {
+    IoTServer.buildResponse(msg.interfaceIndex() ? IoTServer.ResponseInvalidInterface : IoTServer.ResponseInvalidInterfaceProperty);
+    return;
+  }
+  // Only the pixels that have actually changed are sent and applied
+  memcpy(pixels + msg.offset(), msg.value(), msg.count() * sizeof(IoTRGBTriplet));
+  // Any other commands should go here
+  IoTServer.writeResponsePropertyRange(Interface0, PropPixels, msg.offset(), pixels + msg.offset(), msg.count());
+  IoTServer.buildResponse(IoTServer.ResponseOK);
+}
+
+void executeScene() {
+  const uint8_t* operation;
+  uint8_t i;
+
+  // Interfaces, commands, properties and value lengths have already been
+  // validated by IoTServer, so only the values themselves must be checked,
+  // before applying anything
+  for (operation = IoTServer.firstSceneOperation(), i = 0; operation; operation = IoTServer.nextSceneOperation(operation), i++) {
+    if (operation[0] != IoTServer.SceneSetProperty)
+      continue;
+    IoTSetPropertyView msg(operation + 1);
+    if (msg.propertyIndex() == PropSampleEnum) {
+      switch (msg.value16()) {
+      case 0:
+      case 1:
+      case 2:
+      case 255:
+        break;
+      default:
+        IoTServer.writeResponse(i);
+        IoTServer.buildResponse(IoTServer.ResponseInvalidInterfacePropertyValue);
+        return;
+      }
+    }
+  }
+
+  if (!IoTServer.isMessageRepeated()) {
+    for (operation = IoTServer.firstSceneOperation(); operation; operation = IoTServer.nextSceneOperation(operation)) {
+      if (operation[0] == IoTServer.SceneExecute) {
+        IoTExecuteView msg(operation + 1);
+        onOff = ((msg.interfaceCommand() == IoTInterfaceOnOff.CommandOn) ? IoTInterfaceOnOff.StateOn : IoTInterfaceOnOff.StateOff);
+#ifdef IoTActuatorQueue
+        actuateCommand(msg.interfaceCommand());
+#endif
+      } else {
+        IoTSetPropertyView msg(operation + 1);
+        switch (msg.propertyIndex()) {
+        case PropColor:
+          color[0] = msg.value()[0];
+          color[1] = msg.value()[1];
+          color[2] = msg.value()[2];
+          break;
+        case PropSampleEnum:
+          enumValue = msg.value16();
+          break;
+        case PropPixels:
+          memcpy(pixels, msg.value(), sizeof(pixels));
+          break;
+        }
+#ifdef IoTActuatorQueue
+        actuateProperty(msg.propertyIndex(), msg.value(), msg.valueLength());
+#endif
+      }
+    }
+#ifndef IoTActuatorQueue
+    // Any other commands should go here
+#endif
+  }
+
+  // Since there is only one interface, all of its states are sent back
+  IoTServer.writeResponseProperty8(Interface0, PropState, onOff);
+  IoTServer.writeResponsePropertyRGB(Interface0, PropColor, color);
+  IoTServer.writeResponseProperty16(Interface0, PropSampleEnum, enumValue);
+  IoTServer.buildResponse(IoTServer.ResponseOK);
+}
+
+#ifdef IoTActuatorQueue
+void applyActuation(const IoTActuation& actuation) {
+  // This is where the hardware would actually be updated (values have
+  // already been sent back to the client by now)
+  if (actuation.operation == IoTServer.SceneExecute) {
+    // actuation.interfaceCommand
+  } else if (actuation.propertyIndex == PropColor) {
+    // actuation.propertyValue[0], actuation.propertyValue[1], actuation.propertyValue[2]
+  }
+}
+#endif
+
+#ifdef IoTSetpointStreamCount
+// Only the newest frame of each stream gets here, and its length has already
+// been checked, but there is no response to report invalid values, so they are
+// just ignored
+void applyStreamFrame() {
+  if (IoTServer.streamInterfaceIndex() != Interface0)
+    return;
+  switch (IoTServer.streamPropertyIndex()) {
+  case PropColor:
+    memcpy(color, IoTServer.payloadBuffer(), 3);
+#ifdef IoTActuatorQueue
+    actuateProperty(PropColor, color, 3);
+#else
+    // Any other commands should go here
+#endif
+    break;
+  case PropPixels:
+    memcpy(pixels, IoTServer.payloadBuffer(), sizeof(pixels));
+    // Any other commands should go here
+    break;
+  }
+}
+#endif
+
 void handleMessage() {
   switch (IoTServer.message()) {
   case IoTServer.MessageDescribeEnum:
-    describeEnum((IoTMessageDescribeEnum*)IoTServer.payloadBuffer());
+    describeEnum(IoTDescribeEnumView(IoTServer.payloadBuffer()));
     break;
   case IoTServer.MessageExecute:
-    executeCommand((IoTMessageExecute*)IoTServer.payloadBuffer());
+    executeCommand(IoTExecuteView(IoTServer.payloadBuffer()));
     break;
   case IoTServer.MessageGetProperty:
-    getProperty((IoTMessageGetProperty*)IoTServer.payloadBuffer());
+    getProperty(IoTGetPropertyView(IoTServer.payloadBuffer()));
     break;
   case IoTServer.MessageSetProperty:
-    setProperty((IoTMessageSetProperty*)IoTServer.payloadBuffer(), IoTServer.payloadLength());
+    setProperty(IoTSetPropertyView(IoTServer.payloadBuffer()));
+    break;
+  case IoTServer.MessageGetPropertyRange:
+    getPropertyRange(IoTGetPropertyRangeView(IoTServer.payloadBuffer()));
+    break;
+  case IoTServer.MessageSetPropertyRange:
+    setPropertyRange(IoTSetPropertyRangeView(IoTServer.payloadBuffer()));
     break;
+  case IoTServer.MessageScene:
+  case IoTServer.MessageGroup:
+    executeScene();
+    break;
+#ifdef IoTSetpointStreamCount
+  case IoTServer.MessageStreamFrame:
+    // Stream frames must not be answered (IoTServer builds the reports)
+    applyStreamFrame();
+    break;
+#endif
   default:
     IoTServer.buildResponse(IoTServer.ResponseUnsupportedMessage);
     break;
   }
 }
 
+#ifdef IoTPersistentState
+#define SampleStateLength 6
+// Flash sectors wear out after a few thousand erase cycles, so writes
+// are batched (at most once every StateSaveInterval milliseconds)
+#define StateSaveInterval 60000
+
+uint8_t savedSampleState[SampleStateLength];
+uint32_t lastStateSaveTime;
+
+void sampleState(uint8_t* dstBuffer) {
+  dstBuffer[0] = onOff;
+  dstBuffer[1] = color[0];
+  dstBuffer[2] = color[1];
+  dstBuffer[3] = color[2];
+  dstBuffer[4] = (uint8_t)enumValue;
+  dstBuffer[5] = (uint8_t)(enumValue >> 8);
+}
+
+void loadState() {
+  const uint32_t stateSize = IoTServer.stateSize();
+  EEPROM.begin(stateSize + SampleStateLength);
+  const uint8_t* srcBuffer = EEPROM.getDataPtr();
+  if (IoTServer.loadState(srcBuffer, stateSize)) {
+    srcBuffer += stateSize;
+    onOff = srcBuffer[0];
+    color[0] = srcBuffer[1];
+    color[1] = srcBuffer[2];
+    color[2] = srcBuffer[3];
+    enumValue = (uint16_t)(srcBuffer[4] | (srcBuffer[5] << 8));
+  }
+  sampleState(savedSampleState);
+  lastStateSaveTime = millis();
+}
+
+void saveState() {
+  if ((millis() - lastStateSaveTime) < StateSaveInterval)
+    return;
+
+  uint8_t currentSampleState[SampleStateLength];
+  sampleState(currentSampleState);
+  if (!IoTServer.isStateDirty() && !memcmp(currentSampleState, savedSampleState, SampleStateLength))
+    return;
+
+  lastStateSaveTime = millis();
+  uint8_t* dstBuffer = EEPROM.getDataPtr();
+  IoTServer.saveState(dstBuffer);
+  memcpy(dstBuffer + IoTServer.stateSize(), currentSampleState, SampleStateLength);
+  if (EEPROM.commit())
+    memcpy(savedSampleState, currentSampleState, SampleStateLength);
+}
+#endif
+
 void WiFiEvent(WiFiEvent_t event) {
   switch(event) {
   case WIFI_EVENT_STAMODE_GOT_IP:
@@ -198,7 +594,11 @@ void WiFiEvent(WiFiEvent_t event) {
       break;
     wifiConnected = 1;
     wifiConnecting = 0;
+#if defined(IoTGroupCount) || defined(IoTMulticastDiscovery)
+    udpServer.beginMulticast(WiFi.localIP(), IPAddress(IoTMulticastGroupAddress[0], IoTMulticastGroupAddress[1], IoTMulticastGroupAddress[2], IoTMulticastGroupAddress[3]), IoTPort);
+#else
     udpServer.begin(IoTPort);
+#endif
     break;
   case WIFI_EVENT_STAMODE_DISCONNECTED:
     wifiConnected = 0;
@@ -228,8 +628,33 @@ void setup() {
   color[1] = 0;
   color[2] = 0;
   enumValue = 0;
+
+#ifdef IoTGroupCount
+  IoTServer.joinGroup(1);
+#endif
+
+#ifdef IoTPersistentState
+  // Must be called after all the initial values have been set
+  loadState();
+#endif
 }
 
+#ifdef IoTRuleCount
+// The rules only see the values given to propertyChanged(), and unchanged
+// values are ignored, so all of them can be given every time (this must not
+// be called while a response is waiting to be sent, as the actions are
+// handled like any other message)
+void applyRules() {
+  for (;;) {
+    IoTServer.propertyChanged(Interface0, PropState, (float)onOff);
+    IoTServer.propertyChanged(Interface0, PropSampleEnum, (float)(int16_t)enumValue);
+    if (!IoTServer.processRules())
+      break;
+    handleMessage();
+  }
+}
+#endif
+
 void loop() {
   if (!wifiConnected) {
     if (!wifiConnecting) {
@@ -253,6 +678,32 @@ void loop() {
     return;
   }
 
+#ifdef IoTClientTimeout
+  IoTServer.tick();
+#endif
+#ifdef IoTPersistentState
+  saveState();
+#endif
+
+#ifdef IoTScheduleCount
+  // Scheduled scenes are handled just like MessageScene, but they are never
+  // answered
+  while (IoTServer.processSchedule())
+    handleMessage();
+#endif
+
+#ifdef IoTRuleCount
+  applyRules();
+#endif
+
+#ifdef IoTActuatorQueue
+  // Only one at a time, so that packets received meanwhile can still replace
+  // the values waiting in the queue
+  IoTActuation actuation;
+  if (IoTServer.nextActuation(actuation))
+    applyActuation(actuation);
+#endif
+
   uint16_t bytesInPacket = udpServer.parsePacket();
   if (!bytesInPacket)
     return;
@@ -270,17 +721,37 @@ void loop() {
   IoTServer.currentClientPort = port;
 
   uint8_t flushed = false;
+#ifdef IoTStreamingResponse
+  // flush() would send the chunks written so far
+  udpServer.beginPacket(ip, port);
+  flushed = true;
+#endif
   if (IoTServer.process(receivedBuffer, bytesRead)) {
     yield();
 
+#ifndef IoTStreamingResponse
     udpServer.flush();
     flushed = true;
+#endif
     if (!IoTServer.responseReady())
       handleMessage();
 
-    udpServer.beginPacket(ip, port);
-    udpServer.write(IoTServer.responseBuffer(), IoTServer.responseLength());
-    udpServer.endPacket();
+    // Group messages are only answered when the client asks for it
+    if (IoTServer.responseRequired()) {
+#ifdef IoTMulticastDiscovery
+      // delay() keeps the WiFi stack running
+      if (IoTServer.responseDelay())
+        delay(IoTServer.responseDelay());
+#endif
+#ifndef IoTStreamingResponse
+      udpServer.beginPacket(ip, port);
+      udpServer.write(IoTServer.responseBuffer(), IoTServer.responseLength());
+#endif
+      udpServer.endPacket();
+#ifdef IoTTrace
+      IoTServer.trace(IoTServer.TraceSent, IoTServer.responseLength());
+#endif
+    }
   }
 
   if (!flushed)
@@ -31,6 +31,7 @@
 #define IoTDCP_h
 
 #include <inttypes.h>
+#include <string.h>
 
 // Client message format (Request)
 // - StartOfPacket
@@ -57,6 +58,195 @@
 // - Payload bytes
 // - EndOfPacket
 
+// MessageScene payload (all operations are validated before the message is
+// given to the user, and must be applied all at once, in a single response)
+// - Operation count
+// - For each operation:
+//   - SceneExecute, followed by the same fields as IoTMessageExecute, or
+//   - SceneSetProperty, followed by the same fields as IoTMessageSetProperty
+// When validation fails, the response payload contains only the index of
+// the offending operation
+
+// Request views
+// - IoTDescribeEnumView, IoTExecuteView, IoTGetPropertyView, IoTSetPropertyView, IoTGetPropertyRangeView and IoTSetPropertyRangeView read payloadBuffer() (or a scene operation, past its operation byte) in place, as little endian, from any address
+// - process() has already validated the payload lengths of those messages (answering with ResponseInvalidPayload otherwise), so the views check nothing, and the user only checks valueLength()
+
+// MessageGetPropertyRange / MessageSetPropertyRange payload (a slice of an array property, such as some of the pixels of an LED strip)
+// - Interface index
+// - Property index
+// - Offset of the first element
+// - Element count
+// - Element values (MessageSetPropertyRange only, count * dataTypeSize bytes)
+// The range is validated before the message is given to the user (UnitUTF8Text properties do not accept ranges), and the response payload has the same layout
+
+// MessageGroup payload (only when IoTGroupCount is defined, sent to IoTMulticastGroupAddress:IoTPort, with InvalidClientId, and with the group sequence number as Client Sequence Number)
+// - Group Id (Low byte)
+// - Group Id (High byte)
+// - Flags
+// - Same payload as MessageScene
+// Every device that has joined the group applies it, but only answers when Flags contains GroupFlagAckRequested (invalid messages are silently discarded)
+
+// MessageOpenStream payload (only when IoTSetpointStreamCount is defined, binding a writable property to a stream)
+// - Interface index
+// - Property index
+// - Report interval (Low byte)
+// - Report interval (High byte)
+// The response payload is the Stream id, and MessageCloseStream (payload: Stream id) closes it, answering with its final report
+
+// Stream frame (never answered, and only accepted from the address of the client that opened the stream, when it is newer than the last one accepted)
+// - StartOfStreamFrame
+// - Stream id
+// - Stream Sequence Number (Low byte)
+// - Stream Sequence Number (High byte)
+// - Sender time (Low byte)
+// - Sender time (High byte)
+// - Value (dataTypeSize * elementCount bytes, the whole property)
+// - EndOfPacket
+
+// ServerMessageStreamReport payload (sent every Report interval accepted frames, 0 = never)
+// - Stream id
+// - Stream Sequence Number of the last frame accepted (2 bytes)
+// - Received frames (4 bytes)
+// - Lost frames (4 bytes)
+// - Late frames (4 bytes)
+// - Jitter (2 bytes, milliseconds, as in RFC 3550, computed from Sender time)
+// All of them little endian
+
+// MessagePing payload (only when IoTScheduleCount is defined, answered by IoTServer for NTP-like time synchronization; MessagePing with any other payload is still handled by the user)
+// - Client clock, T1 (4 bytes, little endian)
+// The response payload is T1, followed by the device clock (IoTMillis()) when the request was processed, T2, and when the response was built, T3 (4 bytes each, little endian)
+// With T4 being the client clock when the response arrives, the round trip is (T4 - T1) - (T3 - T2), and device clock - client clock is ((T2 - T1) + (T3 - T4)) / 2
+
+// MessageScheduleScene payload (only when IoTScheduleCount is defined)
+// - Target time (4 bytes, little endian, device clock)
+// - Same payload as MessageScene (up to IoTScheduleLength bytes)
+// The scene is validated and stored right away (scenes whose target time has already passed are applied right away), and the response payload is its Schedule slot
+
+// MessageScheduleTimer payload (only when IoTScheduleCount is defined, sharing the schedule slots with MessageScheduleScene, without clock synchronization)
+// - Delay (4 bytes, little endian, milliseconds from now, < 0x80000000)
+// - Interval (4 bytes, little endian, milliseconds, < 0x80000000, 0 to apply the scene only once)
+// - Same payload as MessageScene
+// The response payload is its Schedule slot, and recurring scenes stay in their slots, even after the client that scheduled them is gone (occurrences missed while the host was busy are skipped)
+
+// MessageListSchedule response payload (the request has no payload)
+// - For each slot in use, in slot order:
+//   - Schedule slot
+//   - Delay until the scene is due (4 bytes, little endian, milliseconds, 0 when it is already due)
+//   - Interval (4 bytes, little endian)
+
+// MessageCancelSchedule payload (ResponseInvalidPayload when the slot is not in use)
+// - Schedule slot
+
+// MessageSetRule payload (only when IoTRuleCount is defined)
+// - Code length
+// - Code
+// - Same payload as MessageScene (code and scene must fit in IoTRuleLength bytes)
+// Both are validated right away, and the response payload is its Rule slot; the scene is applied when the condition becomes true (it must become false before it can be applied again)
+
+// Rule code (evaluated on a stack of up to RuleStackDepth floats, reading up to IoTRuleInputCount properties, shared by all the rules)
+// - RuleLoad, Interface index, Property index (pushes the first element of a readable property)
+// - RuleConstant, Value (4 bytes, little endian float)
+// - RuleAdd, RuleSubtract, RuleMultiply, RuleLess, RuleLessOrEqual, RuleGreater, RuleGreaterOrEqual, RuleEqual, RuleNotEqual, RuleAnd or RuleOr (pop two values, push the result, with true = 1 and false = 0)
+// - RuleNot (replaces the value on top of the stack)
+// - RuleEnd (the condition is true when the only value left is not 0)
+
+// MessageDeleteRule payload (ResponseInvalidPayload when the slot is not in use)
+// - Rule slot
+
+// MessageGetSeries payload (only when IoTTimeSeries is defined, validated before it is given to the user, who answers it with writeResponseSeries())
+// - Interface index
+// - Property index
+// - Encoding (SeriesPlain or SeriesCompressed)
+// - Since (4 bytes, little endian, the timestamp of the newest sample the client already has)
+
+// MessageGetSeries response payload (only as many samples as fit in IoTMaxPayloadLength, so the client asks for the rest later)
+// - Interface index
+// - Property index
+// - Data type
+// - Encoding
+// - Sample count (2 bytes, little endian)
+// - SeriesPlain: Timestamp (4 bytes) and Value (dataTypeSize bytes), both little endian, for each sample
+// - SeriesCompressed: a bit stream (most significant bit first, padded with zeros), with the first Timestamp (32 bits) and Value (integers as a zigzag varint, floats as their 32 or 64 bits), followed by, for each other sample:
+//   - Timestamp: zigzag varint of the delta of deltas (the first delta is taken against 0)
+//   - Integers: zigzag varint of the difference from the previous value (signed values are sign extended to 64 bits first)
+//   - Floats (as in Facebook's Gorilla): the bits XORed with the previous value: 0 when they are equal, or 1, followed by either 0 and the meaningful bits, when they fit in the previous window, or 1, the count of leading zeros (5 bits), the count of meaningful bits minus 1 (5 bits for DataTypeFloat32, 6 bits for DataTypeFloat64) and the meaningful bits
+//   - Varints are 7 bits per byte, least significant group first, with the most significant bit of each byte telling whether there are more bytes
+
+// MessageGetAggregates payload (only when IoTAggregateCount is defined, for the properties listed in IoTAggregates, each one over a tumbling window, fed by propertySampled())
+// - Interface index
+// - Property index
+// The response is ResponseInvalidInterfaceProperty when the property has no aggregates
+
+// MessageGetAggregates response payload
+// - Interface index
+// - Property index
+// - For each aggregate of that property, in IoTAggregates order, its last completed window:
+//   - Window (4 bytes)
+//   - Age (4 bytes, milliseconds since the end of that window)
+//   - Count (4 bytes, 0 when no samples arrived during that window, or when no windows have been completed yet)
+//   - Minimum, Maximum and Mean (4 bytes each, float)
+// All of them little endian
+
+// MessageQueryDevice payload (broadcast, or sent to IoTMulticastGroupAddress:IoTPort)
+// - Empty, or an estimate of how many devices will answer:
+// - Fleet size (Low byte)
+// - Fleet size (High byte)
+// When IoTMulticastDiscovery is defined and the estimate is present, the response must only be sent after responseDelay() milliseconds, and clients should de-duplicate responses by the device UUID
+
+// Encrypted messages (only when IoTEncryptionRequired is defined)
+// - MessageHandshake payload: Client nonce (8 bytes), and its response payload: Client Id, Server nonce (8 bytes)
+// - After the handshake, the password is no longer sent, and the payload of every message with a client id is sealed with ChaCha20-Poly1305, using a session key derived from IoTEncryptionKey and both nonces
+// - Request payload: Ciphertext, Tag (16 bytes)
+//   Nonce: 0x00, Client Sequence Number (Low byte), Client Sequence Number (High byte), 0x00...
+//   Associated data: Message type, Client Id, Client Sequence Number (Low byte), Client Sequence Number (High byte)
+// - Response payload: Response counter (4 bytes, little endian), Ciphertext, Tag (16 bytes)
+//   Nonce: 0x01, Response counter (4 bytes, little endian), 0x00...
+//   Associated data: Message type, Client Id, Client Sequence Number (Low byte), Client Sequence Number (High byte), Response code
+// - MessageGroup payload: Group Id (Low byte), Group Id (High byte), Group epoch (Low byte), Group epoch (High byte), Ciphertext, Tag (16 bytes), sealed with a key derived from IoTEncryptionKey and Group Id
+//   Nonce: 0x02, Client Sequence Number (2 bytes), Group Id (2 bytes), Group epoch (2 bytes), 0x00...
+//   Response nonce: 0x03, Response counter (4 bytes), first 7 bytes of IoTUuid
+// - Requests that fail authentication, or whose payload is longer than IoTMaxPayloadLength, are silently discarded
+// - A session only covers 65535 sequence numbers: the request that would reuse a nonce is answered with ResponseUnknownClient, and the client must handshake again
+
+// Extended client message format (only when IoTExtendedClientId is defined)
+// - StartOfExtendedPacket
+// - Message type
+// - Client Id (Low byte)
+// - Client Id (High byte)
+// - Same fields as a regular request, from Client Sequence Number on
+// Responses (along with the client id in the response to MessageHandshake) and the associated data of encrypted messages carry both Client Id bytes
+// InvalidClientId becomes 0xFFFF (0xFF is still accepted in regular requests), and clients that handshake using regular requests only get client ids below 255
+
+// Persistent state (only when IoTPersistentState is defined)
+// - saveState() serializes the name, the password, the client table and the group sequence numbers into stateSize() bytes, and loadState() restores them after begin(), so clients do not need to handshake again after a restart
+// - isStateDirty() tells whether anything changed since the last saveState() (every new sequence number does)
+// - When IoTEncryptionRequired is defined, the client table is not saved, and encrypted clients must handshake again after a restart
+
+// Handshake cookies (only when IoTHandshakeCookies is defined)
+// - MessageHandshake without a cookie does not claim a client slot, and is answered with ResponseCookieRequired, whose payload is Cookie (8 bytes)
+// - The client repeats MessageHandshake, with Cookie (8 bytes) appended to its payload (after the client nonce, when IoTEncryptionRequired is defined)
+// - Cookies expire after one or two periods of IoTHandshakeCookieTime milliseconds, and are answered with ResponseCookieRequired again
+
+// Property plane (only when IoTPropertyPlane is defined)
+// - A block of shared memory, with propertyPlaneSize() bytes: a header slot, followed by one IoTPropertyPlaneSlotLength-byte slot, protected by a seqlock, for each property of each interface in IoTInterfaces (in order)
+// - Driver processes write values with publishProperty(), without any system calls, and MessageGetProperty requests for published properties are answered without bothering the user
+
+// Actuator queue (only when IoTActuatorQueue is defined)
+// - Instead of applying MessageExecute, MessageSetProperty and scene operations right away, handleMessage() validates them, queues them with queueCommand()/queueProperty() and answers, while an actuator thread applies them with nextActuation()
+// - Each property (and each interface, for commands) gets its own mailbox, out of IoTActuatorQueue, and a value queued while the previous one is still waiting replaces it, so only the latest one is applied
+
+// Tracing (only when IoTTrace is defined)
+// - The last IoTTrace events of the requests being processed are kept in a ring buffer, read with traceCount() and tracedEvent()
+// - When IoTTraceProbes is also defined, every event also fires the USDT probe iotdcp:event(type, message, clientId, sequenceNumber, argument, timestamp) (requires <sys/sdt.h>)
+
+// Streamed response (only when IoTStreamingResponse is defined, and the response does not fit in a single IoTStreamingChunkLength chunk)
+// - Same header as a regular response, with 0xFF as Response code and 0xFFFF as Payload length
+// - Payload bytes
+// - Response code
+// - Payload length (Low byte)
+// - Payload length (High byte)
+// - EndOfPacket
+
 #ifndef countof
 #define countof(X) (sizeof(X) / sizeof((X)[0]))
 #endif
@@ -89,9 +279,15 @@
 #error("IoTClientCount <= 0")
 #endif
 
+#ifdef IoTExtendedClientId
+#if (IoTClientCount > 65535)
+#error("IoTClientCount > 65535")
+#endif
+#else
 #if (IoTClientCount > 255)
 #error("IoTClientCount > 255")
 #endif
+#endif
 
 #ifndef IoTMaxPayloadLength
 #define IoTMaxPayloadLength 512
@@ -148,6 +344,264 @@
 #error("IoTMaxPasswordLength == 0")
 #endif
 
+#ifdef IoTStreamingResponse
+#ifdef IoTEncryptionRequired
+#error("IoTStreamingResponse cannot be used along with IoTEncryptionRequired")
+#endif
+#ifndef IoTStreamingChunkLength
+#define IoTStreamingChunkLength 32
+#endif
+#if (IoTStreamingChunkLength < 16)
+#error("IoTStreamingChunkLength < 16")
+#endif
+#if (IoTStreamingChunkLength > 1024)
+#error("IoTStreamingChunkLength > 1024")
+#endif
+#endif
+
+#ifdef IoTGroupCount
+#if (IoTGroupCount <= 0)
+#error("IoTGroupCount <= 0")
+#endif
+#if (IoTGroupCount > 32)
+#error("IoTGroupCount > 32")
+#endif
+#endif
+
+#ifdef IoTSetpointStreamCount
+#if (IoTSetpointStreamCount <= 0)
+#error("IoTSetpointStreamCount <= 0")
+#endif
+#if (IoTSetpointStreamCount > 255)
+#error("IoTSetpointStreamCount > 255")
+#endif
+#ifndef IoTMillis
+#error("IoTMillis not defined")
+#endif
+#endif
+
+#ifdef IoTScheduleCount
+#if (IoTScheduleCount <= 0)
+#error("IoTScheduleCount <= 0")
+#endif
+#if (IoTScheduleCount > 255)
+#error("IoTScheduleCount > 255")
+#endif
+#ifndef IoTMillis
+#error("IoTMillis not defined")
+#endif
+#ifndef IoTScheduleLength
+#define IoTScheduleLength 32
+#endif
+#if (IoTScheduleLength < 4)
+#error("IoTScheduleLength < 4")
+#endif
+#if (IoTScheduleLength > 1024)
+#error("IoTScheduleLength > 1024")
+#endif
+#if ((IoTScheduleCount * 9) > IoTMaxPayloadLength)
+#error("IoTScheduleCount * 9 > IoTMaxPayloadLength")
+#endif
+#endif
+
+#ifdef IoTRuleCount
+#if (IoTRuleCount <= 0)
+#error("IoTRuleCount <= 0")
+#endif
+#if (IoTRuleCount > 255)
+#error("IoTRuleCount > 255")
+#endif
+#ifndef IoTRuleInputCount
+#define IoTRuleInputCount 8
+#endif
+#if (IoTRuleInputCount <= 0)
+#error("IoTRuleInputCount <= 0")
+#endif
+#if (IoTRuleInputCount > 32)
+#error("IoTRuleInputCount > 32")
+#endif
+#ifndef IoTRuleLength
+#define IoTRuleLength 32
+#endif
+#if (IoTRuleLength < 8)
+#error("IoTRuleLength < 8")
+#endif
+#if (IoTRuleLength > 255)
+#error("IoTRuleLength > 255")
+#endif
+#endif
+
+#ifdef IoTAggregateCount
+#if (IoTAggregateCount <= 0)
+#error("IoTAggregateCount <= 0")
+#endif
+#if (IoTAggregateCount > 255)
+#error("IoTAggregateCount > 255")
+#endif
+#ifndef IoTMillis
+#error("IoTMillis not defined")
+#endif
+#if ((2 + (IoTAggregateCount * 24)) > IoTMaxPayloadLength)
+#error("2 + (IoTAggregateCount * 24) > IoTMaxPayloadLength")
+#endif
+#endif
+
+#ifdef IoTPropertyCacheCount
+#if (IoTPropertyCacheCount <= 0)
+#error("IoTPropertyCacheCount <= 0")
+#endif
+#if (IoTPropertyCacheCount > 255)
+#error("IoTPropertyCacheCount > 255")
+#endif
+#ifndef IoTMillis
+#error("IoTMillis not defined")
+#endif
+#ifndef IoTPropertyCacheTime
+#define IoTPropertyCacheTime 1000
+#endif
+#ifndef IoTPropertyCacheValueLength
+#define IoTPropertyCacheValueLength 8
+#endif
+#if (IoTPropertyCacheValueLength < 1)
+#error("IoTPropertyCacheValueLength < 1")
+#endif
+#if (IoTPropertyCacheValueLength > 64)
+#error("IoTPropertyCacheValueLength > 64")
+#endif
+#endif
+
+#ifdef IoTHandshakeCookies
+#ifndef IoTRandom32
+#error("IoTRandom32 not defined")
+#endif
+#ifndef IoTMillis
+#error("IoTMillis not defined")
+#endif
+#ifndef IoTHandshakeCookieTime
+#define IoTHandshakeCookieTime 10000
+#endif
+#if (IoTHandshakeCookieTime < 1000)
+#error("IoTHandshakeCookieTime < 1000")
+#endif
+#endif
+
+#ifdef IoTClientTimeout
+#ifndef IoTMillis
+#error("IoTMillis not defined")
+#endif
+#ifndef IoTTimerTickTime
+#define IoTTimerTickTime 1000
+#endif
+#ifndef IoTTimerWheelSlots
+#define IoTTimerWheelSlots 16
+#endif
+#if (IoTTimerTickTime < 10)
+#error("IoTTimerTickTime < 10")
+#endif
+#if ((IoTClientTimeout / IoTTimerTickTime) < 1)
+#error("IoTClientTimeout < IoTTimerTickTime")
+#endif
+#if ((IoTClientTimeout / IoTTimerTickTime) > 32767)
+#error("IoTClientTimeout / IoTTimerTickTime > 32767")
+#endif
+#if (IoTTimerWheelSlots < 2 || IoTTimerWheelSlots > 256 || (IoTTimerWheelSlots & (IoTTimerWheelSlots - 1)))
+#error("IoTTimerWheelSlots must be a power of 2 between 2 and 256")
+#endif
+#endif
+
+#if defined(IoTPropertyPlane) || defined(IoTActuatorQueue)
+#ifndef IoTMemoryBarrier
+#ifdef __GNUC__
+#define IoTMemoryBarrier() __sync_synchronize()
+#else
+#error("IoTMemoryBarrier not defined")
+#endif
+#endif
+#endif
+
+#ifdef IoTActuatorQueue
+#if (IoTActuatorQueue < 1 || IoTActuatorQueue > 256 || (IoTActuatorQueue & (IoTActuatorQueue - 1)))
+#error("IoTActuatorQueue must be a power of 2 between 1 and 256")
+#endif
+#ifndef IoTActuatorValueLength
+#define IoTActuatorValueLength 8
+#endif
+#if (IoTActuatorValueLength < 1)
+#error("IoTActuatorValueLength < 1")
+#endif
+#if (IoTActuatorValueLength > 255)
+#error("IoTActuatorValueLength > 255")
+#endif
+#endif
+
+#ifdef IoTTrace
+#if (IoTTrace < 2 || IoTTrace > 65536 || (IoTTrace & (IoTTrace - 1)))
+#error("IoTTrace must be a power of 2 between 2 and 65536")
+#endif
+#ifndef IoTTraceTimestamp
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IoTTraceTimestamp() __builtin_ia32_rdtsc()
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define IoTTraceTimestamp() __rdtsc()
+#elif defined(IoTMillis)
+#define IoTTraceTimestamp() IoTMillis()
+#else
+#error("IoTTraceTimestamp not defined")
+#endif
+#endif
+#ifdef IoTTraceProbes
+#include <sys/sdt.h>
+#define TraceProbe(EVENT) DTRACE_PROBE6(iotdcp, event, (EVENT)->type, (EVENT)->message, (EVENT)->clientId, (EVENT)->sequenceNumber, (EVENT)->argument, (EVENT)->timestamp)
+#else
+#define TraceProbe(EVENT) ((void)(EVENT))
+#endif
+#endif
+
+#ifdef IoTPropertyPlane
+#ifndef IoTPropertyPlaneSlotLength
+#define IoTPropertyPlaneSlotLength 64
+#endif
+#if (IoTPropertyPlaneSlotLength < 32 || IoTPropertyPlaneSlotLength > 256 || (IoTPropertyPlaneSlotLength & (IoTPropertyPlaneSlotLength - 1)))
+#error("IoTPropertyPlaneSlotLength must be a power of 2 between 32 and 256")
+#endif
+#endif
+
+#ifdef IoTMulticastDiscovery
+#ifndef IoTRandom32
+#error("IoTRandom32 not defined")
+#endif
+#ifndef IoTDiscoverySlotTime
+#define IoTDiscoverySlotTime 2
+#endif
+#ifndef IoTDiscoveryMaxDelay
+#define IoTDiscoveryMaxDelay 2000
+#endif
+#if (IoTDiscoverySlotTime < 1)
+#error("IoTDiscoverySlotTime < 1")
+#endif
+#if (IoTDiscoveryMaxDelay < 1 || IoTDiscoveryMaxDelay > 60000)
+#error("IoTDiscoveryMaxDelay must be between 1 and 60000")
+#endif
+#endif
+
+#if defined(IoTExternalResponseBuffer) && defined(IoTStreamingResponse)
+#error("IoTExternalResponseBuffer cannot be used along with IoTStreamingResponse")
+#endif
+
+#if defined(IoTSetpointStreamCount) && defined(IoTEncryptionRequired)
+#error("IoTSetpointStreamCount cannot be used along with IoTEncryptionRequired")
+#endif
+
+#ifdef IoTEncryptionRequired
+#ifndef IoTEncryptionKey
+#error("IoTEncryptionKey not defined")
+#endif
+#ifndef IoTRandom32
+#error("IoTRandom32 not defined")
+#endif
+#endif
+
 // 2570 = 0x0A0A (at the present date it is not assigned to any services)
 #define IoTPort 2570
 
@@ -162,6 +616,20 @@ public:
 		TypeOpenClose = 0x03,
 		TypeOpenCloseStop = 0x04
 	};
+
+	// Amount of commands accepted by MessageExecute for each interface type
+	static uint8_t commandCount(uint8_t type) {
+		switch (type) {
+		case TypeOnOff:
+		case TypeOpenClose:
+			return 2;
+		case TypeOnOffSimple:
+			return 1;
+		case TypeOpenCloseStop:
+			return 3;
+		}
+		return 0;
+	}
 };
 
 struct _IoTProperty {
@@ -242,6 +710,29 @@ public:
 		IECZebi = 0x79, // 2^70
 		IECYobi = 0x78  // 2^80
 	};
+
+	// Size in bytes of a single element of the given data type (0 for unknown types)
+	static uint8_t dataTypeSize(uint8_t dataType) {
+		switch (dataType) {
+		case DataTypeS8:
+		case DataTypeU8:
+			return 1;
+		case DataTypeS16:
+		case DataTypeU16:
+			return 2;
+		case DataTypeRGBTriplet:
+			return 3;
+		case DataTypeS32:
+		case DataTypeU32:
+		case DataTypeFloat32:
+			return 4;
+		case DataTypeS64:
+		case DataTypeU64:
+		case DataTypeFloat64:
+			return 8;
+		}
+		return 0;
+	}
 };
 
 struct IoTEnumDescriptor8 {
@@ -282,6 +773,13 @@ public:
 	const IoTPropertyDescriptor* propertyDescriptors;
 };
 
+struct IoTAggregateDescriptor {
+public:
+	uint8_t interfaceIndex;
+	uint8_t propertyIndex;
+	uint32_t window; // Milliseconds (> 0 and < 0x80000000)
+};
+
 struct _IoTInterfaceSensor {
 public:
 	enum _Properties {
@@ -397,219 +895,2855 @@ public:
 	uint8_t propertyValue[1];
 };
 
-#define StartOfPacket 0x55
-#define EndOfPacket 0x33
-#define ResponseHeaderLength 8
-#define RequestHeaderLength 8
-#define EndOfPacketLength 1
-
-const uint8_t IoTServerCategoryUuid[] = IoTCategoryUuid; // Element 0 must be the least significant, whereas element 15 must be the most significant
-const uint8_t IoTServerUuid[] = IoTUuid; // Element 0 must be the least significant, whereas element 15 must be the most significant
-extern const IoTInterfaceDescriptor IoTInterfaces[IoTInterfaceCount];
+#if (defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)) || defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM) || defined(_M_ARM64)
+#define LittleEndianHost
+#endif
 
-class _IoTServer {
+class _IoTLittleEndian {
 public:
-	enum _CliendIds {
-		InvalidClientId = 0xFF
-	};
-
-	enum _SequenceNumbers {
-		MaximumSequenceNumber = 0xFFFF
-	};
-
-	enum _Messages {
-		MessageQueryDevice = 0x00,
-		MessageDescribeInterface = 0x01,
-		MessageDescribeEnum = 0x02,
-		MessageChangeName = 0x03,
-		MessageChangePassword = 0x04,
-		MessageHandshake = 0x05,
-		MessagePing = 0x06,
-		MessageReset = 0x07,
-		MessageGoodBye = 0x08,
-		MessageExecute = 0x09,
-		MessageGetProperty = 0x0A,
-		MessageSetProperty = 0x0B,
-		MessageMax = 0x0B
-	};
-
-	enum _ServerMessages {
-		ServerMessagePropertyChange = 0x80
-	};
-
-	enum _Replies {
-		ResponseOK = 0x00,
-		ResponseDeviceError = 0x01,
-		ResponseUnknownClient = 0x02,
-		ResponseUnsupportedMessage = 0x03,
-		ResponsePayloadTooLarge = 0x04,
-		ResponseInvalidPayload = 0x05,
-		ResponseEndOfPacketNotFound = 0x06,
-		ResponseWrongPassword = 0x07,
-		ResponseNameReadOnly = 0x08,
-		ResponsePasswordReadOnly = 0x09,
-		ResponseCannotChangeNameNow = 0x0A,
-		ResponseCannotChangePasswordNow = 0x0B,
-		ResponseInvalidInterface = 0x0C,
-		ResponseInvalidInterfaceCommand = 0x0D,
-		ResponseInvalidInterfaceProperty = 0x0E,
-		ResponseInterfacePropertyReadOnly = 0x0F,
-		ResponseInterfacePropertyWriteOnly = 0x10,
-		ResponseInvalidInterfacePropertyValue = 0x11,
-		ResponseTryAgainLater = 0x12,
-		ResponseMax = 0x20
-	};
-
-	enum _Flags {
-		FlagNameReadOnly = 0x01,
-		FlagPasswordProtected = 0x02,
-		FlagPasswordReadOnly = 0x04,
-		FlagResetSupported = 0x08,
-		FlagEncryptionRequired = 0x10
-	};
-
-private:
-	struct _IoTClient {
-	public:
-		uint16_t sequenceNumber;
-		uint16_t port;
-		uint32_t ip;
-	};
-
-	static _IoTClient clients[IoTClientCount];
-
-	static uint8_t nameLength;
-#ifdef IoTNameReadOnly
-	static const uint8_t* name;
+	// On little endian hosts, memcpy() becomes a single (unaligned) load
+	inline static uint16_t load16(const uint8_t* srcBuffer) {
+#ifdef LittleEndianHost
+		uint16_t value;
+		memcpy(&value, srcBuffer, sizeof(value));
+		return value;
 #else
-	static const uint8_t name[IoTMaxNameLength];
+		return ((uint16_t)srcBuffer[0]) | (((uint16_t)srcBuffer[1]) << 8);
 #endif
+	}
 
-#ifndef IoTNoPassword
-	static uint8_t passwordLength;
-#ifdef IoTPasswordReadOnly
-	static const uint8_t* password;
+	inline static uint32_t load32(const uint8_t* srcBuffer) {
+#ifdef LittleEndianHost
+		uint32_t value;
+		memcpy(&value, srcBuffer, sizeof(value));
+		return value;
 #else
-	static uint8_t password[IoTMaxPasswordLength];
+		return ((uint32_t)srcBuffer[0]) | (((uint32_t)srcBuffer[1]) << 8) | (((uint32_t)srcBuffer[2]) << 16) | (((uint32_t)srcBuffer[3]) << 24);
 #endif
+	}
+
+	inline static uint64_t load64(const uint8_t* srcBuffer) {
+#ifdef LittleEndianHost
+		uint64_t value;
+		memcpy(&value, srcBuffer, sizeof(value));
+		return value;
+#else
+		return ((uint64_t)load32(srcBuffer)) | (((uint64_t)load32(srcBuffer + 4)) << 32);
 #endif
+	}
 
-	static uint8_t clientId;
-	static uint16_t clientSequenceNumber;
-	static uint8_t clientMessageRepeated;
-	static uint8_t clientMessage;
-	static const uint8_t* clientPayloadBuffer;
-	static uint16_t clientPayloadLength;
-	static uint8_t clientResponseReady;
+	inline static float loadFloat(const uint8_t* srcBuffer) {
+		const uint32_t bits = load32(srcBuffer);
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
 
-	static uint16_t bufferOffset;
-	static uint8_t buffer[ResponseHeaderLength + IoTMaxPayloadLength + EndOfPacketLength];
+	inline static double loadDouble(const uint8_t* srcBuffer) {
+		const uint64_t bits = load64(srcBuffer);
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
 
-	static void buildQueryDeviceResponse() {
-		uint8_t flags = 0;
-#ifndef IoTNoPassword
-		flags |= FlagPasswordProtected;
+	// Big endian hosts swap bytes in registers (which loops over arrays can
+	// vectorize), and little endian hosts just store them
+	inline static void store16(uint8_t* dstBuffer, uint16_t value) {
+#if defined(LittleEndianHost) || defined(__GNUC__)
+#ifndef LittleEndianHost
+		value = __builtin_bswap16(value);
 #endif
-#ifdef IoTPasswordReadOnly
-		flags |= FlagPasswordReadOnly;
+		memcpy(dstBuffer, &value, sizeof(value));
+#else
+		dstBuffer[0] = (uint8_t)value;
+		dstBuffer[1] = (uint8_t)(value >> 8);
 #endif
-#ifdef IoTResetSupported
-		flags |= FlagResetSupported;
+	}
+
+	inline static void store32(uint8_t* dstBuffer, uint32_t value) {
+#if defined(LittleEndianHost) || defined(__GNUC__)
+#ifndef LittleEndianHost
+		value = __builtin_bswap32(value);
 #endif
-#ifdef IoTNameReadOnly
-		flags |= FlagNameReadOnly;
+		memcpy(dstBuffer, &value, sizeof(value));
+#else
+		dstBuffer[0] = (uint8_t)value;
+		dstBuffer[1] = (uint8_t)(value >> 8);
+		dstBuffer[2] = (uint8_t)(value >> 16);
+		dstBuffer[3] = (uint8_t)(value >> 24);
 #endif
-#ifdef IoTEncryptionRequired
-		flags |= FlagEncryptionRequired;
+	}
+
+	inline static void store64(uint8_t* dstBuffer, uint64_t value) {
+#if defined(LittleEndianHost) || defined(__GNUC__)
+#ifndef LittleEndianHost
+		value = __builtin_bswap64(value);
 #endif
-		writeResponse(flags);
+		memcpy(dstBuffer, &value, sizeof(value));
+#else
+		store32(dstBuffer, (uint32_t)value);
+		store32(dstBuffer + 4, (uint32_t)(value >> 32));
+#endif
+	}
+};
 
-		writeResponse(IoTServerCategoryUuid, 16);
+struct IoTRGBTriplet {
+public:
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+};
 
-		writeResponse(IoTServerUuid, 16);
+// Maps every type accepted by writeResponseProperty() to its DataType (other
+// types do not compile), along with the way it is stored in a response
+template<typename T> struct _IoTDataType;
 
-		writeResponse(IoTInterfaceCount);
+template<> struct _IoTDataType<int8_t> {
+	enum { Type = 0x00 }; // DataTypeS8
+	inline static void store(uint8_t* dstBuffer, int8_t value) { *dstBuffer = (uint8_t)value; }
+};
 
-		for (uint8_t i = 0; i < IoTInterfaceCount; i++)
-			writeResponse(IoTInterfaces[i].type);
+template<> struct _IoTDataType<int16_t> {
+	enum { Type = 0x01 }; // DataTypeS16
+	inline static void store(uint8_t* dstBuffer, int16_t value) { _IoTLittleEndian::store16(dstBuffer, (uint16_t)value); }
+};
 
-		if (!nameLength || !name) {
+template<> struct _IoTDataType<int32_t> {
+	enum { Type = 0x02 }; // DataTypeS32
+	inline static void store(uint8_t* dstBuffer, int32_t value) { _IoTLittleEndian::store32(dstBuffer, (uint32_t)value); }
+};
+
+template<> struct _IoTDataType<int64_t> {
+	enum { Type = 0x03 }; // DataTypeS64
+	inline static void store(uint8_t* dstBuffer, int64_t value) { _IoTLittleEndian::store64(dstBuffer, (uint64_t)value); }
+};
+
+template<> struct _IoTDataType<uint8_t> {
+	enum { Type = 0x04 }; // DataTypeU8
+	inline static void store(uint8_t* dstBuffer, uint8_t value) { *dstBuffer = value; }
+};
+
+template<> struct _IoTDataType<uint16_t> {
+	enum { Type = 0x05 }; // DataTypeU16
+	inline static void store(uint8_t* dstBuffer, uint16_t value) { _IoTLittleEndian::store16(dstBuffer, value); }
+};
+
+template<> struct _IoTDataType<uint32_t> {
+	enum { Type = 0x06 }; // DataTypeU32
+	inline static void store(uint8_t* dstBuffer, uint32_t value) { _IoTLittleEndian::store32(dstBuffer, value); }
+};
+
+template<> struct _IoTDataType<uint64_t> {
+	enum { Type = 0x07 }; // DataTypeU64
+	inline static void store(uint8_t* dstBuffer, uint64_t value) { _IoTLittleEndian::store64(dstBuffer, value); }
+};
+
+template<> struct _IoTDataType<float> {
+	enum { Type = 0x08 }; // DataTypeFloat32
+	inline static void store(uint8_t* dstBuffer, float value) {
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		_IoTLittleEndian::store32(dstBuffer, bits);
+	}
+};
+
+template<> struct _IoTDataType<double> {
+	enum { Type = 0x09 }; // DataTypeFloat64
+	inline static void store(uint8_t* dstBuffer, double value) {
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		_IoTLittleEndian::store64(dstBuffer, bits);
+	}
+};
+
+template<> struct _IoTDataType<IoTRGBTriplet> {
+	enum { Type = 0x0A }; // DataTypeRGBTriplet
+	inline static void store(uint8_t* dstBuffer, const IoTRGBTriplet& value) { memcpy(dstBuffer, &value, sizeof(value)); }
+};
+
+class IoTDescribeEnumView {
+private:
+	const uint8_t* payload;
+
+public:
+	inline IoTDescribeEnumView(const uint8_t* payload) : payload(payload) {
+	}
+
+	inline uint8_t interfaceIndex() const {
+		return payload[0];
+	}
+
+	inline uint8_t propertyIndex() const {
+		return payload[1];
+	}
+};
+
+class IoTExecuteView {
+private:
+	const uint8_t* payload;
+
+public:
+	inline IoTExecuteView(const uint8_t* payload) : payload(payload) {
+	}
+
+	inline uint8_t interfaceIndex() const {
+		return payload[0];
+	}
+
+	inline uint8_t interfaceCommand() const {
+		return payload[1];
+	}
+};
+
+class IoTGetPropertyView {
+private:
+	const uint8_t* payload;
+
+public:
+	inline IoTGetPropertyView(const uint8_t* payload) : payload(payload) {
+	}
+
+	inline uint8_t interfaceIndex() const {
+		return payload[0];
+	}
+
+	inline uint8_t propertyIndex() const {
+		return payload[1];
+	}
+};
+
+class IoTSetPropertyView {
+private:
+	const uint8_t* payload;
+
+public:
+	inline IoTSetPropertyView(const uint8_t* payload) : payload(payload) {
+	}
+
+	inline uint8_t interfaceIndex() const {
+		return payload[0];
+	}
+
+	inline uint8_t propertyIndex() const {
+		return payload[1];
+	}
+
+	inline uint16_t valueLength() const {
+		return _IoTLittleEndian::load16(payload + 2);
+	}
+
+	inline const uint8_t* value() const {
+		return payload + 4;
+	}
+
+	inline uint8_t value8() const {
+		return payload[4];
+	}
+
+	inline uint16_t value16() const {
+		return _IoTLittleEndian::load16(payload + 4);
+	}
+
+	inline uint32_t value32() const {
+		return _IoTLittleEndian::load32(payload + 4);
+	}
+
+	inline uint64_t value64() const {
+		return _IoTLittleEndian::load64(payload + 4);
+	}
+
+	inline float valueFloat() const {
+		return _IoTLittleEndian::loadFloat(payload + 4);
+	}
+
+	inline double valueDouble() const {
+		return _IoTLittleEndian::loadDouble(payload + 4);
+	}
+};
+
+class IoTGetPropertyRangeView {
+private:
+	const uint8_t* payload;
+
+public:
+	inline IoTGetPropertyRangeView(const uint8_t* payload) : payload(payload) {
+	}
+
+	inline uint8_t interfaceIndex() const {
+		return payload[0];
+	}
+
+	inline uint8_t propertyIndex() const {
+		return payload[1];
+	}
+
+	inline uint8_t offset() const {
+		return payload[2];
+	}
+
+	inline uint8_t count() const {
+		return payload[3];
+	}
+};
+
+class IoTSetPropertyRangeView {
+private:
+	const uint8_t* payload;
+
+public:
+	inline IoTSetPropertyRangeView(const uint8_t* payload) : payload(payload) {
+	}
+
+	inline uint8_t interfaceIndex() const {
+		return payload[0];
+	}
+
+	inline uint8_t propertyIndex() const {
+		return payload[1];
+	}
+
+	inline uint8_t offset() const {
+		return payload[2];
+	}
+
+	inline uint8_t count() const {
+		return payload[3];
+	}
+
+	// count() elements, already little endian
+	inline const uint8_t* value() const {
+		return payload + 4;
+	}
+};
+
+class IoTGetSeriesView {
+private:
+	const uint8_t* payload;
+
+public:
+	inline IoTGetSeriesView(const uint8_t* payload) : payload(payload) {
+	}
+
+	inline uint8_t interfaceIndex() const {
+		return payload[0];
+	}
+
+	inline uint8_t propertyIndex() const {
+		return payload[1];
+	}
+
+	inline uint8_t encoding() const {
+		return payload[2];
+	}
+
+	inline uint32_t since() const {
+		return _IoTLittleEndian::load32(payload + 3);
+	}
+};
+
+#define StartOfPacket 0x55
+#define StartOfExtendedPacket 0x56
+#define StartOfStreamFrame 0x57
+#define EndOfPacket 0x33
+#define StreamFrameHeaderLength 6
+#define StreamReportLength 17
+#define RuleStackDepth 8
+#define SeriesHeaderLength 6
+#define AggregateReportLength 24
+#define ResponseHeaderLength 8
+#define RequestHeaderLength 8
+#define EndOfPacketLength 1
+#ifdef IoTExtendedClientId
+#define ExtendedHeaderLength 1
+#define CurrentResponseHeaderLength (ResponseHeaderLength + clientExtendedHeader)
+#define CurrentRequestHeaderLength (RequestHeaderLength + clientExtendedHeader)
+#if (IoTClientCount > 255)
+#define ShortClientCount 255
+#else
+#define ShortClientCount IoTClientCount
+#endif
+typedef uint16_t IoTClientId;
+#else
+#define ExtendedHeaderLength 0
+#define CurrentResponseHeaderLength ResponseHeaderLength
+#define CurrentRequestHeaderLength RequestHeaderLength
+typedef uint8_t IoTClientId;
+#endif
+
+#if defined(IoTEncryptionRequired) || defined(IoTHandshakeCookies)
+#define AeadKeyLength 32
+#define AeadNonceLength 8
+#define AeadCounterLength 4
+#define AeadTagLength 16
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define AeadSSE2
+#endif
+
+class _IoTAead {
+private:
+	inline static uint32_t load32(const uint8_t* srcBuffer) {
+		return ((uint32_t)srcBuffer[0]) | (((uint32_t)srcBuffer[1]) << 8) | (((uint32_t)srcBuffer[2]) << 16) | (((uint32_t)srcBuffer[3]) << 24);
+	}
+
+	inline static void store32(uint8_t* dstBuffer, uint32_t value) {
+		dstBuffer[0] = (uint8_t)value;
+		dstBuffer[1] = (uint8_t)(value >> 8);
+		dstBuffer[2] = (uint8_t)(value >> 16);
+		dstBuffer[3] = (uint8_t)(value >> 24);
+	}
+
+	// state[0..3] = constants, state[4..11] = key, state[12] = block counter, state[13..15] = nonce
+	static void initState(uint32_t* state, const uint8_t* key, uint32_t counter, const uint8_t* nonce) {
+		state[0] = 0x61707865;
+		state[1] = 0x3320646E;
+		state[2] = 0x79622D32;
+		state[3] = 0x6B206574;
+		for (uint8_t i = 0; i < 8; i++)
+			state[4 + i] = load32(key + (i << 2));
+		state[12] = counter;
+		state[13] = load32(nonce);
+		state[14] = load32(nonce + 4);
+		state[15] = load32(nonce + 8);
+	}
+
+#ifdef AeadSSE2
+#define AeadRotate(X, N) _mm_or_si128(_mm_slli_epi32((X), (N)), _mm_srli_epi32((X), 32 - (N)))
+#define AeadRounds(A, B, C, D) \
+		A = _mm_add_epi32(A, B); D = _mm_xor_si128(D, A); D = AeadRotate(D, 16); \
+		C = _mm_add_epi32(C, D); B = _mm_xor_si128(B, C); B = AeadRotate(B, 12); \
+		A = _mm_add_epi32(A, B); D = _mm_xor_si128(D, A); D = AeadRotate(D, 8); \
+		C = _mm_add_epi32(C, D); B = _mm_xor_si128(B, C); B = AeadRotate(B, 7)
+
+	// Each row of the state lives in one SSE2 register, so a column round
+	// is 4 quarter rounds at once, and a diagonal round is the same thing
+	// after rotating rows 1, 2 and 3 by 1, 2 and 3 lanes
+	static void chachaBlock(const uint32_t* state, uint8_t* dstBuffer) {
+		const __m128i s0 = _mm_loadu_si128((const __m128i*)state);
+		const __m128i s1 = _mm_loadu_si128((const __m128i*)(state + 4));
+		const __m128i s2 = _mm_loadu_si128((const __m128i*)(state + 8));
+		const __m128i s3 = _mm_loadu_si128((const __m128i*)(state + 12));
+		__m128i a = s0, b = s1, c = s2, d = s3;
+		for (uint8_t i = 0; i < 10; i++) {
+			AeadRounds(a, b, c, d);
+			b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1));
+			c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+			d = _mm_shuffle_epi32(d, _MM_SHUFFLE(2, 1, 0, 3));
+			AeadRounds(a, b, c, d);
+			b = _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3));
+			c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+			d = _mm_shuffle_epi32(d, _MM_SHUFFLE(0, 3, 2, 1));
+		}
+		// x86 is little endian, so the registers can be stored as they are
+		_mm_storeu_si128((__m128i*)dstBuffer, _mm_add_epi32(a, s0));
+		_mm_storeu_si128((__m128i*)(dstBuffer + 16), _mm_add_epi32(b, s1));
+		_mm_storeu_si128((__m128i*)(dstBuffer + 32), _mm_add_epi32(c, s2));
+		_mm_storeu_si128((__m128i*)(dstBuffer + 48), _mm_add_epi32(d, s3));
+	}
+
+#undef AeadRounds
+#undef AeadRotate
+#else
+#define AeadRotate(X, N) (((X) << (N)) | ((X) >> (32 - (N))))
+#define AeadQuarterRound(A, B, C, D) \
+		x[A] += x[B]; x[D] ^= x[A]; x[D] = AeadRotate(x[D], 16); \
+		x[C] += x[D]; x[B] ^= x[C]; x[B] = AeadRotate(x[B], 12); \
+		x[A] += x[B]; x[D] ^= x[A]; x[D] = AeadRotate(x[D], 8); \
+		x[C] += x[D]; x[B] ^= x[C]; x[B] = AeadRotate(x[B], 7)
+
+	// Plain 32-bit version, used on ESP8266, AVR and on any other platform
+	// without SSE2 (no tables, and only the 64-byte state on the stack)
+	static void chachaBlock(const uint32_t* state, uint8_t* dstBuffer) {
+		uint32_t x[16];
+		uint8_t i;
+		for (i = 0; i < 16; i++)
+			x[i] = state[i];
+		for (i = 0; i < 10; i++) {
+			AeadQuarterRound(0, 4, 8, 12);
+			AeadQuarterRound(1, 5, 9, 13);
+			AeadQuarterRound(2, 6, 10, 14);
+			AeadQuarterRound(3, 7, 11, 15);
+			AeadQuarterRound(0, 5, 10, 15);
+			AeadQuarterRound(1, 6, 11, 12);
+			AeadQuarterRound(2, 7, 8, 13);
+			AeadQuarterRound(3, 4, 9, 14);
+		}
+		for (i = 0; i < 16; i++)
+			store32(dstBuffer + (i << 2), x[i] + state[i]);
+	}
+
+#undef AeadQuarterRound
+#undef AeadRotate
+#endif
+
+	static void chachaXor(uint32_t* state, uint8_t* buffer, uint16_t length) {
+		uint8_t block[64];
+		while (length) {
+			chachaBlock(state, block);
+			state[12]++;
+			const uint8_t count = (length < 64 ? (uint8_t)length : 64);
+			for (uint8_t i = 0; i < count; i++)
+				buffer[i] ^= block[i];
+			buffer += count;
+			length -= count;
+		}
+	}
+
+	// Poly1305 with 26-bit limbs (only 32x32 -> 64 multiplications are required)
+	struct _Poly1305 {
+	public:
+		uint32_t r[5], h[5], pad[4];
+	};
+
+	static void polyInit(_Poly1305& poly, const uint8_t* key) {
+		poly.r[0] = load32(key) & 0x3FFFFFF;
+		poly.r[1] = (load32(key + 3) >> 2) & 0x3FFFF03;
+		poly.r[2] = (load32(key + 6) >> 4) & 0x3FFC0FF;
+		poly.r[3] = (load32(key + 9) >> 6) & 0x3F03FFF;
+		poly.r[4] = (load32(key + 12) >> 8) & 0x00FFFFF;
+		for (uint8_t i = 0; i < 5; i++)
+			poly.h[i] = 0;
+		for (uint8_t i = 0; i < 4; i++)
+			poly.pad[i] = load32(key + 16 + (i << 2));
+	}
+
+	// Messages are always zero padded to 16 bytes by the AEAD construction,
+	// so every block is a full block
+	static void polyBlocks(_Poly1305& poly, const uint8_t* srcBuffer, uint16_t length) {
+		const uint32_t r0 = poly.r[0], r1 = poly.r[1], r2 = poly.r[2], r3 = poly.r[3], r4 = poly.r[4];
+		const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+		uint32_t h0 = poly.h[0], h1 = poly.h[1], h2 = poly.h[2], h3 = poly.h[3], h4 = poly.h[4];
+		uint8_t block[16];
+		while (length) {
+			const uint8_t* m = srcBuffer;
+			if (length < 16) {
+				uint8_t i;
+				for (i = 0; i < length; i++)
+					block[i] = srcBuffer[i];
+				for (; i < 16; i++)
+					block[i] = 0;
+				m = block;
+				length = 16;
+			}
+
+			h0 += load32(m) & 0x3FFFFFF;
+			h1 += (load32(m + 3) >> 2) & 0x3FFFFFF;
+			h2 += (load32(m + 6) >> 4) & 0x3FFFFFF;
+			h3 += (load32(m + 9) >> 6) & 0x3FFFFFF;
+			h4 += (load32(m + 12) >> 8) | (1UL << 24);
+
+			const uint64_t d0 = ((uint64_t)h0 * r0) + ((uint64_t)h1 * s4) + ((uint64_t)h2 * s3) + ((uint64_t)h3 * s2) + ((uint64_t)h4 * s1);
+			uint64_t d1 = ((uint64_t)h0 * r1) + ((uint64_t)h1 * r0) + ((uint64_t)h2 * s4) + ((uint64_t)h3 * s3) + ((uint64_t)h4 * s2);
+			uint64_t d2 = ((uint64_t)h0 * r2) + ((uint64_t)h1 * r1) + ((uint64_t)h2 * r0) + ((uint64_t)h3 * s4) + ((uint64_t)h4 * s3);
+			uint64_t d3 = ((uint64_t)h0 * r3) + ((uint64_t)h1 * r2) + ((uint64_t)h2 * r1) + ((uint64_t)h3 * r0) + ((uint64_t)h4 * s4);
+			uint64_t d4 = ((uint64_t)h0 * r4) + ((uint64_t)h1 * r3) + ((uint64_t)h2 * r2) + ((uint64_t)h3 * r1) + ((uint64_t)h4 * r0);
+
+			uint32_t c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3FFFFFF;
+			d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3FFFFFF;
+			d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3FFFFFF;
+			d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3FFFFFF;
+			d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3FFFFFF;
+			h0 += c * 5; c = h0 >> 26; h0 &= 0x3FFFFFF;
+			h1 += c;
+
+			srcBuffer += 16;
+			length -= 16;
+		}
+		poly.h[0] = h0;
+		poly.h[1] = h1;
+		poly.h[2] = h2;
+		poly.h[3] = h3;
+		poly.h[4] = h4;
+	}
+
+	static void polyFinish(_Poly1305& poly, uint8_t* tag) {
+		uint32_t h0 = poly.h[0], h1 = poly.h[1], h2 = poly.h[2], h3 = poly.h[3], h4 = poly.h[4];
+
+		uint32_t c = h1 >> 26; h1 &= 0x3FFFFFF;
+		h2 += c; c = h2 >> 26; h2 &= 0x3FFFFFF;
+		h3 += c; c = h3 >> 26; h3 &= 0x3FFFFFF;
+		h4 += c; c = h4 >> 26; h4 &= 0x3FFFFFF;
+		h0 += c * 5; c = h0 >> 26; h0 &= 0x3FFFFFF;
+		h1 += c;
+
+		// Compute h - p, and select it only if h >= p (without branches)
+		uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3FFFFFF;
+		uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3FFFFFF;
+		uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3FFFFFF;
+		uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3FFFFFF;
+		uint32_t g4 = h4 + c - (1UL << 26);
+
+		uint32_t mask = (g4 >> 31) - 1;
+		h0 = (h0 & ~mask) | (g0 & mask);
+		h1 = (h1 & ~mask) | (g1 & mask);
+		h2 = (h2 & ~mask) | (g2 & mask);
+		h3 = (h3 & ~mask) | (g3 & mask);
+		h4 = (h4 & ~mask) | (g4 & mask);
+
+		h0 = h0 | (h1 << 26);
+		h1 = (h1 >> 6) | (h2 << 20);
+		h2 = (h2 >> 12) | (h3 << 14);
+		h3 = (h3 >> 18) | (h4 << 8);
+
+		uint64_t f = (uint64_t)h0 + poly.pad[0];
+		store32(tag, (uint32_t)f);
+		f = (uint64_t)h1 + poly.pad[1] + (f >> 32);
+		store32(tag + 4, (uint32_t)f);
+		f = (uint64_t)h2 + poly.pad[2] + (f >> 32);
+		store32(tag + 8, (uint32_t)f);
+		f = (uint64_t)h3 + poly.pad[3] + (f >> 32);
+		store32(tag + 12, (uint32_t)f);
+	}
+
+	static void computeTag(uint32_t* state, const uint8_t* aad, uint8_t aadLength, const uint8_t* ciphertext, uint16_t length, uint8_t* tag) {
+		// The one-time Poly1305 key is the first half of block 0
+		uint8_t block[64];
+		state[12] = 0;
+		chachaBlock(state, block);
+		state[12] = 1;
+
+		_Poly1305 poly;
+		polyInit(poly, block);
+		polyBlocks(poly, aad, aadLength);
+		polyBlocks(poly, ciphertext, length);
+		for (uint8_t i = 0; i < 16; i++)
+			block[i] = 0;
+		block[0] = aadLength;
+		block[8] = (uint8_t)length;
+		block[9] = (uint8_t)(length >> 8);
+		polyBlocks(poly, block, 16);
+		polyFinish(poly, tag);
+	}
+
+public:
+	// The session key is the first half of a ChaCha20 block, keyed with the
+	// pre-shared key, and using both nonces in place of counter and nonce
+	static void deriveKey(uint8_t* sessionKey, const uint8_t* key, const uint8_t* clientNonce, const uint8_t* serverNonce) {
+		uint32_t state[16];
+		uint8_t block[64], nonce[12];
+		for (uint8_t i = 0; i < 4; i++)
+			nonce[i] = clientNonce[4 + i];
+		for (uint8_t i = 0; i < AeadNonceLength; i++)
+			nonce[4 + i] = serverNonce[i];
+		initState(state, key, load32(clientNonce), nonce);
+		chachaBlock(state, block);
+		for (uint8_t i = 0; i < AeadKeyLength; i++)
+			sessionKey[i] = block[i];
+	}
+
+	static void seal(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, uint8_t aadLength, uint8_t* buffer, uint16_t length, uint8_t* tag) {
+		uint32_t state[16];
+		initState(state, key, 1, nonce);
+		chachaXor(state, buffer, length);
+		computeTag(state, aad, aadLength, buffer, length, tag);
+	}
+
+	static uint8_t open(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, uint8_t aadLength, uint8_t* buffer, uint16_t length, const uint8_t* tag) {
+		uint32_t state[16];
+		uint8_t expectedTag[AeadTagLength];
+		initState(state, key, 0, nonce);
+		computeTag(state, aad, aadLength, buffer, length, expectedTag);
+
+		// Constant time comparison
+		uint8_t diff = 0;
+		for (uint8_t i = 0; i < AeadTagLength; i++)
+			diff |= expectedTag[i] ^ tag[i];
+		if (diff)
+			return false;
+
+		chachaXor(state, buffer, length);
+		return true;
+	}
+};
+
+#undef AeadSSE2
+#endif
+
+#ifdef IoTEncryptionRequired
+#define EncryptionOverheadLength (AeadCounterLength + AeadTagLength)
+#define HandshakePayloadLength AeadNonceLength
+#else
+#define EncryptionOverheadLength 0
+#define HandshakePayloadLength 0
+#endif
+#define HandshakeCookieLength 8
+
+#ifdef IoTPropertyPlane
+#define PlaneVersion 1
+#define PlaneSlotHeaderLength 12
+#define PlaneValueLength (IoTPropertyPlaneSlotLength - PlaneSlotHeaderLength)
+#endif
+
+#ifdef IoTPersistentState
+#define StateVersion 2
+#define StateHeaderLength 5
+#define StateCounterGap 0x00100000
+#ifdef IoTEncryptionRequired
+#define ClientStateLength 0
+#define GroupStateLength 7
+#define GroupCounterStateLength 4
+#else
+#define ClientStateLength 8
+#define GroupStateLength 5
+#define GroupCounterStateLength 0
+#endif
+#endif
+
+const uint8_t IoTServerCategoryUuid[] = IoTCategoryUuid; // Element 0 must be the least significant, whereas element 15 must be the most significant
+const uint8_t IoTServerUuid[] = IoTUuid; // Element 0 must be the least significant, whereas element 15 must be the most significant
+#ifndef IoTMulticastGroupAddressDefined
+#define IoTMulticastGroupAddressDefined
+// 239.255.10.10 (administratively scoped), used by MessageGroup and by discovery
+const uint8_t IoTMulticastGroupAddress[] = { 239, 255, 10, 10 };
+#endif
+#ifdef IoTEncryptionRequired
+const uint8_t IoTServerEncryptionKey[] = IoTEncryptionKey; // Must contain exactly 32 bytes, shared with all clients allowed to control this device
+#endif
+extern const IoTInterfaceDescriptor IoTInterfaces[IoTInterfaceCount];
+#ifdef IoTAggregateCount
+extern const IoTAggregateDescriptor IoTAggregates[IoTAggregateCount];
+#endif
+#ifdef IoTStreamingResponse
+// Called with each chunk of the response, as it is written, and srcBuffer
+// must be appended to what has been written so far (nothing is rewritten, so
+// it can go straight into the datagram being sent); responses that must not
+// be sent also come here, and must be dropped (responseRequired() is false)
+extern void IoTResponseSinkWrite(const uint8_t* srcBuffer, uint16_t length);
+#define StreamedResponseCode 0xFF
+#define StreamedPayloadLength 0xFFFF
+#define StreamedTrailerLength 3
+#define ResponseBufferLength (IoTStreamingChunkLength + StreamedTrailerLength + EndOfPacketLength)
+#else
+#define ResponseBufferLength (ResponseHeaderLength + ExtendedHeaderLength + IoTMaxPayloadLength + EncryptionOverheadLength + EndOfPacketLength)
+#endif
+
+#ifdef IoTPropertyPlane
+// The fields are naturally aligned, so the slot must not be packed: sequence
+// and acknowledgedSequence must be read and written with single instructions
+#pragma pack(push, 4)
+struct IoTPropertyPlaneSlot {
+public:
+	volatile uint32_t sequence; // Odd while the value is being written (0 = never published)
+	volatile uint32_t acknowledgedSequence; // Only written by the server, in nextPropertyChange()
+	volatile uint16_t valueLength;
+	uint16_t reserved;
+	volatile uint8_t value[PlaneValueLength];
+};
+#pragma pack(pop)
+#endif
+
+#ifdef IoTActuatorQueue
+struct IoTActuation {
+public:
+	uint8_t operation; // SceneExecute or SceneSetProperty
+	uint8_t interfaceIndex;
+	uint8_t interfaceCommand; // Only used with SceneExecute
+	uint8_t propertyIndex; // Only used with SceneSetProperty
+	uint8_t propertyValueLength; // Only used with SceneSetProperty
+	uint8_t propertyValue[IoTActuatorValueLength]; // Only used with SceneSetProperty
+};
+#endif
+
+#ifdef IoTTrace
+struct IoTTraceEvent {
+public:
+	uint64_t timestamp;
+	uint16_t clientId;
+	uint16_t sequenceNumber;
+	uint8_t type;
+	uint8_t message;
+	uint16_t argument;
+};
+#endif
+
+class _IoTServer {
+public:
+	enum _CliendIds {
+#ifdef IoTExtendedClientId
+		InvalidClientId = 0xFFFF,
+#else
+		InvalidClientId = 0xFF,
+#endif
+		InvalidShortClientId = 0xFF
+	};
+
+	enum _SequenceNumbers {
+		MaximumSequenceNumber = 0xFFFF
+	};
+
+	enum _ResponseLengths {
+		MaximumResponseLength = ResponseBufferLength
+	};
+
+	enum _Messages {
+		MessageQueryDevice = 0x00,
+		MessageDescribeInterface = 0x01,
+		MessageDescribeEnum = 0x02,
+		MessageChangeName = 0x03,
+		MessageChangePassword = 0x04,
+		MessageHandshake = 0x05,
+		MessagePing = 0x06,
+		MessageReset = 0x07,
+		MessageGoodBye = 0x08,
+		MessageExecute = 0x09,
+		MessageGetProperty = 0x0A,
+		MessageSetProperty = 0x0B,
+		MessageScene = 0x0C,
+		MessageGroup = 0x0D,
+		MessageGetPropertyRange = 0x0E,
+		MessageSetPropertyRange = 0x0F,
+		MessageOpenStream = 0x10,
+		MessageCloseStream = 0x11,
+		MessageStreamFrame = 0x12, // Only sent as a stream frame, never as a regular request
+		MessageScheduleScene = 0x13,
+		MessageScheduleTimer = 0x14,
+		MessageListSchedule = 0x15,
+		MessageCancelSchedule = 0x16,
+		MessageSetRule = 0x17,
+		MessageDeleteRule = 0x18,
+		MessageGetSeries = 0x19,
+		MessageGetAggregates = 0x1A,
+		MessageMax = 0x1A
+	};
+
+	enum _SceneOperations {
+		SceneExecute = 0x00,
+		SceneSetProperty = 0x01
+	};
+
+	enum _SeriesEncodings {
+		SeriesPlain = 0x00,
+		SeriesCompressed = 0x01
+	};
+
+	enum _RuleOperations {
+		RuleEnd = 0x00,
+		RuleLoad = 0x01,
+		RuleConstant = 0x02,
+		RuleAdd = 0x03,
+		RuleSubtract = 0x04,
+		RuleMultiply = 0x05,
+		RuleLess = 0x06,
+		RuleLessOrEqual = 0x07,
+		RuleGreater = 0x08,
+		RuleGreaterOrEqual = 0x09,
+		RuleEqual = 0x0A,
+		RuleNotEqual = 0x0B,
+		RuleAnd = 0x0C,
+		RuleOr = 0x0D,
+		RuleNot = 0x0E
+	};
+
+	enum _GroupIds {
+		InvalidGroupId = 0xFFFF
+	};
+
+	enum _GroupFlags {
+		GroupFlagAckRequested = 0x01
+	};
+
+	enum _ServerMessages {
+		ServerMessagePropertyChange = 0x80,
+		ServerMessageStreamReport = 0x81
+	};
+
+	enum _Replies {
+		ResponseOK = 0x00,
+		ResponseDeviceError = 0x01,
+		ResponseUnknownClient = 0x02,
+		ResponseUnsupportedMessage = 0x03,
+		ResponsePayloadTooLarge = 0x04,
+		ResponseInvalidPayload = 0x05,
+		ResponseEndOfPacketNotFound = 0x06,
+		ResponseWrongPassword = 0x07,
+		ResponseNameReadOnly = 0x08,
+		ResponsePasswordReadOnly = 0x09,
+		ResponseCannotChangeNameNow = 0x0A,
+		ResponseCannotChangePasswordNow = 0x0B,
+		ResponseInvalidInterface = 0x0C,
+		ResponseInvalidInterfaceCommand = 0x0D,
+		ResponseInvalidInterfaceProperty = 0x0E,
+		ResponseInterfacePropertyReadOnly = 0x0F,
+		ResponseInterfacePropertyWriteOnly = 0x10,
+		ResponseInvalidInterfacePropertyValue = 0x11,
+		ResponseTryAgainLater = 0x12,
+		ResponseCookieRequired = 0x13,
+		ResponseMax = 0x20
+	};
+
+	enum _Flags {
+		FlagNameReadOnly = 0x01,
+		FlagPasswordProtected = 0x02,
+		FlagPasswordReadOnly = 0x04,
+		FlagResetSupported = 0x08,
+		FlagEncryptionRequired = 0x10,
+		FlagHandshakeCookies = 0x20,
+		FlagExtendedClientId = 0x40
+	};
+
+	// Arguments: TraceReceived (packet length), TraceVerdict (_TraceVerdicts),
+	// TraceResponse (response code, also marking the end of the user handler)
+	// and TraceSent (length, recorded by the application with trace())
+	enum _TraceEvents {
+		TraceReceived = 0x00,
+		TraceVerdict = 0x01,
+		TraceHandler = 0x02,
+		TraceResponse = 0x03,
+		TraceSent = 0x04,
+		TraceUser = 0x80
+	};
+
+	enum _TraceVerdicts {
+		TraceAccepted = 0x01,
+		TraceAnswered = 0x02,
+		TraceRepeated = 0x04
+	};
+
+private:
+	// Kept apart, so looking up a client only walks through clientIPs
+	static uint32_t clientIPs[IoTClientCount];
+	static uint16_t clientPorts[IoTClientCount];
+	static uint16_t clientSequenceNumbers[IoTClientCount];
+
+#ifdef IoTClientTimeout
+	// Every client slot in use is linked into one of the wheel slots, chosen
+	// by the tick when it would expire, if no other messages arrived
+	static uint16_t clientLastSeen[IoTClientCount];
+	static IoTClientId clientTimerNext[IoTClientCount];
+	static IoTClientId clientTimerPrevious[IoTClientCount];
+	static uint8_t clientTimerSlot[IoTClientCount];
+	static IoTClientId timerWheel[IoTTimerWheelSlots];
+	static uint16_t timerTick;
+	static uint32_t timerTime;
+#endif
+
+#ifdef IoTPropertyCacheCount
+	struct _IoTPropertyCacheEntry {
+	public:
+		uint32_t time;
+		uint8_t used;
+		uint8_t interfaceIndex;
+		uint8_t propertyIndex;
+		uint8_t valueLength;
+		uint8_t value[IoTPropertyCacheValueLength];
+	};
+
+	static _IoTPropertyCacheEntry propertyCache[IoTPropertyCacheCount];
+#endif
+
+#ifdef IoTTrace
+	static IoTTraceEvent traceEvents[IoTTrace];
+	static uint32_t traceEventCount;
+#endif
+
+#ifdef IoTSetpointStreamCount
+	// A closed stream keeps its client id and its statistics, so a repeated
+	// MessageCloseStream can be answered with the same report
+	struct _IoTSetpointStream {
+	public:
+		IoTClientId clientId; // InvalidClientId when the stream was never opened
+		uint8_t open;
+		uint8_t synchronized; // false until the first frame has been accepted
+#ifdef IoTExtendedClientId
+		uint8_t extendedHeader;
+#endif
+		uint8_t interfaceIndex;
+		uint8_t propertyIndex;
+		uint16_t valueLength;
+		uint16_t reportInterval;
+		uint16_t framesUntilReport;
+		uint16_t sequenceNumber;
+		uint16_t transitTime;
+		uint32_t jitter; // << 4, as in RFC 3550
+		uint32_t receivedFrames;
+		uint32_t lostFrames;
+		uint32_t lateFrames;
+	};
+
+	static _IoTSetpointStream setpointStreams[IoTSetpointStreamCount];
+	static uint8_t currentStream;
+#endif
+
+#ifdef IoTScheduleCount
+	// A slot keeps the client id and the sequence number of the message that
+	// scheduled it, even after the scene has been applied, so a repeated
+	// message is not scheduled again
+	struct _IoTScheduledScene {
+	public:
+		uint32_t time;
+		uint32_t interval; // 0 for scenes that are applied only once
+		IoTClientId clientId;
+		uint16_t sequenceNumber;
+		uint8_t used;
+		uint8_t heapIndex;
+		uint16_t length;
+		uint8_t scene[IoTScheduleLength];
+	};
+
+	static _IoTScheduledScene scheduledScenes[IoTScheduleCount];
+	// Slots in use, as a binary heap, with the earliest one at index 0
+	static uint8_t scheduleHeap[IoTScheduleCount];
+	static uint8_t scheduleHeapSize;
+#endif
+
+#ifdef IoTRuleCount
+	// Inputs are shared by all the rules reading the same property (references
+	// counts those rules), and a rule only refers to its inputs by their slots
+	struct _IoTRuleInput {
+	public:
+		float value;
+		uint8_t interfaceIndex;
+		uint8_t propertyIndex;
+		uint8_t references;
+	};
+
+	// program holds the code (with the operands of RuleLoad already replaced
+	// by input slots), followed by the scene
+	struct _IoTRule {
+	public:
+		uint32_t inputMask;
+		IoTClientId clientId;
+		uint16_t sequenceNumber;
+		uint8_t used;
+		uint8_t active;
+		uint8_t pending;
+		uint8_t codeLength;
+		uint8_t length;
+		uint8_t program[IoTRuleLength];
+	};
+
+	static _IoTRuleInput ruleInputs[IoTRuleInputCount];
+	static uint32_t knownRuleInputs;
+	static _IoTRule rules[IoTRuleCount];
+	static uint8_t pendingRules;
+#endif
+
+#ifdef IoTAggregateCount
+	// Only the window in progress is accumulated, and the last completed one
+	// is kept already summarized, ready to be sent
+	struct _IoTAggregate {
+	public:
+		uint32_t start; // Of the window in progress
+		uint32_t count;
+		float minimum;
+		float maximum;
+		double sum;
+		uint32_t completedCount;
+		float completedMinimum;
+		float completedMaximum;
+		float completedMean;
+	};
+
+	static _IoTAggregate aggregates[IoTAggregateCount];
+#endif
+
+#ifdef IoTActuatorQueue
+	// Mailboxes are only ever claimed and released by the producer, and only
+	// while the consumer is not reading any of them, so operation,
+	// interfaceIndex and propertyIndex do not change while they are being read
+	struct _IoTActuatorMailbox {
+	public:
+		volatile uint32_t sequence; // Odd while value is being written
+		volatile uint8_t pending; // true while the mailbox is in actuatorRing
+		uint8_t used;
+		uint8_t operation;
+		uint8_t interfaceIndex;
+		uint8_t propertyIndex; // Commands are kept in value[0]
+		volatile uint8_t valueLength;
+		volatile uint8_t value[IoTActuatorValueLength];
+	};
+
+	static _IoTActuatorMailbox actuatorMailboxes[IoTActuatorQueue];
+	// Since each mailbox is in the ring at most once, it never overflows
+	static volatile uint8_t actuatorRing[IoTActuatorQueue];
+	static volatile uint16_t actuatorHead; // Only written by the consumer
+	static volatile uint16_t actuatorDone; // Only written by the consumer (actuatorHead, once the mailbox has been read)
+	static volatile uint16_t actuatorTail; // Only written by the producer
+#endif
+
+#ifdef IoTPropertyPlane
+	// Slot 0 is the header, and the slot of the first property of interface i
+	// is propertyPlaneFirstSlots[i]
+	static IoTPropertyPlaneSlot* propertyPlane;
+	static uint16_t propertyPlaneFirstSlots[IoTInterfaceCount];
+	static uint16_t propertyPlaneSlotCount;
+	static uint16_t propertyPlaneCursor;
+#endif
+
+	static uint8_t nameLength;
+#ifdef IoTNameReadOnly
+	static const uint8_t* name;
+#else
+	static uint8_t name[IoTMaxNameLength];
+#endif
+
+#ifndef IoTNoPassword
+	static uint8_t passwordLength;
+#ifdef IoTPasswordReadOnly
+	static const uint8_t* password;
+#else
+	static uint8_t password[IoTMaxPasswordLength];
+#endif
+#endif
+
+	static IoTClientId clientId;
+#ifdef IoTExtendedClientId
+	static uint8_t clientExtendedHeader;
+#endif
+	static uint16_t clientSequenceNumber;
+	static uint8_t clientMessageRepeated;
+	static uint8_t clientMessage;
+	static const uint8_t* clientPayloadBuffer;
+	static uint16_t clientPayloadLength;
+	static uint8_t clientResponseReady;
+	static uint8_t clientResponseRequired;
+#ifdef IoTMulticastDiscovery
+	static uint16_t clientResponseDelay;
+#endif
+
+#ifdef IoTPersistentState
+	static uint8_t stateDirty;
+#endif
+
+#ifdef IoTGroupCount
+	static uint16_t groupIds[IoTGroupCount];
+	static uint16_t groupSequenceNumbers[IoTGroupCount];
+	static uint8_t groupSynchronized[IoTGroupCount];
+#ifdef IoTEncryptionRequired
+	static uint8_t groupKeys[IoTGroupCount][AeadKeyLength];
+	static uint8_t currentGroup; // Slot of the MessageGroup being answered
+	static uint16_t groupEpochs[IoTGroupCount];
+	static uint32_t groupResponseCounter;
+#endif
+#endif
+
+#ifdef IoTHandshakeCookies
+	static uint8_t handshakeCookieSecret[AeadKeyLength];
+#endif
+
+#ifdef IoTEncryptionRequired
+	static uint8_t clientKeys[IoTClientCount][AeadKeyLength];
+	static uint32_t clientResponseCounters[IoTClientCount];
+	static uint32_t clientSequenceAdvances[IoTClientCount];
+	static uint8_t clientEncrypted;
+	static uint8_t plaintextBuffer[IoTMaxPayloadLength];
+#endif
+
+	static uint16_t bufferOffset;
+#ifdef IoTStreamingResponse
+	static uint16_t flushedLength;
+#endif
+#ifdef IoTExternalResponseBuffer
+	static uint8_t* buffer;
+#else
+	static uint8_t buffer[ResponseBufferLength];
+#endif
+
+	static void buildQueryDeviceResponse() {
+		uint8_t flags = 0;
+#ifndef IoTNoPassword
+		flags |= FlagPasswordProtected;
+#endif
+#ifdef IoTPasswordReadOnly
+		flags |= FlagPasswordReadOnly;
+#endif
+#ifdef IoTResetSupported
+		flags |= FlagResetSupported;
+#endif
+#ifdef IoTNameReadOnly
+		flags |= FlagNameReadOnly;
+#endif
+#ifdef IoTEncryptionRequired
+		flags |= FlagEncryptionRequired;
+#endif
+#ifdef IoTHandshakeCookies
+		flags |= FlagHandshakeCookies;
+#endif
+#ifdef IoTExtendedClientId
+		flags |= FlagExtendedClientId;
+#endif
+		writeResponse(flags);
+
+		writeResponse(IoTServerCategoryUuid, 16);
+
+		writeResponse(IoTServerUuid, 16);
+
+		writeResponse(IoTInterfaceCount);
+
+		for (uint8_t i = 0; i < IoTInterfaceCount; i++)
+			writeResponse(IoTInterfaces[i].type);
+
+#ifdef IoTNameReadOnly
+		if (!nameLength || !name) {
+#else
+		if (!nameLength) {
+#endif
 			writeResponse(3);
 			writeResponse('I');
 			writeResponse('o');
 			writeResponse('T');
 		} else {
-			writeResponse(nameLength);
-			writeResponse(name, nameLength);
+			writeResponse(nameLength);
+			writeResponse(name, nameLength);
+		}
+
+		buildResponse(ResponseOK);
+	}
+
+	static void buildDescribeInterfaceResponse(uint8_t interfaceIndex) {
+		if (interfaceIndex >= IoTInterfaceCount)
+			return buildResponse(ResponseInvalidInterface);
+
+		const IoTInterfaceDescriptor* const interfaceDescriptor = &(IoTInterfaces[interfaceIndex]);
+
+		writeResponse(interfaceIndex);
+
+		uint8_t nameLen = (uint8_t)strlen(interfaceDescriptor->name);
+		writeResponse(nameLen);
+		writeResponse(interfaceDescriptor->name, nameLen);
+
+		writeResponse(interfaceDescriptor->type);
+
+		const uint8_t propertyCount = interfaceDescriptor->propertyCount;
+		writeResponse(propertyCount);
+
+		for (uint8_t i = 0; i < propertyCount; i++) {
+			const IoTPropertyDescriptor* const propertyDescriptor = &(interfaceDescriptor->propertyDescriptors[i]);
+
+			nameLen = (uint8_t)strlen(propertyDescriptor->name);
+			writeResponse(nameLen);
+			writeResponse(propertyDescriptor->name, nameLen);
+			writeResponse(&(propertyDescriptor->mode), 6);
+		}
+
+		buildResponse(ResponseOK);
+	}
+
+	static void buildHandshakeResponse(uint16_t sequenceNumber, const uint8_t* clientNonce) {
+#ifdef IoTExtendedClientId
+		// Client ids that do not fit in one byte are only given to clients using extended requests
+		const IoTClientId clientCount = (clientExtendedHeader ? IoTClientCount : ShortClientCount);
+#else
+		const IoTClientId clientCount = IoTClientCount;
+#endif
+		IoTClientId i;
+		// First, try to find the client itself
+		for (i = 0; i < clientCount; i++) {
+			if (clientIPs[i] == currentClientIP &&
+				clientPorts[i] == currentClientPort)
+				break;
+		}
+		if (i >= clientCount) {
+			// If not found, try to find an empty client slot
+			for (i = 0; i < clientCount; i++) {
+				if (!clientIPs[i])
+					break;
+			}
+			if (i >= clientCount) {
+				// Since there were no empty slots, we will have to overwrite someone...
+#ifdef IoTClientTimeout
+				// ... the one that has been quiet for the longest time
+				i = 0;
+				for (IoTClientId j = 1; j < clientCount; j++) {
+					if ((uint16_t)(timerTick - clientLastSeen[j]) > (uint16_t)(timerTick - clientLastSeen[i]))
+						i = j;
+				}
+#else
+				// TODO: create a RLU list of client id's
+				i = 0;
+#endif
+			}
+		}
+#ifdef IoTClientTimeout
+		unlinkClientTimer(i);
+		clientLastSeen[i] = timerTick;
+		linkClientTimer(i);
+#endif
+		clientSequenceNumbers[i] = sequenceNumber;
+		clientIPs[i] = currentClientIP;
+		clientPorts[i] = currentClientPort;
+#ifdef IoTPersistentState
+		stateDirty = true;
+#endif
+
+		writeResponse((uint8_t)i);
+#ifdef IoTExtendedClientId
+		if (clientExtendedHeader)
+			writeResponse((uint8_t)(i >> 8));
+#endif
+
+#ifdef IoTEncryptionRequired
+		uint8_t serverNonce[AeadNonceLength];
+		for (uint8_t j = 0; j < AeadNonceLength; j += 4) {
+			const uint32_t r = IoTRandom32();
+			serverNonce[j] = (uint8_t)r;
+			serverNonce[j + 1] = (uint8_t)(r >> 8);
+			serverNonce[j + 2] = (uint8_t)(r >> 16);
+			serverNonce[j + 3] = (uint8_t)(r >> 24);
+		}
+		_IoTAead::deriveKey(clientKeys[i], IoTServerEncryptionKey, clientNonce, serverNonce);
+		clientResponseCounters[i] = 0;
+		clientSequenceAdvances[i] = 0;
+
+		writeResponse(serverNonce, AeadNonceLength);
+#else
+		(void)clientNonce;
+#endif
+
+		buildResponse(ResponseOK);
+	}
+
+#ifdef IoTHandshakeCookies
+	// Derived from the client address, the secret chosen in begin() and the
+	// time slot, so nothing is stored until the cookie comes back
+	static void computeHandshakeCookie(uint8_t* cookie, uint32_t timeSlot) {
+		uint8_t address[AeadNonceLength], slot[AeadNonceLength], block[AeadKeyLength];
+		address[0] = (uint8_t)currentClientIP;
+		address[1] = (uint8_t)(currentClientIP >> 8);
+		address[2] = (uint8_t)(currentClientIP >> 16);
+		address[3] = (uint8_t)(currentClientIP >> 24);
+		address[4] = (uint8_t)currentClientPort;
+		address[5] = (uint8_t)(currentClientPort >> 8);
+		address[6] = 0;
+		address[7] = 0;
+		slot[0] = (uint8_t)timeSlot;
+		slot[1] = (uint8_t)(timeSlot >> 8);
+		slot[2] = (uint8_t)(timeSlot >> 16);
+		slot[3] = (uint8_t)(timeSlot >> 24);
+		slot[4] = 0;
+		slot[5] = 0;
+		slot[6] = 0;
+		slot[7] = 0;
+		_IoTAead::deriveKey(block, handshakeCookieSecret, address, slot);
+		for (uint8_t i = 0; i < HandshakeCookieLength; i++)
+			cookie[i] = block[i];
+	}
+
+	static uint8_t validHandshakeCookie(const uint8_t* cookie) {
+		uint8_t expectedCookie[HandshakeCookieLength];
+		const uint32_t timeSlot = (uint32_t)IoTMillis() / IoTHandshakeCookieTime;
+		for (uint8_t slot = 0; slot < 2; slot++) {
+			computeHandshakeCookie(expectedCookie, timeSlot - slot);
+			uint8_t diff = 0;
+			for (uint8_t i = 0; i < HandshakeCookieLength; i++)
+				diff |= expectedCookie[i] ^ cookie[i];
+			if (!diff)
+				return true;
+		}
+		return false;
+	}
+
+	static void buildHandshakeCookieResponse() {
+		uint8_t* dstBuffer = reserveResponse(HandshakeCookieLength);
+		computeHandshakeCookie(dstBuffer, (uint32_t)IoTMillis() / IoTHandshakeCookieTime);
+		buildResponse(ResponseCookieRequired);
+	}
+#endif
+
+#ifdef IoTPersistentState
+	static uint8_t* saveStateValue(uint8_t* dstBuffer, uint32_t value, uint8_t length) {
+		while (length--) {
+			*dstBuffer++ = (uint8_t)value;
+			value >>= 8;
+		}
+		return dstBuffer;
+	}
+
+	static uint32_t loadStateValue(const uint8_t* srcBuffer, uint8_t length) {
+		uint32_t value = 0;
+		while (length--)
+			value = (value << 8) | srcBuffer[length];
+		return value;
+	}
+#endif
+
+	static void releaseClient(IoTClientId id) {
+#ifdef IoTClientTimeout
+		unlinkClientTimer(id);
+#endif
+		clientSequenceNumbers[id] = MaximumSequenceNumber;
+		clientIPs[id] = 0;
+		clientPorts[id] = 0;
+#ifdef IoTPersistentState
+		stateDirty = true;
+#endif
+#ifdef IoTSetpointStreamCount
+		for (uint8_t i = 0; i < IoTSetpointStreamCount; i++) {
+			if (setpointStreams[i].clientId == id) {
+				setpointStreams[i].clientId = InvalidClientId;
+				setpointStreams[i].open = false;
+			}
+		}
+#endif
+#ifdef IoTEncryptionRequired
+		for (uint8_t i = 0; i < AeadKeyLength; i++)
+			clientKeys[id][i] = 0;
+#endif
+	}
+
+	static void buildGoodByeResponse() {
+		buildResponse(ResponseOK);
+		releaseClient(clientId);
+	}
+
+#ifdef IoTClientTimeout
+	static void linkClientTimer(IoTClientId id) {
+		const uint8_t slot = (uint8_t)((uint16_t)(clientLastSeen[id] + (IoTClientTimeout / IoTTimerTickTime)) & (IoTTimerWheelSlots - 1));
+		IoTClientId* const head = timerWheel + slot;
+		clientTimerSlot[id] = slot;
+		clientTimerPrevious[id] = InvalidClientId;
+		clientTimerNext[id] = *head;
+		if (*head != InvalidClientId)
+			clientTimerPrevious[*head] = id;
+		*head = id;
+	}
+
+	static void unlinkClientTimer(IoTClientId id) {
+		if (!clientIPs[id])
+			return;
+		const IoTClientId next = clientTimerNext[id], previous = clientTimerPrevious[id];
+		if (next != InvalidClientId)
+			clientTimerPrevious[next] = previous;
+		if (previous != InvalidClientId)
+			clientTimerNext[previous] = next;
+		else if (timerWheel[clientTimerSlot[id]] == id)
+			timerWheel[clientTimerSlot[id]] = next;
+	}
+
+	// Clients that were seen after being linked are only moved to the right
+	// wheel slot here, so process() never has to touch the wheel
+	static void processTimerSlot() {
+		IoTClientId id = timerWheel[timerTick & (IoTTimerWheelSlots - 1)];
+		timerWheel[timerTick & (IoTTimerWheelSlots - 1)] = InvalidClientId;
+		while (id != InvalidClientId) {
+			const IoTClientId next = clientTimerNext[id];
+			if ((int16_t)(timerTick - (uint16_t)(clientLastSeen[id] + (IoTClientTimeout / IoTTimerTickTime))) >= 0) {
+				// The slot list has already been detached from the wheel
+				clientTimerNext[id] = InvalidClientId;
+				clientTimerPrevious[id] = InvalidClientId;
+				releaseClient(id);
+			} else {
+				linkClientTimer(id);
+			}
+			id = next;
+		}
+	}
+#endif
+
+#ifdef IoTEncryptionRequired
+	static uint8_t openPayload(const uint8_t* header, const uint8_t* key, uint8_t direction, uint16_t groupId, uint16_t groupEpoch) {
+		if (clientPayloadLength < AeadTagLength ||
+			clientPayloadLength - AeadTagLength > IoTMaxPayloadLength)
+			return false;
+
+		uint8_t nonce[12];
+		for (uint8_t i = 0; i < 12; i++)
+			nonce[i] = 0;
+		nonce[0] = direction;
+		nonce[1] = (uint8_t)clientSequenceNumber;
+		nonce[2] = (uint8_t)(clientSequenceNumber >> 8);
+		nonce[3] = (uint8_t)groupId;
+		nonce[4] = (uint8_t)(groupId >> 8);
+		nonce[5] = (uint8_t)groupEpoch;
+		nonce[6] = (uint8_t)(groupEpoch >> 8);
+
+		// The buffer given to process() belongs to the caller, so the payload
+		// is decrypted into plaintextBuffer
+		clientPayloadLength -= AeadTagLength;
+		for (uint16_t i = 0; i < clientPayloadLength; i++)
+			plaintextBuffer[i] = clientPayloadBuffer[i];
+		if (!_IoTAead::open(key, nonce, header, CurrentRequestHeaderLength - 4, plaintextBuffer, clientPayloadLength, clientPayloadBuffer + clientPayloadLength))
+			return false;
+		clientPayloadBuffer = plaintextBuffer;
+
+		clientEncrypted = true;
+		bufferOffset = CurrentResponseHeaderLength + AeadCounterLength;
+		return true;
+	}
+
+	static void sealResponse() {
+		uint32_t counter;
+		const uint8_t* key;
+		uint8_t nonce[12];
+		for (uint8_t i = 0; i < 12; i++)
+			nonce[i] = 0;
+#ifdef IoTGroupCount
+		if (clientId == InvalidClientId) {
+			// All members share the group key, so their nonces must differ
+			counter = ++groupResponseCounter;
+#ifdef IoTPersistentState
+			// Keeps the saved counter within StateCounterGap of the actual one
+			if (!(counter & 0xFFFF))
+				stateDirty = true;
+#endif
+			key = groupKeys[currentGroup];
+			nonce[0] = 3;
+			for (uint8_t i = 0; i < 7; i++)
+				nonce[5 + i] = IoTServerUuid[i];
+		} else
+#endif
+		{
+			counter = ++clientResponseCounters[clientId];
+#ifdef IoTPersistentState
+			if (!(counter & 0xFFFF))
+				stateDirty = true;
+#endif
+			key = clientKeys[clientId];
+			nonce[0] = 1;
+		}
+		uint8_t* const counterBuffer = buffer + CurrentResponseHeaderLength;
+		nonce[1] = counterBuffer[0] = (uint8_t)counter;
+		nonce[2] = counterBuffer[1] = (uint8_t)(counter >> 8);
+		nonce[3] = counterBuffer[2] = (uint8_t)(counter >> 16);
+		nonce[4] = counterBuffer[3] = (uint8_t)(counter >> 24);
+
+		// The associated data is the header, without StartOfPacket and the payload length
+		const uint16_t length = bufferOffset - (CurrentResponseHeaderLength + AeadCounterLength);
+		_IoTAead::seal(key, nonce, buffer + 1, CurrentResponseHeaderLength - 3, counterBuffer + AeadCounterLength, length, buffer + bufferOffset);
+		bufferOffset += AeadTagLength;
+	}
+#endif
+
+#ifdef IoTGroupCount
+	static uint8_t findGroup(uint16_t groupId) {
+		uint8_t i;
+		for (i = 0; i < IoTGroupCount; i++) {
+			if (groupIds[i] == groupId)
+				break;
+		}
+		return i;
+	}
+
+	// Returns false when the message must be silently discarded
+	static uint8_t processGroup(const uint8_t* header, const uint8_t* clientPassword, uint16_t clientPasswordLength) {
+		if (clientId != InvalidClientId ||
+			clientPayloadLength < 3)
+			return false;
+
+#ifdef IoTEncryptionRequired
+		// The tag authenticates the sender, so there is no password to check
+		(void)clientPassword;
+		if (clientPasswordLength)
+			return false;
+#else
+		if (clientPasswordLength != passwordLength)
+			return false;
+#ifdef IoTNoPassword
+		(void)clientPassword;
+#else
+		const uint8_t* passwordBuffer = password;
+		while (clientPasswordLength--) {
+			if (*clientPassword++ != *passwordBuffer++)
+				return false;
+		}
+#endif
+#endif
+
+		const uint16_t groupId = ((uint16_t)clientPayloadBuffer[0]) | (((uint16_t)clientPayloadBuffer[1]) << 8);
+		if (groupId == InvalidGroupId)
+			return false;
+		const uint8_t i = findGroup(groupId);
+		if (i >= IoTGroupCount)
+			return false;
+
+		clientPayloadBuffer += 2;
+		clientPayloadLength -= 2;
+
+#ifdef IoTEncryptionRequired
+		if (clientPayloadLength < 2)
+			return false;
+		const uint16_t groupEpoch = _IoTLittleEndian::load16(clientPayloadBuffer);
+		clientPayloadBuffer += 2;
+		clientPayloadLength -= 2;
+
+		if (!openPayload(header, groupKeys[i], 2, groupId, groupEpoch) ||
+			!clientPayloadLength)
+			return false;
+		currentGroup = i;
+#else
+		(void)header;
+#endif
+
+		const uint8_t flags = *clientPayloadBuffer++;
+		clientPayloadLength--;
+
+#ifdef IoTEncryptionRequired
+		// The group key never changes, so the epoch keeps nonces from repeating
+		const uint32_t groupSequence = (((uint32_t)groupEpoch) << 16) | clientSequenceNumber;
+		const uint32_t lastGroupSequence = (((uint32_t)groupEpochs[i]) << 16) | groupSequenceNumbers[i];
+		const uint8_t groupSequenceOld = ((groupSequence - lastGroupSequence) > 0x7FFFFFFF);
+#else
+		const uint16_t groupSequence = clientSequenceNumber, lastGroupSequence = groupSequenceNumbers[i];
+		const uint8_t groupSequenceOld = ((uint16_t)(groupSequence - lastGroupSequence) > 0x7FFF);
+#endif
+		if (groupSynchronized[i] && groupSequence == lastGroupSequence) {
+			// Duplicates are only answered, never applied again
+			if (!(flags & GroupFlagAckRequested))
+				return false;
+			clientMessageRepeated = true;
+		} else {
+			if (groupSynchronized[i] && groupSequenceOld)
+				return false;
+			clientMessageRepeated = false;
+			groupSequenceNumbers[i] = clientSequenceNumber;
+#ifdef IoTEncryptionRequired
+			groupEpochs[i] = groupEpoch;
+#endif
+			groupSynchronized[i] = true;
+#ifdef IoTPersistentState
+			stateDirty = true;
+#endif
+#ifdef IoTPropertyCacheCount
+			invalidatePropertyCache();
+#endif
+		}
+
+		clientResponseRequired = ((flags & GroupFlagAckRequested) ? true : false);
+		validateScene();
+		return true;
+	}
+#endif
+
+#ifdef IoTPropertyCacheCount
+	static _IoTPropertyCacheEntry* findCachedProperty(uint8_t interfaceIndex, uint8_t propertyIndex) {
+		for (uint8_t i = 0; i < IoTPropertyCacheCount; i++) {
+			if (propertyCache[i].used &&
+				propertyCache[i].interfaceIndex == interfaceIndex &&
+				propertyCache[i].propertyIndex == propertyIndex)
+				return propertyCache + i;
+		}
+		return 0;
+	}
+
+	// Answers MessageGetProperty without bothering the user, while the value is fresh
+	static void serveCachedProperty() {
+		if (clientPayloadLength != 2)
+			return;
+
+		_IoTPropertyCacheEntry* entry = findCachedProperty(clientPayloadBuffer[0], clientPayloadBuffer[1]);
+		if (!entry)
+			return;
+
+		if ((uint32_t)(IoTMillis() - entry->time) >= IoTPropertyCacheTime) {
+			entry->used = false;
+			return;
+		}
+
+		uint8_t* dstBuffer = reserveResponse(4 + entry->valueLength);
+		*dstBuffer++ = entry->interfaceIndex;
+		*dstBuffer++ = entry->propertyIndex;
+		*dstBuffer++ = entry->valueLength;
+		*dstBuffer++ = 0;
+		for (uint8_t i = 0; i < entry->valueLength; i++)
+			*dstBuffer++ = entry->value[i];
+		clientResponseReady = true;
+		buildResponse(ResponseOK);
+	}
+
+	// Called by buildResponse() when the user answers MessageGetProperty with
+	// a single property, before the response is sealed or sent
+	static void cacheProperty(const uint8_t* record, uint16_t length) {
+		if (length < 4 ||
+			length > (4 + IoTPropertyCacheValueLength) ||
+			record[0] != clientPayloadBuffer[0] ||
+			record[1] != clientPayloadBuffer[1] ||
+			(((uint16_t)record[2]) | (((uint16_t)record[3]) << 8)) != (length - 4))
+			return;
+
+		_IoTPropertyCacheEntry* entry = findCachedProperty(record[0], record[1]);
+		if (!entry) {
+			// Replace the oldest entry when there are no free ones
+			const uint32_t now = IoTMillis();
+			entry = propertyCache;
+			for (uint8_t i = 0; i < IoTPropertyCacheCount; i++) {
+				if (!propertyCache[i].used) {
+					entry = propertyCache + i;
+					break;
+				}
+				if ((uint32_t)(now - propertyCache[i].time) > (uint32_t)(now - entry->time))
+					entry = propertyCache + i;
+			}
+		}
+
+		entry->time = IoTMillis();
+		entry->used = true;
+		entry->interfaceIndex = record[0];
+		entry->propertyIndex = record[1];
+		entry->valueLength = (uint8_t)(length - 4);
+		for (uint8_t i = 0; i < entry->valueLength; i++)
+			entry->value[i] = record[4 + i];
+	}
+#endif
+
+#ifdef IoTPropertyPlane
+	static void layOutPropertyPlane() {
+		uint16_t slot = 1;
+		for (uint8_t i = 0; i < IoTInterfaceCount; i++) {
+			propertyPlaneFirstSlots[i] = slot;
+			slot += IoTInterfaces[i].propertyCount;
+		}
+		propertyPlaneSlotCount = slot;
+	}
+
+	static IoTPropertyPlaneSlot* findPropertySlot(uint8_t interfaceIndex, uint8_t propertyIndex) {
+		if (!propertyPlane ||
+			interfaceIndex >= IoTInterfaceCount ||
+			propertyIndex >= IoTInterfaces[interfaceIndex].propertyCount)
+			return 0;
+		return propertyPlane + propertyPlaneFirstSlots[interfaceIndex] + propertyIndex;
+	}
+
+	// Answers MessageGetProperty without bothering the user, once a driver has
+	// published the property
+	static void servePublishedProperty() {
+		if (clientPayloadLength != 2)
+			return;
+
+		uint8_t value[PlaneValueLength];
+		uint16_t valueLength;
+		if (!readPublishedProperty(clientPayloadBuffer[0], clientPayloadBuffer[1], value, valueLength))
+			return;
+
+		uint8_t* dstBuffer = reserveResponse(4 + (uint8_t)valueLength);
+		*dstBuffer++ = clientPayloadBuffer[0];
+		*dstBuffer++ = clientPayloadBuffer[1];
+		*dstBuffer++ = (uint8_t)valueLength;
+		*dstBuffer++ = 0;
+		for (uint8_t i = 0; i < valueLength; i++)
+			*dstBuffer++ = value[i];
+		clientResponseReady = true;
+		buildResponse(ResponseOK);
+	}
+#endif
+
+#ifdef IoTTrace
+	static IoTTraceEvent* appendTraceEvent(uint8_t type, uint16_t argument) {
+		IoTTraceEvent* const event = traceEvents + (traceEventCount & (IoTTrace - 1));
+		traceEventCount++;
+		event->timestamp = IoTTraceTimestamp();
+		event->clientId = clientId;
+		event->sequenceNumber = clientSequenceNumber;
+		event->type = type;
+		event->message = clientMessage;
+		event->argument = argument;
+		return event;
+	}
+#endif
+
+	// The user (and the views) trust these lengths from now on
+	static uint8_t validRequestPayload() {
+		switch (clientMessage) {
+		case MessageExecute:
+		case MessageGetProperty:
+			return (clientPayloadLength == 2);
+		case MessageSetProperty:
+			return (clientPayloadLength >= 4 && clientPayloadLength == 4 + _IoTLittleEndian::load16(clientPayloadBuffer + 2));
+#ifdef IoTSetpointStreamCount
+		case MessageOpenStream:
+			return (clientPayloadLength == 4);
+		case MessageCloseStream:
+			return (clientPayloadLength == 1);
+#endif
+		case MessageStreamFrame:
+			return false;
+#ifdef IoTScheduleCount
+		case MessageScheduleScene:
+			return (clientPayloadLength >= 5);
+		case MessageScheduleTimer:
+			return (clientPayloadLength >= 9);
+		case MessageListSchedule:
+			return !clientPayloadLength;
+		case MessageCancelSchedule:
+			return (clientPayloadLength == 1);
+#endif
+#ifdef IoTRuleCount
+		case MessageSetRule:
+			// At least RuleEnd and the operation count of the scene
+			return (clientPayloadLength >= 3 && clientPayloadBuffer[0] && clientPayloadBuffer[0] <= clientPayloadLength - 2);
+		case MessageDeleteRule:
+			return (clientPayloadLength == 1);
+#endif
+#ifdef IoTTimeSeries
+		case MessageGetSeries:
+			return (clientPayloadLength == 7 && clientPayloadBuffer[2] <= SeriesCompressed);
+#endif
+#ifdef IoTAggregateCount
+		case MessageGetAggregates:
+			return (clientPayloadLength == 2);
+#endif
+		}
+		return true;
+	}
+
+#if defined(IoTScheduleCount) || defined(IoTRuleCount)
+	// Makes a stored scene look like a MessageScene that has just been
+	// processed, but whose response must not be sent
+	static void beginStoredScene(IoTClientId id, uint16_t sequenceNumber, const uint8_t* scene, uint16_t length) {
+		clientMessage = MessageScene;
+		clientId = id;
+		clientSequenceNumber = sequenceNumber;
+		clientMessageRepeated = false;
+		clientPayloadBuffer = scene;
+		clientPayloadLength = length;
+		clientResponseReady = false;
+		clientResponseRequired = false;
+#ifdef IoTMulticastDiscovery
+		clientResponseDelay = 0;
+#endif
+#ifdef IoTEncryptionRequired
+		clientEncrypted = false;
+#endif
+		bufferOffset = CurrentResponseHeaderLength;
+#ifdef IoTStreamingResponse
+		flushedLength = 0;
+#endif
+#ifdef IoTPropertyCacheCount
+		invalidatePropertyCache();
+#endif
+	}
+#endif
+
+#ifdef IoTRuleCount
+	// Checks every operand and the depth of the stack at every operation, so
+	// evaluateRule() does not need to check anything
+	static uint8_t verifyRuleCode(const uint8_t* code, uint8_t codeLength) {
+		uint8_t i = 0, depth = 0;
+		while (i < codeLength) {
+			switch (code[i++]) {
+			case RuleEnd:
+				return (depth == 1 && i == codeLength);
+			case RuleLoad:
+				if (i + 2 > codeLength ||
+					code[i] >= IoTInterfaceCount ||
+					code[i + 1] >= IoTInterfaces[code[i]].propertyCount ||
+					IoTInterfaces[code[i]].propertyDescriptors[code[i + 1]].mode == IoTProperty.ModeWriteOnly ||
+					++depth > RuleStackDepth)
+					return false;
+				i += 2;
+				break;
+			case RuleConstant:
+				if (i + 4 > codeLength || ++depth > RuleStackDepth)
+					return false;
+				i += 4;
+				break;
+			case RuleAdd:
+			case RuleSubtract:
+			case RuleMultiply:
+			case RuleLess:
+			case RuleLessOrEqual:
+			case RuleGreater:
+			case RuleGreaterOrEqual:
+			case RuleEqual:
+			case RuleNotEqual:
+			case RuleAnd:
+			case RuleOr:
+				if (depth < 2)
+					return false;
+				depth--;
+				break;
+			case RuleNot:
+				if (!depth)
+					return false;
+				break;
+			default:
+				return false;
+			}
+		}
+		return false;
+	}
+
+	static uint8_t evaluateRule(const uint8_t* code) {
+		float stack[RuleStackDepth];
+		uint8_t depth = 0;
+		for (;;) {
+			switch (*code++) {
+			case RuleLoad:
+				stack[depth++] = ruleInputs[code[0]].value;
+				code += 2;
+				break;
+			case RuleConstant:
+				stack[depth++] = _IoTLittleEndian::loadFloat(code);
+				code += 4;
+				break;
+			case RuleAdd:
+				depth--;
+				stack[depth - 1] += stack[depth];
+				break;
+			case RuleSubtract:
+				depth--;
+				stack[depth - 1] -= stack[depth];
+				break;
+			case RuleMultiply:
+				depth--;
+				stack[depth - 1] *= stack[depth];
+				break;
+			case RuleLess:
+				depth--;
+				stack[depth - 1] = ((stack[depth - 1] < stack[depth]) ? 1.0f : 0.0f);
+				break;
+			case RuleLessOrEqual:
+				depth--;
+				stack[depth - 1] = ((stack[depth - 1] <= stack[depth]) ? 1.0f : 0.0f);
+				break;
+			case RuleGreater:
+				depth--;
+				stack[depth - 1] = ((stack[depth - 1] > stack[depth]) ? 1.0f : 0.0f);
+				break;
+			case RuleGreaterOrEqual:
+				depth--;
+				stack[depth - 1] = ((stack[depth - 1] >= stack[depth]) ? 1.0f : 0.0f);
+				break;
+			case RuleEqual:
+				depth--;
+				stack[depth - 1] = ((stack[depth - 1] == stack[depth]) ? 1.0f : 0.0f);
+				break;
+			case RuleNotEqual:
+				depth--;
+				stack[depth - 1] = ((stack[depth - 1] != stack[depth]) ? 1.0f : 0.0f);
+				break;
+			case RuleAnd:
+				depth--;
+				stack[depth - 1] = ((stack[depth - 1] != 0.0f && stack[depth] != 0.0f) ? 1.0f : 0.0f);
+				break;
+			case RuleOr:
+				depth--;
+				stack[depth - 1] = ((stack[depth - 1] != 0.0f || stack[depth] != 0.0f) ? 1.0f : 0.0f);
+				break;
+			case RuleNot:
+				stack[depth - 1] = ((stack[depth - 1] == 0.0f) ? 1.0f : 0.0f);
+				break;
+			default: // RuleEnd
+				return (stack[0] != 0.0f);
+			}
+		}
+	}
+
+	static void releaseRuleInputs(uint32_t inputMask) {
+		for (uint8_t i = 0; i < IoTRuleInputCount; i++) {
+			if ((inputMask & ((uint32_t)1 << i)) && !--ruleInputs[i].references)
+				knownRuleInputs &= ~((uint32_t)1 << i);
+		}
+	}
+
+	// Replaces the operands of every RuleLoad with an input slot (code has
+	// already been verified), returning false when there are no free slots left
+	static uint8_t linkRuleInputs(uint8_t* code, uint32_t& inputMask) {
+		uint8_t i, j;
+		inputMask = 0;
+		for (;;) {
+			switch (*code++) {
+			case RuleEnd:
+				// Only now the inputs become referenced by the rule
+				for (i = 0; i < IoTRuleInputCount; i++) {
+					if (inputMask & ((uint32_t)1 << i))
+						ruleInputs[i].references++;
+				}
+				return true;
+			case RuleLoad:
+				for (i = 0, j = IoTRuleInputCount; i < IoTRuleInputCount; i++) {
+					if (ruleInputs[i].references || (inputMask & ((uint32_t)1 << i))) {
+						if (ruleInputs[i].interfaceIndex == code[0] && ruleInputs[i].propertyIndex == code[1])
+							break;
+					} else if (j >= IoTRuleInputCount) {
+						j = i;
+					}
+				}
+				if (i >= IoTRuleInputCount) {
+					if (j >= IoTRuleInputCount)
+						return false;
+					i = j;
+					ruleInputs[i].interfaceIndex = code[0];
+					ruleInputs[i].propertyIndex = code[1];
+					knownRuleInputs &= ~((uint32_t)1 << i);
+				}
+				inputMask |= ((uint32_t)1 << i);
+				code[0] = i;
+				code[1] = 0;
+				code += 2;
+				break;
+			case RuleConstant:
+				code += 4;
+				break;
+			}
+		}
+	}
+
+	static void buildSetRuleResponse() {
+		uint8_t i;
+		if (clientMessageRepeated) {
+			for (i = 0; i < IoTRuleCount; i++) {
+				if (rules[i].clientId == clientId &&
+					rules[i].sequenceNumber == clientSequenceNumber) {
+					clientResponseReady = true;
+					writeResponse(i);
+					buildResponse(ResponseOK);
+					return;
+				}
+			}
+		}
+
+		if (clientPayloadLength - 1 > IoTRuleLength) {
+			clientResponseReady = true;
+			buildResponse(ResponsePayloadTooLarge);
+			return;
+		}
+
+		const uint8_t codeLength = clientPayloadBuffer[0];
+		const uint8_t* const code = clientPayloadBuffer + 1;
+		if (!verifyRuleCode(code, codeLength)) {
+			clientResponseReady = true;
+			buildResponse(ResponseInvalidPayload);
+			return;
+		}
+		clientPayloadBuffer += 1 + codeLength;
+		clientPayloadLength -= 1 + codeLength;
+		validateScene();
+		if (clientResponseReady)
+			return;
+
+		clientResponseReady = true;
+		for (i = 0; i < IoTRuleCount; i++) {
+			if (!rules[i].used)
+				break;
+		}
+		if (i >= IoTRuleCount) {
+			buildResponse(ResponseTryAgainLater);
+			return;
+		}
+
+		_IoTRule* const rule = &(rules[i]);
+		memcpy(rule->program, code, codeLength);
+		if (!linkRuleInputs(rule->program, rule->inputMask)) {
+			buildResponse(ResponseTryAgainLater);
+			return;
+		}
+		memcpy(rule->program + codeLength, clientPayloadBuffer, clientPayloadLength);
+		rule->clientId = clientId;
+		rule->sequenceNumber = clientSequenceNumber;
+		rule->used = true;
+		rule->active = false;
+		rule->pending = false;
+		rule->codeLength = codeLength;
+		rule->length = (uint8_t)(codeLength + clientPayloadLength);
+
+		writeResponse(i);
+		buildResponse(ResponseOK);
+	}
+
+	static void buildDeleteRuleResponse() {
+		const uint8_t i = clientPayloadBuffer[0];
+		if (clientMessageRepeated) {
+			// A deleted slot keeps the identity of the request that deleted it,
+			// and a repeated message must never delete whatever took its place
+			buildResponse((i < IoTRuleCount &&
+				!rules[i].used &&
+				rules[i].clientId == clientId &&
+				rules[i].sequenceNumber == clientSequenceNumber) ? ResponseOK : ResponseInvalidPayload);
+			return;
+		}
+		if (i >= IoTRuleCount || !rules[i].used) {
+			buildResponse(ResponseInvalidPayload);
+			return;
+		}
+		rules[i].used = false;
+		if (rules[i].pending) {
+			rules[i].pending = false;
+			pendingRules--;
+		}
+		releaseRuleInputs(rules[i].inputMask);
+		rules[i].clientId = clientId;
+		rules[i].sequenceNumber = clientSequenceNumber;
+		buildResponse(ResponseOK);
+	}
+#endif
+
+#ifdef IoTScheduleCount
+	static void buildTimeSyncResponse() {
+		const uint32_t time = (uint32_t)IoTMillis();
+		uint8_t* const dstBuffer = reserveResponse(12);
+		dstBuffer[0] = clientPayloadBuffer[0];
+		dstBuffer[1] = clientPayloadBuffer[1];
+		dstBuffer[2] = clientPayloadBuffer[2];
+		dstBuffer[3] = clientPayloadBuffer[3];
+		_IoTLittleEndian::store32(dstBuffer + 4, time);
+		_IoTLittleEndian::store32(dstBuffer + 8, time);
+		buildResponse(ResponseOK);
+	}
+
+	// Times are compared by their difference, as IoTMillis() wraps around
+	inline static uint8_t scheduledBefore(uint8_t slotA, uint8_t slotB) {
+		return ((int32_t)(scheduledScenes[slotA].time - scheduledScenes[slotB].time) < 0);
+	}
+
+	inline static void placeScheduled(uint8_t heapIndex, uint8_t slot) {
+		scheduleHeap[heapIndex] = slot;
+		scheduledScenes[slot].heapIndex = heapIndex;
+	}
+
+	static void siftScheduledUp(uint8_t heapIndex) {
+		const uint8_t slot = scheduleHeap[heapIndex];
+		while (heapIndex) {
+			const uint8_t parent = (uint8_t)((heapIndex - 1) >> 1);
+			if (!scheduledBefore(slot, scheduleHeap[parent]))
+				break;
+			placeScheduled(heapIndex, scheduleHeap[parent]);
+			heapIndex = parent;
+		}
+		placeScheduled(heapIndex, slot);
+	}
+
+	static void siftScheduledDown(uint8_t heapIndex) {
+		const uint8_t slot = scheduleHeap[heapIndex];
+		for (;;) {
+			uint16_t child = (((uint16_t)heapIndex) << 1) + 1;
+			if (child >= scheduleHeapSize)
+				break;
+			if (child + 1 < scheduleHeapSize && scheduledBefore(scheduleHeap[child + 1], scheduleHeap[child]))
+				child++;
+			if (!scheduledBefore(scheduleHeap[child], slot))
+				break;
+			placeScheduled(heapIndex, scheduleHeap[child]);
+			heapIndex = (uint8_t)child;
+		}
+		placeScheduled(heapIndex, slot);
+	}
+
+	static void unscheduleSlot(uint8_t slot) {
+		const uint8_t heapIndex = scheduledScenes[slot].heapIndex;
+		scheduledScenes[slot].used = false;
+		scheduleHeapSize--;
+		if (heapIndex < scheduleHeapSize) {
+			const uint8_t lastSlot = scheduleHeap[scheduleHeapSize];
+			placeScheduled(heapIndex, lastSlot);
+			siftScheduledUp(heapIndex);
+			siftScheduledDown(scheduledScenes[lastSlot].heapIndex);
+		}
+	}
+
+	// Handles both MessageScheduleScene and MessageScheduleTimer
+	static void buildScheduleSceneResponse() {
+		uint8_t i;
+		if (clientMessageRepeated) {
+			for (i = 0; i < IoTScheduleCount; i++) {
+				if (scheduledScenes[i].clientId == clientId &&
+					scheduledScenes[i].sequenceNumber == clientSequenceNumber) {
+					clientResponseReady = true;
+					writeResponse(i);
+					buildResponse(ResponseOK);
+					return;
+				}
+			}
+		}
+
+		const uint8_t headerLength = ((clientMessage == MessageScheduleTimer) ? 8 : 4);
+		if (clientPayloadLength - headerLength > IoTScheduleLength) {
+			clientResponseReady = true;
+			buildResponse(ResponsePayloadTooLarge);
+			return;
+		}
+
+		uint32_t time = _IoTLittleEndian::load32(clientPayloadBuffer);
+		uint32_t interval = 0;
+		if (clientMessage == MessageScheduleTimer) {
+			interval = _IoTLittleEndian::load32(clientPayloadBuffer + 4);
+			if (time > 0x7FFFFFFF || interval > 0x7FFFFFFF) {
+				clientResponseReady = true;
+				buildResponse(ResponseInvalidPayload);
+				return;
+			}
+			time += (uint32_t)IoTMillis();
+		}
+		clientPayloadBuffer += headerLength;
+		clientPayloadLength -= headerLength;
+		validateScene();
+		if (clientResponseReady)
+			return;
+
+		clientResponseReady = true;
+		for (i = 0; i < IoTScheduleCount; i++) {
+			if (!scheduledScenes[i].used)
+				break;
+		}
+		if (i >= IoTScheduleCount) {
+			buildResponse(ResponseTryAgainLater);
+			return;
+		}
+
+		_IoTScheduledScene* const scheduledScene = &(scheduledScenes[i]);
+		scheduledScene->time = time;
+		scheduledScene->interval = interval;
+		scheduledScene->clientId = clientId;
+		scheduledScene->sequenceNumber = clientSequenceNumber;
+		scheduledScene->used = true;
+		scheduledScene->length = clientPayloadLength;
+		memcpy(scheduledScene->scene, clientPayloadBuffer, clientPayloadLength);
+		scheduleHeap[scheduleHeapSize] = i;
+		siftScheduledUp(scheduleHeapSize++);
+
+		writeResponse(i);
+		buildResponse(ResponseOK);
+	}
+
+	static void buildListScheduleResponse() {
+		const uint32_t now = (uint32_t)IoTMillis();
+		for (uint8_t i = 0; i < IoTScheduleCount; i++) {
+			const _IoTScheduledScene* const scheduledScene = &(scheduledScenes[i]);
+			if (!scheduledScene->used)
+				continue;
+			const int32_t delay = (int32_t)(scheduledScene->time - now);
+			uint8_t* const dstBuffer = reserveResponse(9);
+			dstBuffer[0] = i;
+			_IoTLittleEndian::store32(dstBuffer + 1, (delay <= 0) ? 0 : (uint32_t)delay);
+			_IoTLittleEndian::store32(dstBuffer + 5, scheduledScene->interval);
+		}
+		buildResponse(ResponseOK);
+	}
+
+	static void buildCancelScheduleResponse() {
+		const uint8_t slot = clientPayloadBuffer[0];
+		if (clientMessageRepeated) {
+			// A cancelled slot keeps the identity of the request that cancelled it,
+			// and a repeated message must never cancel whatever took its place
+			buildResponse((slot < IoTScheduleCount &&
+				!scheduledScenes[slot].used &&
+				scheduledScenes[slot].clientId == clientId &&
+				scheduledScenes[slot].sequenceNumber == clientSequenceNumber) ? ResponseOK : ResponseInvalidPayload);
+			return;
+		}
+		if (slot >= IoTScheduleCount || !scheduledScenes[slot].used) {
+			buildResponse(ResponseInvalidPayload);
+			return;
+		}
+		unscheduleSlot(slot);
+		scheduledScenes[slot].clientId = clientId;
+		scheduledScenes[slot].sequenceNumber = clientSequenceNumber;
+		buildResponse(ResponseOK);
+	}
+#endif
+
+#ifdef IoTAggregateCount
+	// Completes the window in progress when now is past its end (when whole
+	// windows passed without samples, the completed one is empty)
+	static void rollAggregate(_IoTAggregate* aggregate, uint32_t window, uint32_t now) {
+		const uint32_t elapsed = now - aggregate->start;
+		if (elapsed < window)
+			return;
+		if ((elapsed - window) < window && aggregate->count) {
+			aggregate->completedCount = aggregate->count;
+			aggregate->completedMinimum = aggregate->minimum;
+			aggregate->completedMaximum = aggregate->maximum;
+			aggregate->completedMean = (float)(aggregate->sum / (double)aggregate->count);
+		} else {
+			aggregate->completedCount = 0;
+			aggregate->completedMinimum = 0;
+			aggregate->completedMaximum = 0;
+			aggregate->completedMean = 0;
+		}
+		aggregate->start += (elapsed / window) * window;
+		aggregate->count = 0;
+		aggregate->sum = 0;
+	}
+
+	static void buildGetAggregatesResponse() {
+		const uint8_t interfaceIndex = clientPayloadBuffer[0];
+		const uint8_t propertyIndex = clientPayloadBuffer[1];
+		if (interfaceIndex >= IoTInterfaceCount) {
+			buildResponse(ResponseInvalidInterface);
+			return;
+		}
+
+		const uint32_t now = (uint32_t)IoTMillis();
+		uint8_t found = false;
+		for (uint8_t i = 0; i < IoTAggregateCount; i++) {
+			const IoTAggregateDescriptor* const aggregateDescriptor = &(IoTAggregates[i]);
+			if (aggregateDescriptor->interfaceIndex != interfaceIndex || aggregateDescriptor->propertyIndex != propertyIndex)
+				continue;
+			_IoTAggregate* const aggregate = &(aggregates[i]);
+			rollAggregate(aggregate, aggregateDescriptor->window, now);
+			if (!found) {
+				found = true;
+				writeResponse(interfaceIndex);
+				writeResponse(propertyIndex);
+			}
+			uint8_t* const dstBuffer = reserveResponse(AggregateReportLength);
+			_IoTLittleEndian::store32(dstBuffer, aggregateDescriptor->window);
+			_IoTLittleEndian::store32(dstBuffer + 4, now - aggregate->start);
+			_IoTLittleEndian::store32(dstBuffer + 8, aggregate->completedCount);
+			_IoTDataType<float>::store(dstBuffer + 12, aggregate->completedMinimum);
+			_IoTDataType<float>::store(dstBuffer + 16, aggregate->completedMaximum);
+			_IoTDataType<float>::store(dstBuffer + 20, aggregate->completedMean);
+		}
+		buildResponse(found ? ResponseOK : ResponseInvalidInterfaceProperty);
+	}
+#endif
+
+#ifdef IoTSetpointStreamCount
+	static void buildStreamReport(uint8_t streamId) {
+		const _IoTSetpointStream* const stream = &(setpointStreams[streamId]);
+		const uint32_t jitter = stream->jitter >> 4;
+		uint8_t* const dstBuffer = reserveResponse(StreamReportLength);
+		dstBuffer[0] = streamId;
+		_IoTLittleEndian::store16(dstBuffer + 1, stream->sequenceNumber);
+		_IoTLittleEndian::store32(dstBuffer + 3, stream->receivedFrames);
+		_IoTLittleEndian::store32(dstBuffer + 7, stream->lostFrames);
+		_IoTLittleEndian::store32(dstBuffer + 11, stream->lateFrames);
+		_IoTLittleEndian::store16(dstBuffer + 15, (jitter > 0xFFFF) ? 0xFFFF : (uint16_t)jitter);
+		buildResponse(ResponseOK);
+	}
+
+	static void buildOpenStreamResponse() {
+		const uint8_t interfaceIndex = clientPayloadBuffer[0];
+		if (interfaceIndex >= IoTInterfaceCount) {
+			buildResponse(ResponseInvalidInterface);
+			return;
+		}
+
+		const IoTInterfaceDescriptor* const interfaceDescriptor = &(IoTInterfaces[interfaceIndex]);
+		const uint8_t propertyIndex = clientPayloadBuffer[1];
+		if (propertyIndex >= interfaceDescriptor->propertyCount ||
+			interfaceDescriptor->propertyDescriptors[propertyIndex].unitNum == IoTProperty.UnitUTF8Text) {
+			buildResponse(ResponseInvalidInterfaceProperty);
+			return;
+		}
+
+		const IoTPropertyDescriptor* const propertyDescriptor = &(interfaceDescriptor->propertyDescriptors[propertyIndex]);
+		if (propertyDescriptor->mode == IoTProperty.ModeReadOnly) {
+			buildResponse(ResponseInterfacePropertyReadOnly);
+			return;
+		}
+
+		// The same property is always bound to the same stream, so a repeated
+		// message gets the same stream id
+		uint8_t i, freeStream = IoTSetpointStreamCount;
+		for (i = 0; i < IoTSetpointStreamCount; i++) {
+			const _IoTSetpointStream* const stream = &(setpointStreams[i]);
+			if (stream->open) {
+				if (stream->clientId == clientId &&
+					stream->interfaceIndex == interfaceIndex &&
+					stream->propertyIndex == propertyIndex)
+					break;
+			} else if (freeStream == IoTSetpointStreamCount) {
+				freeStream = i;
+			}
+		}
+
+		if (i >= IoTSetpointStreamCount) {
+			if (freeStream == IoTSetpointStreamCount) {
+				buildResponse(ResponseTryAgainLater);
+				return;
+			}
+			i = freeStream;
+		} else if (clientMessageRepeated) {
+			writeResponse(i);
+			buildResponse(ResponseOK);
+			return;
 		}
 
+		_IoTSetpointStream* const stream = &(setpointStreams[i]);
+		stream->clientId = clientId;
+		stream->open = true;
+		stream->synchronized = false;
+#ifdef IoTExtendedClientId
+		stream->extendedHeader = clientExtendedHeader;
+#endif
+		stream->interfaceIndex = interfaceIndex;
+		stream->propertyIndex = propertyIndex;
+		stream->valueLength = (uint16_t)IoTProperty.dataTypeSize(propertyDescriptor->dataType) * propertyDescriptor->elementCount;
+		stream->reportInterval = _IoTLittleEndian::load16(clientPayloadBuffer + 2);
+		stream->framesUntilReport = stream->reportInterval;
+		stream->sequenceNumber = 0;
+		stream->transitTime = 0;
+		stream->jitter = 0;
+		stream->receivedFrames = 0;
+		stream->lostFrames = 0;
+		stream->lateFrames = 0;
+
+		writeResponse(i);
 		buildResponse(ResponseOK);
 	}
 
-	static void buildDescribeInterfaceResponse(uint8_t interfaceIndex) {
+	static void buildCloseStreamResponse() {
+		const uint8_t i = clientPayloadBuffer[0];
+		// A repeated message finds the stream already closed
+		if (i >= IoTSetpointStreamCount ||
+			setpointStreams[i].clientId != clientId ||
+			(!setpointStreams[i].open && !clientMessageRepeated)) {
+			buildResponse(ResponseInvalidPayload);
+			return;
+		}
+		setpointStreams[i].open = false;
+		buildStreamReport(i);
+	}
+
+	// Returns false when the frame must be silently discarded
+	static uint8_t processStreamFrame(const uint8_t* srcBuffer, uint16_t length) {
+		if (length < (StreamFrameHeaderLength + EndOfPacketLength) ||
+			srcBuffer[length - 1] != EndOfPacket ||
+			srcBuffer[1] >= IoTSetpointStreamCount)
+			return false;
+
+		const uint8_t i = srcBuffer[1];
+		_IoTSetpointStream* const stream = &(setpointStreams[i]);
+		if (!stream->open ||
+			clientIPs[stream->clientId] != currentClientIP ||
+			clientPorts[stream->clientId] != currentClientPort ||
+			stream->valueLength != length - (StreamFrameHeaderLength + EndOfPacketLength))
+			return false;
+
+		const uint16_t sequenceNumber = _IoTLittleEndian::load16(srcBuffer + 2);
+		stream->receivedFrames++;
+		if (stream->synchronized) {
+			const uint16_t gap = (uint16_t)(sequenceNumber - stream->sequenceNumber);
+			if (!gap || gap > 0x7FFF) {
+				// A newer value has already been applied
+				stream->lateFrames++;
+				return false;
+			}
+			stream->lostFrames += gap - 1;
+		}
+
+		// RFC 3550, section 6.4.1 (the sender clock and ours do not need to
+		// agree, only the variation of the transit time matters)
+		const uint16_t transitTime = (uint16_t)((uint16_t)IoTMillis() - _IoTLittleEndian::load16(srcBuffer + 4));
+		if (stream->synchronized) {
+			const int16_t d = (int16_t)(transitTime - stream->transitTime);
+			stream->jitter += (uint32_t)((d < 0) ? -(int32_t)d : (int32_t)d) - ((stream->jitter + 8) >> 4);
+		}
+		stream->transitTime = transitTime;
+		stream->sequenceNumber = sequenceNumber;
+		stream->synchronized = true;
+
+#ifdef IoTClientTimeout
+		clientLastSeen[stream->clientId] = timerTick;
+#endif
+#ifdef IoTPropertyCacheCount
+		invalidatePropertyCache(stream->interfaceIndex, stream->propertyIndex);
+#endif
+
+		currentStream = i;
+		clientId = stream->clientId;
+#ifdef IoTExtendedClientId
+		clientExtendedHeader = stream->extendedHeader;
+#endif
+		clientSequenceNumber = sequenceNumber;
+		clientMessageRepeated = false;
+		clientPayloadBuffer = srcBuffer + StreamFrameHeaderLength;
+		clientPayloadLength = stream->valueLength;
+		clientResponseReady = false;
+		clientResponseRequired = false;
+#ifdef IoTMulticastDiscovery
+		clientResponseDelay = 0;
+#endif
+		bufferOffset = CurrentResponseHeaderLength;
+#ifdef IoTStreamingResponse
+		flushedLength = 0;
+#endif
+
+		if (stream->reportInterval && !--stream->framesUntilReport) {
+			// The report is built before the user applies the frame, but it is
+			// only sent afterwards (except when streaming the response, in
+			// which case responseRequired() must already be true)
+			stream->framesUntilReport = stream->reportInterval;
+			clientMessage = ServerMessageStreamReport;
+			clientResponseRequired = true;
+			buildStreamReport(i);
+		}
+		clientMessage = MessageStreamFrame;
+		return true;
+	}
+#endif
+
+	static uint8_t validatePropertyRange() {
+		if (clientPayloadLength < 4)
+			return ResponseInvalidPayload;
+
+		const uint8_t interfaceIndex = clientPayloadBuffer[0];
 		if (interfaceIndex >= IoTInterfaceCount)
-			return buildResponse(ResponseInvalidInterface);
+			return ResponseInvalidInterface;
 
 		const IoTInterfaceDescriptor* const interfaceDescriptor = &(IoTInterfaces[interfaceIndex]);
+		if (clientPayloadBuffer[1] >= interfaceDescriptor->propertyCount)
+			return ResponseInvalidInterfaceProperty;
+
+		const IoTPropertyDescriptor* const propertyDescriptor = &(interfaceDescriptor->propertyDescriptors[clientPayloadBuffer[1]]);
+		if (propertyDescriptor->unitNum == IoTProperty.UnitUTF8Text)
+			return ResponseInvalidInterfaceProperty;
+
+		const uint8_t count = clientPayloadBuffer[3];
+		if (!count || (uint16_t)clientPayloadBuffer[2] + count > propertyDescriptor->elementCount)
+			return ResponseInvalidInterfacePropertyValue;
+
+		if (clientMessage == MessageGetPropertyRange) {
+			if (clientPayloadLength != 4)
+				return ResponseInvalidPayload;
+			if (propertyDescriptor->mode == IoTProperty.ModeWriteOnly)
+				return ResponseInterfacePropertyWriteOnly;
+		} else {
+			if (clientPayloadLength != 4 + (uint16_t)IoTProperty.dataTypeSize(propertyDescriptor->dataType) * count)
+				return ResponseInvalidPayload;
+			if (propertyDescriptor->mode == IoTProperty.ModeReadOnly)
+				return ResponseInterfacePropertyReadOnly;
+		}
+		return ResponseOK;
+	}
 
-		writeResponse(interfaceIndex);
+	template<typename T> inline static void writeResponseElements(const T* values, uint16_t count) {
+		const uint16_t length = count * (uint16_t)sizeof(T);
+#if defined(LittleEndianHost)
+		// The values are already laid out exactly as they must be sent
+		writeResponse(values, length);
+#elif defined(IoTStreamingResponse)
+		for (uint16_t i = 0; i < count; i++)
+			_IoTDataType<T>::store(reserveResponse(sizeof(T)), values[i]);
+#else
+		uint8_t* dstBuffer = buffer + bufferOffset;
+		bufferOffset += length;
+		for (uint16_t i = 0; i < count; i++, dstBuffer += sizeof(T))
+			_IoTDataType<T>::store(dstBuffer, values[i]);
+#endif
+	}
 
-		uint8_t nameLen = (uint8_t)strlen(interfaceDescriptor->name);
-		writeResponse(nameLen);
-		writeResponse(interfaceDescriptor->name, nameLen);
+#ifdef IoTTimeSeries
+	static uint8_t validateSeries() {
+		const uint8_t interfaceIndex = clientPayloadBuffer[0];
+		if (interfaceIndex >= IoTInterfaceCount)
+			return ResponseInvalidInterface;
 
-		writeResponse(interfaceDescriptor->type);
+		const IoTInterfaceDescriptor* const interfaceDescriptor = &(IoTInterfaces[interfaceIndex]);
+		if (clientPayloadBuffer[1] >= interfaceDescriptor->propertyCount)
+			return ResponseInvalidInterfaceProperty;
 
-		const uint8_t propertyCount = interfaceDescriptor->propertyCount;
-		writeResponse(propertyCount);
+		const IoTPropertyDescriptor* const propertyDescriptor = &(interfaceDescriptor->propertyDescriptors[clientPayloadBuffer[1]]);
+		if (propertyDescriptor->unitNum == IoTProperty.UnitUTF8Text || propertyDescriptor->elementCount != 1)
+			return ResponseInvalidInterfaceProperty;
+		if (propertyDescriptor->mode == IoTProperty.ModeWriteOnly)
+			return ResponseInterfacePropertyWriteOnly;
+
+		return ResponseOK;
+	}
+
+	// Keeps everything the next compressed sample depends upon, and the bits
+	// still waiting to complete a byte (nothing is written while dry, so the
+	// same samples can be measured first, and then written)
+	struct _IoTSeriesEncoder {
+	public:
+		uint64_t value;
+		uint32_t bitCount;
+		uint32_t timestamp;
+		int32_t delta;
+		uint32_t pending;
+		uint8_t pendingBits;
+		uint8_t dry;
+		uint8_t leading;
+		uint8_t trailing;
+	};
+
+	static void seriesWriteBits(_IoTSeriesEncoder& encoder, uint32_t bits, uint8_t count) {
+		encoder.bitCount += count;
+		if (encoder.dry)
+			return;
+		// At most 7 bits are pending, so 24 more bits can be appended at once
+		while (count) {
+			const uint8_t chunk = ((count > 24) ? 24 : count);
+			count -= chunk;
+			encoder.pending = (encoder.pending << chunk) | ((bits >> count) & ((((uint32_t)1) << chunk) - 1));
+			encoder.pendingBits += chunk;
+			while (encoder.pendingBits >= 8) {
+				encoder.pendingBits -= 8;
+				writeResponse((uint8_t)(encoder.pending >> encoder.pendingBits));
+			}
+		}
+	}
+
+	static void seriesWriteBits64(_IoTSeriesEncoder& encoder, uint64_t bits, uint8_t count) {
+		if (count > 32) {
+			seriesWriteBits(encoder, (uint32_t)(bits >> 32), count - 32);
+			count = 32;
+		}
+		seriesWriteBits(encoder, (uint32_t)bits, count);
+	}
+
+	static void seriesWriteVarint(_IoTSeriesEncoder& encoder, uint64_t value) {
+		while (value > 0x7F) {
+			seriesWriteBits(encoder, (uint32_t)(value & 0x7F) | 0x80, 8);
+			value >>= 7;
+		}
+		seriesWriteBits(encoder, (uint32_t)value, 8);
+	}
+
+	inline static uint8_t seriesLeadingZeros(uint64_t value) {
+#ifdef __GNUC__
+		return (uint8_t)__builtin_clzll(value);
+#else
+		uint8_t count = 0;
+		while (!(value & 0x8000000000000000ULL)) {
+			value <<= 1;
+			count++;
+		}
+		return count;
+#endif
+	}
+
+	inline static uint8_t seriesTrailingZeros(uint64_t value) {
+#ifdef __GNUC__
+		return (uint8_t)__builtin_ctzll(value);
+#else
+		uint8_t count = 0;
+		while (!(value & 1)) {
+			value >>= 1;
+			count++;
+		}
+		return count;
+#endif
+	}
+
+	// value holds the bits of floats, and integers already extended to 64 bits
+	static void seriesWriteSample(_IoTSeriesEncoder& encoder, uint8_t dataType, uint8_t first, uint32_t timestamp, uint64_t value) {
+		if (first) {
+			seriesWriteBits(encoder, timestamp, 32);
+			encoder.delta = 0;
+		} else {
+			const int32_t delta = (int32_t)(timestamp - encoder.timestamp);
+			const int32_t deltaOfDeltas = (int32_t)((uint32_t)delta - (uint32_t)encoder.delta);
+			seriesWriteVarint(encoder, (uint32_t)((((uint32_t)deltaOfDeltas) << 1) ^ (uint32_t)(deltaOfDeltas >> 31)));
+			encoder.delta = delta;
+		}
+		encoder.timestamp = timestamp;
+
+		if (dataType == IoTProperty.DataTypeFloat32 || dataType == IoTProperty.DataTypeFloat64) {
+			const uint8_t size = ((dataType == IoTProperty.DataTypeFloat32) ? 32 : 64);
+			if (first) {
+				seriesWriteBits64(encoder, value, size);
+				encoder.leading = 0xFF;
+			} else {
+				const uint64_t xored = value ^ encoder.value;
+				if (!xored) {
+					seriesWriteBits(encoder, 0, 1);
+				} else {
+					uint8_t leading = seriesLeadingZeros(xored) - (64 - size);
+					const uint8_t trailing = seriesTrailingZeros(xored);
+					if (leading > 31)
+						leading = 31;
+					if (encoder.leading != 0xFF && leading >= encoder.leading && trailing >= encoder.trailing) {
+						seriesWriteBits(encoder, 2, 2);
+						seriesWriteBits64(encoder, xored >> encoder.trailing, size - encoder.leading - encoder.trailing);
+					} else {
+						const uint8_t meaningful = size - leading - trailing;
+						seriesWriteBits(encoder, 3, 2);
+						seriesWriteBits(encoder, leading, 5);
+						seriesWriteBits(encoder, meaningful - 1, (size == 32) ? 5 : 6);
+						seriesWriteBits64(encoder, xored >> trailing, meaningful);
+						encoder.leading = leading;
+						encoder.trailing = trailing;
+					}
+				}
+			}
+		} else {
+			const int64_t difference = (int64_t)(first ? value : (value - encoder.value));
+			seriesWriteVarint(encoder, (((uint64_t)difference) << 1) ^ (uint64_t)(difference >> 63));
+		}
+		encoder.value = value;
+	}
+
+	static uint64_t seriesValue(uint8_t dataType, const uint8_t* srcBuffer) {
+		switch (dataType) {
+		case IoTProperty.DataTypeS8:
+			return (uint64_t)(int64_t)(int8_t)srcBuffer[0];
+		case IoTProperty.DataTypeS16:
+			return (uint64_t)(int64_t)(int16_t)_IoTLittleEndian::load16(srcBuffer);
+		case IoTProperty.DataTypeS32:
+			return (uint64_t)(int64_t)(int32_t)_IoTLittleEndian::load32(srcBuffer);
+		case IoTProperty.DataTypeU8:
+			return srcBuffer[0];
+		case IoTProperty.DataTypeU16:
+			return _IoTLittleEndian::load16(srcBuffer);
+		case IoTProperty.DataTypeRGBTriplet:
+			return ((uint64_t)srcBuffer[0]) | (((uint64_t)srcBuffer[1]) << 8) | (((uint64_t)srcBuffer[2]) << 16);
+		case IoTProperty.DataTypeU32:
+		case IoTProperty.DataTypeFloat32:
+			return _IoTLittleEndian::load32(srcBuffer);
+		}
+		return _IoTLittleEndian::load64(srcBuffer);
+	}
+#endif
+
+#ifdef IoTActuatorQueue
+	static uint8_t queueActuation(uint8_t operation, uint8_t interfaceIndex, uint8_t propertyIndex, const void* value, uint16_t length) {
+		if (length > IoTActuatorValueLength)
+			return false;
+
+		_IoTActuatorMailbox* mailbox = 0;
+		for (uint16_t i = 0; i < IoTActuatorQueue; i++) {
+			_IoTActuatorMailbox* const m = actuatorMailboxes + i;
+			if (!m->used) {
+				if (!mailbox)
+					mailbox = m;
+				break;
+			}
+			if (m->operation == operation && m->interfaceIndex == interfaceIndex && m->propertyIndex == propertyIndex) {
+				mailbox = m;
+				break;
+			}
+		}
+		if (!mailbox) {
+			// A mailbox can only become pending again here, and the consumer
+			// clears pending after advancing actuatorHead, so actuatorDone only
+			// matches actuatorHead when the mailbox found is not being read
+			for (uint16_t i = 0; i < IoTActuatorQueue; i++) {
+				if (!actuatorMailboxes[i].pending) {
+					mailbox = actuatorMailboxes + i;
+					break;
+				}
+			}
+			IoTMemoryBarrier();
+			if (!mailbox || actuatorDone != actuatorHead)
+				return false;
+			mailbox->used = false;
+		}
+		if (!mailbox->used) {
+			mailbox->used = true;
+			mailbox->operation = operation;
+			mailbox->interfaceIndex = interfaceIndex;
+			mailbox->propertyIndex = propertyIndex;
+		}
+
+		const uint32_t sequence = mailbox->sequence;
+		mailbox->sequence = sequence + 1;
+		IoTMemoryBarrier();
+		for (uint16_t i = 0; i < length; i++)
+			mailbox->value[i] = ((const uint8_t*)value)[i];
+		mailbox->valueLength = (uint8_t)length;
+		IoTMemoryBarrier();
+		mailbox->sequence = sequence + 2;
+		IoTMemoryBarrier();
+
+		// The value must be written before pending is checked, and the consumer
+		// clears pending before reading the value, so no values are lost
+		if (!mailbox->pending) {
+			mailbox->pending = true;
+			actuatorRing[actuatorTail & (IoTActuatorQueue - 1)] = (uint8_t)(mailbox - actuatorMailboxes);
+			IoTMemoryBarrier();
+			actuatorTail = actuatorTail + 1;
+		}
+		return true;
+	}
+#endif
+
+	static uint8_t validateSceneOperation(const uint8_t* operation, uint16_t availableLength, uint16_t& operationLength) {
+		if (availableLength < 3)
+			return ResponseInvalidPayload;
+
+		const uint8_t interfaceIndex = operation[1];
+		if (interfaceIndex >= IoTInterfaceCount)
+			return ResponseInvalidInterface;
 
-		for (uint8_t i = 0; i < propertyCount; i++) {
-			const IoTPropertyDescriptor* const propertyDescriptor = &(interfaceDescriptor->propertyDescriptors[i]);
+		const IoTInterfaceDescriptor* const interfaceDescriptor = &(IoTInterfaces[interfaceIndex]);
 
-			nameLen = (uint8_t)strlen(propertyDescriptor->name);
-			writeResponse(nameLen);
-			writeResponse(propertyDescriptor->name, nameLen);
-			writeResponse(&(propertyDescriptor->mode), 6);
+		switch (operation[0]) {
+		case SceneExecute:
+			operationLength = 3;
+			if (operation[2] >= IoTInterface.commandCount(interfaceDescriptor->type))
+				return ResponseInvalidInterfaceCommand;
+			return ResponseOK;
+		case SceneSetProperty:
+			if (availableLength < 5)
+				return ResponseInvalidPayload;
+			operationLength = 5 + (((uint16_t)operation[3]) | (((uint16_t)operation[4]) << 8));
+			if (operationLength > availableLength)
+				return ResponseInvalidPayload;
+			if (operation[2] >= interfaceDescriptor->propertyCount)
+				return ResponseInvalidInterfaceProperty;
+			{
+				const IoTPropertyDescriptor* const propertyDescriptor = &(interfaceDescriptor->propertyDescriptors[operation[2]]);
+				if (propertyDescriptor->mode == IoTProperty.ModeReadOnly)
+					return ResponseInterfacePropertyReadOnly;
+				const uint16_t valueLength = operationLength - 5;
+				if (propertyDescriptor->unitNum == IoTProperty.UnitUTF8Text) {
+					if (!valueLength || valueLength > propertyDescriptor->elementCount)
+						return ResponseInvalidInterfacePropertyValue;
+				} else if (valueLength != (uint16_t)IoTProperty.dataTypeSize(propertyDescriptor->dataType) * propertyDescriptor->elementCount) {
+					return ResponseInvalidInterfacePropertyValue;
+				}
+			}
+			return ResponseOK;
 		}
-
-		buildResponse(ResponseOK);
+		return ResponseInvalidPayload;
 	}
 
-	static void buildHandshakeResponse(uint16_t sequenceNumber) {
-		uint8_t i;
-		// First, try to find the client itself
-		for (i = 0; i < IoTClientCount; i++) {
-			if (clients[i].ip == currentClientIP &&
-				clients[i].port == currentClientPort)
-				break;
+	static void validateScene() {
+		if (!clientPayloadLength) {
+			clientResponseReady = true;
+			buildResponse(ResponseInvalidPayload);
+			return;
 		}
-		if (i >= IoTClientCount) {
-			// If not found, try to find an empty client slot
-			for (i = 0; i < IoTClientCount; i++) {
-				if (!clients[i].ip)
-					break;
-			}
-			if (i >= IoTClientCount) {
-				// Since there were no empty slots, we will have to overwrite someone...
-				// TODO: create a RLU list of client id's
-				i = 0;
+
+		const uint8_t count = clientPayloadBuffer[0];
+		const uint8_t* operation = clientPayloadBuffer + 1;
+		uint16_t availableLength = clientPayloadLength - 1;
+		for (uint8_t i = 0; i < count; i++) {
+			uint16_t operationLength = 0;
+			const uint8_t responseCode = validateSceneOperation(operation, availableLength, operationLength);
+			if (responseCode != ResponseOK) {
+				clientResponseReady = true;
+				writeResponse(i);
+				buildResponse(responseCode);
+				return;
 			}
+			operation += operationLength;
+			availableLength -= operationLength;
 		}
-		clients[i].sequenceNumber = sequenceNumber;
-		clients[i].ip = currentClientIP;
-		clients[i].port = currentClientPort;
 
-		writeResponse(i);
+		if (availableLength) {
+			clientResponseReady = true;
+			writeResponse(count);
+			buildResponse(ResponseInvalidPayload);
+		}
+	}
 
-		buildResponse(ResponseOK);
+	static void buildHeader(uint8_t responseCode, uint16_t payloadLength) {
+		uint8_t* dstBuffer = buffer;
+#ifdef IoTExtendedClientId
+		*dstBuffer++ = (clientExtendedHeader ? StartOfExtendedPacket : StartOfPacket);
+		*dstBuffer++ = clientMessage;
+		*dstBuffer++ = (uint8_t)clientId;
+		if (clientExtendedHeader)
+			*dstBuffer++ = (uint8_t)(clientId >> 8);
+#else
+		*dstBuffer++ = StartOfPacket;
+		*dstBuffer++ = clientMessage;
+		*dstBuffer++ = clientId;
+#endif
+		*dstBuffer++ = (uint8_t)clientSequenceNumber;
+		*dstBuffer++ = (uint8_t)(clientSequenceNumber >> 8);
+		*dstBuffer++ = responseCode;
+		*dstBuffer++ = (uint8_t)payloadLength;
+		*dstBuffer = (uint8_t)(payloadLength >> 8);
 	}
 
-	static void buildGoodByeResponse() {
-		buildResponse(ResponseOK);
-		clients[clientId].sequenceNumber = MaximumSequenceNumber;
-		clients[clientId].ip = 0;
-		clients[clientId].port = 0;
+#ifdef IoTStreamingResponse
+	static void flushResponse() {
+		// The response code and the payload length go in the trailer
+		if (!flushedLength)
+			buildHeader(StreamedResponseCode, StreamedPayloadLength);
+		IoTResponseSinkWrite(buffer, bufferOffset - flushedLength);
+		flushedLength = bufferOffset;
+	}
+
+	inline static uint8_t* reserveResponse(uint8_t length) {
+		if ((bufferOffset - flushedLength) + length > IoTStreamingChunkLength)
+			flushResponse();
+		uint8_t* dstBuffer = buffer + (bufferOffset - flushedLength);
+		bufferOffset += length;
+		return dstBuffer;
+	}
+#else
+	inline static uint8_t* reserveResponse(uint8_t length) {
+		uint8_t* dstBuffer = buffer + bufferOffset;
+		bufferOffset += length;
+		return dstBuffer;
 	}
+#endif
 
 	static void buildResponseEnumDescriptor(uint8_t interfaceIndex, uint8_t propertyIndex, const uint8_t* enumDescriptors, uint8_t count, uint8_t valueSize) {
 		writeResponse(interfaceIndex);
@@ -632,87 +3766,93 @@ private:
 		buildResponse(ResponseOK);
 	}
 
-public:
-	static uint32_t currentClientIP;
-	static uint16_t currentClientPort;
-
-	static void begin() {
-		uint8_t i;
-		for (i = 0; i < IoTClientCount; i++) {
-			clients[i].sequenceNumber = MaximumSequenceNumber;
-			clients[i].ip = 0;
-			clients[i].port = 0;
-		}
-		nameLength = 0;
-#ifdef IoTNameReadOnly
-		name = 0;
-#else
-		for (i = 0; i < IoTMaxNameLength; i++)
-			name[i] = 0;
-#endif
-#ifndef IoTNoPassword
-		passwordLength = 0;
-#ifdef IoTPasswordReadOnly
-		password = 0;
-#else
-		for (i = 0; i < IoTMaxPasswordLength; i++)
-			password[i] = 0;
+	static uint8_t processPacket(const uint8_t* srcBuffer, uint16_t length) {
+#ifdef IoTExternalResponseBuffer
+		if (!buffer)
+			return false;
 #endif
+#ifdef IoTSetpointStreamCount
+		if (length && srcBuffer[0] == StartOfStreamFrame)
+			return processStreamFrame(srcBuffer, length);
 #endif
-		clientId = InvalidClientId;
-		clientSequenceNumber = 0;
-		clientMessage = 0;
-		clientMessageRepeated = false;
-		clientPayloadBuffer = 0;
-		clientPayloadLength = 0;
-		clientResponseReady = false;
-
-		bufferOffset = ResponseHeaderLength;
-	}
-
-	inline static uint8_t isBigEndian() {
-		const uint32_t x = 0x03020100;
-		return ((uint8_t*)&x)[0];
-	}
-
-	static uint8_t process(const uint8_t* srcBuffer, uint16_t length) {
+#ifdef IoTExtendedClientId
+		if (length < (RequestHeaderLength + EndOfPacketLength) ||
+			srcBuffer[length - 1] != EndOfPacket)
+			return false;
+		if (srcBuffer[0] == StartOfExtendedPacket)
+			clientExtendedHeader = 1;
+		else if (srcBuffer[0] == StartOfPacket)
+			clientExtendedHeader = 0;
+		else
+			return false;
+		if (length < (CurrentRequestHeaderLength + EndOfPacketLength))
+			return false;
+#else
 		if (length < (RequestHeaderLength + EndOfPacketLength) ||
 			srcBuffer[0] != StartOfPacket ||
 			srcBuffer[length - 1] != EndOfPacket)
 			return false;
+#endif
 
 		srcBuffer++;
+#ifdef IoTEncryptionRequired
+		const uint8_t* const header = srcBuffer;
+		clientEncrypted = false;
+#endif
 		clientMessage = *srcBuffer++;
 		clientId = *srcBuffer++;
+#ifdef IoTExtendedClientId
+		if (clientExtendedHeader)
+			clientId |= ((uint16_t)*srcBuffer++) << 8;
+		else if (clientId == InvalidShortClientId)
+			clientId = InvalidClientId;
+#endif
 		clientSequenceNumber = ((uint16_t)srcBuffer[0]) | (((uint16_t)srcBuffer[1]) << 8);
 		srcBuffer += 2;
 
 		uint16_t clientPasswordLength = *srcBuffer++;
-		if (clientPasswordLength > length - (RequestHeaderLength + EndOfPacketLength))
+		if (clientPasswordLength > length - (CurrentRequestHeaderLength + EndOfPacketLength))
 			return false;
 		const uint8_t* clientPassword = srcBuffer;
 		srcBuffer += clientPasswordLength;
 
 		clientPayloadLength = ((uint16_t)srcBuffer[0]) | (((uint16_t)srcBuffer[1]) << 8);
-		if (clientPayloadLength != length - clientPasswordLength - (RequestHeaderLength + EndOfPacketLength))
+		if (clientPayloadLength != length - clientPasswordLength - (CurrentRequestHeaderLength + EndOfPacketLength))
 			return false;
 		srcBuffer += 2;
 		clientPayloadBuffer = srcBuffer;
 
 		clientResponseReady = false;
-		bufferOffset = ResponseHeaderLength;
+		clientResponseRequired = true;
+#ifdef IoTMulticastDiscovery
+		clientResponseDelay = 0;
+#endif
+		bufferOffset = CurrentResponseHeaderLength;
+#ifdef IoTStreamingResponse
+		flushedLength = 0;
+#endif
 
 		switch (clientMessage) {
 		case MessageQueryDevice:
 			clientResponseReady = true;
-			if (clientPayloadLength ||
+			if ((clientPayloadLength && clientPayloadLength != 2) ||
 				clientId != InvalidClientId ||
-				clientSequenceNumber != MaximumSequenceNumber)
+				clientSequenceNumber != MaximumSequenceNumber) {
 				buildResponse(ResponseInvalidPayload);
-			else if (clientPasswordLength)
+			} else if (clientPasswordLength) {
 				buildResponse(ResponseWrongPassword);
-			else
+			} else {
+#ifdef IoTMulticastDiscovery
+				if (clientPayloadLength) {
+					const uint32_t fleetSize = ((uint32_t)clientPayloadBuffer[0]) | (((uint32_t)clientPayloadBuffer[1]) << 8);
+					uint32_t window = fleetSize * IoTDiscoverySlotTime;
+					if (window > IoTDiscoveryMaxDelay)
+						window = IoTDiscoveryMaxDelay;
+					clientResponseDelay = (uint16_t)(IoTRandom32() % (window + 1));
+				}
+#endif
 				buildQueryDeviceResponse();
+			}
 			break;
 		case MessageDescribeInterface:
 			clientResponseReady = true;
@@ -782,13 +3922,37 @@ public:
 			}
 #endif
 #else
+			(void)clientPassword;
 			clientResponseReady = true;
 			buildResponse(ResponsePasswordReadOnly);
 #endif
 
 			// This message must be handled by the user
 			break;
+		case MessageGroup:
+#ifdef IoTGroupCount
+#ifdef IoTEncryptionRequired
+			if (!processGroup(header, clientPassword, clientPasswordLength))
+#else
+			if (!processGroup(0, clientPassword, clientPasswordLength))
+#endif
+				return false;
+			break;
+#else
+			// Devices that do not belong to any groups just ignore group messages
+			return false;
+#endif
 		default:
+#ifdef IoTEncryptionRequired
+			// After the handshake, the tag authenticates the client, so the password is not sent anymore
+			if (clientMessage != MessageHandshake) {
+				if (clientPasswordLength) {
+					clientResponseReady = true;
+					buildResponse(ResponseWrongPassword);
+					break;
+				}
+			} else
+#endif
 			// Validate the message and the password
 			if (clientPasswordLength != passwordLength) {
 				clientResponseReady = true;
@@ -812,44 +3976,491 @@ public:
 
 			if (clientMessage == MessageHandshake) {
 				clientResponseReady = true;
-				if (clientPayloadLength ||
+#ifdef IoTHandshakeCookies
+				if ((clientPayloadLength != HandshakePayloadLength && clientPayloadLength != (HandshakePayloadLength + HandshakeCookieLength)) ||
+#else
+				if (clientPayloadLength != HandshakePayloadLength ||
+#endif
 					clientId != InvalidClientId)
 					buildResponse(ResponseInvalidPayload);
+#ifdef IoTHandshakeCookies
+				// Only clients that can prove they own their address get a slot
+				else if (clientPayloadLength == HandshakePayloadLength ||
+					!validHandshakeCookie(clientPayloadBuffer + HandshakePayloadLength))
+					buildHandshakeCookieResponse();
+#endif
 				else
-					buildHandshakeResponse(clientSequenceNumber);
+					buildHandshakeResponse(clientSequenceNumber, clientPayloadBuffer);
 				break;
 			}
 
 			// Try to find the client
 			if (clientId >= IoTClientCount ||
-				clients[clientId].ip != currentClientIP ||
-				clients[clientId].port != currentClientPort) {
+				clientIPs[clientId] != currentClientIP ||
+				clientPorts[clientId] != currentClientPort) {
 				clientResponseReady = true;
 				buildResponse(ResponseUnknownClient);
 				break;
 			}
 
-			if (clientSequenceNumber == clients[clientId].sequenceNumber) {
-				clientMessageRepeated = true;
-			} else {
-				if ((uint16_t)(clientSequenceNumber - clients[clientId].sequenceNumber) > 0x7FFF) {
-					// Old message arriving too late (we will just ignore it)
-					return false;
-				} else {
-					clientMessageRepeated = false;
-					clients[clientId].sequenceNumber = clientSequenceNumber;
+#ifdef IoTEncryptionRequired
+			// Forged or corrupted messages must not even touch the sequence number
+			if (!openPayload(header, clientKeys[clientId], 0, 0, 0))
+				return false;
+#endif
+
+#ifdef IoTClientTimeout
+			clientLastSeen[clientId] = timerTick;
+#endif
+
+			if (clientSequenceNumber == clientSequenceNumbers[clientId]) {
+				clientMessageRepeated = true;
+			} else {
+				if ((uint16_t)(clientSequenceNumber - clientSequenceNumbers[clientId]) > 0x7FFF) {
+					// Old message arriving too late (we will just ignore it)
+					return false;
+				} else {
+#ifdef IoTEncryptionRequired
+					// Nonces start repeating once the sequence number goes all the way around
+					clientSequenceAdvances[clientId] += (uint16_t)(clientSequenceNumber - clientSequenceNumbers[clientId]);
+					if (clientSequenceAdvances[clientId] > 0xFFFF) {
+						releaseClient(clientId);
+						clientResponseReady = true;
+						clientEncrypted = false;
+						bufferOffset = CurrentResponseHeaderLength;
+						buildResponse(ResponseUnknownClient);
+						break;
+					}
+#endif
+					clientMessageRepeated = false;
+					clientSequenceNumbers[clientId] = clientSequenceNumber;
+#ifdef IoTPersistentState
+					stateDirty = true;
+#endif
+
+					if (clientMessage == MessageGoodBye) {
+						clientResponseReady = true;
+						buildGoodByeResponse();
+					}
+#ifdef IoTPropertyCacheCount
+					// Any other message could change the state of the device
+					else if (clientMessage != MessageGetProperty &&
+						clientMessage != MessageGetPropertyRange &&
+						clientMessage != MessagePing)
+						invalidatePropertyCache();
+#endif
+				}
+			}
+
+			if (clientMessage == MessageScene) {
+				validateScene();
+			} else if (!validRequestPayload()) {
+				clientResponseReady = true;
+				buildResponse(ResponseInvalidPayload);
+			} else if (clientMessage == MessageGetPropertyRange || clientMessage == MessageSetPropertyRange) {
+				const uint8_t responseCode = validatePropertyRange();
+				if (responseCode != ResponseOK) {
+					clientResponseReady = true;
+					buildResponse(responseCode);
+				}
+#ifdef IoTTimeSeries
+			} else if (clientMessage == MessageGetSeries) {
+				const uint8_t responseCode = validateSeries();
+				if (responseCode != ResponseOK) {
+					clientResponseReady = true;
+					buildResponse(responseCode);
+				}
+#endif
+#ifdef IoTScheduleCount
+			} else if (clientMessage == MessagePing && clientPayloadLength == 4) {
+				clientResponseReady = true;
+				buildTimeSyncResponse();
+			} else if (clientMessage == MessageScheduleScene || clientMessage == MessageScheduleTimer) {
+				buildScheduleSceneResponse();
+			} else if (clientMessage == MessageListSchedule) {
+				clientResponseReady = true;
+				buildListScheduleResponse();
+			} else if (clientMessage == MessageCancelSchedule) {
+				clientResponseReady = true;
+				buildCancelScheduleResponse();
+#endif
+#ifdef IoTAggregateCount
+			} else if (clientMessage == MessageGetAggregates) {
+				clientResponseReady = true;
+				buildGetAggregatesResponse();
+#endif
+#ifdef IoTRuleCount
+			} else if (clientMessage == MessageSetRule) {
+				buildSetRuleResponse();
+			} else if (clientMessage == MessageDeleteRule) {
+				clientResponseReady = true;
+				buildDeleteRuleResponse();
+#endif
+#ifdef IoTSetpointStreamCount
+			} else if (clientMessage == MessageOpenStream) {
+				clientResponseReady = true;
+				buildOpenStreamResponse();
+			} else if (clientMessage == MessageCloseStream) {
+				clientResponseReady = true;
+				buildCloseStreamResponse();
+#endif
+			} else if (clientMessage == MessageGetProperty) {
+#ifdef IoTPropertyPlane
+				servePublishedProperty();
+#endif
+#ifdef IoTPropertyCacheCount
+				if (!clientResponseReady)
+					serveCachedProperty();
+#endif
+			}
+			break;
+		}
+
+		return true;
+	}
+
+public:
+	static uint32_t currentClientIP;
+	static uint16_t currentClientPort;
+
+	static void begin() {
+		IoTClientId i;
+		for (i = 0; i < IoTClientCount; i++) {
+			clientSequenceNumbers[i] = MaximumSequenceNumber;
+			clientIPs[i] = 0;
+			clientPorts[i] = 0;
+#ifdef IoTClientTimeout
+			clientLastSeen[i] = 0;
+			clientTimerNext[i] = InvalidClientId;
+			clientTimerPrevious[i] = InvalidClientId;
+			clientTimerSlot[i] = 0;
+#endif
+		}
+#ifdef IoTClientTimeout
+		for (uint16_t j = 0; j < IoTTimerWheelSlots; j++)
+			timerWheel[j] = InvalidClientId;
+		timerTick = 0;
+		timerTime = IoTMillis();
+#endif
+#ifdef IoTHandshakeCookies
+		for (i = 0; i < AeadKeyLength; i += 4) {
+			const uint32_t r = IoTRandom32();
+			handshakeCookieSecret[i] = (uint8_t)r;
+			handshakeCookieSecret[i + 1] = (uint8_t)(r >> 8);
+			handshakeCookieSecret[i + 2] = (uint8_t)(r >> 16);
+			handshakeCookieSecret[i + 3] = (uint8_t)(r >> 24);
+		}
+#endif
+#ifdef IoTEncryptionRequired
+		for (i = 0; i < IoTClientCount; i++) {
+			for (uint8_t j = 0; j < AeadKeyLength; j++)
+				clientKeys[i][j] = 0;
+			clientResponseCounters[i] = 0;
+			clientSequenceAdvances[i] = 0;
+		}
+		clientEncrypted = false;
+#endif
+		nameLength = 0;
+#ifdef IoTNameReadOnly
+		name = 0;
+#else
+		for (i = 0; i < IoTMaxNameLength; i++)
+			name[i] = 0;
+#endif
+#ifndef IoTNoPassword
+		passwordLength = 0;
+#ifdef IoTPasswordReadOnly
+		password = 0;
+#else
+		for (i = 0; i < IoTMaxPasswordLength; i++)
+			password[i] = 0;
+#endif
+#endif
+		clientId = InvalidClientId;
+#ifdef IoTExtendedClientId
+		clientExtendedHeader = 0;
+#endif
+		clientSequenceNumber = 0;
+		clientMessage = 0;
+		clientMessageRepeated = false;
+		clientPayloadBuffer = 0;
+		clientPayloadLength = 0;
+		clientResponseReady = false;
+		clientResponseRequired = true;
+#ifdef IoTPersistentState
+		stateDirty = false;
+#endif
+#ifdef IoTPropertyCacheCount
+		invalidatePropertyCache();
+#endif
+#ifdef IoTGroupCount
+		for (i = 0; i < IoTGroupCount; i++) {
+			groupIds[i] = InvalidGroupId;
+			groupSequenceNumbers[i] = 0;
+			groupSynchronized[i] = false;
+#ifdef IoTEncryptionRequired
+			groupEpochs[i] = 0;
+#endif
+		}
+#ifdef IoTEncryptionRequired
+		groupResponseCounter = 0;
+#endif
+#endif
+#ifdef IoTSetpointStreamCount
+		for (i = 0; i < IoTSetpointStreamCount; i++) {
+			setpointStreams[i].clientId = InvalidClientId;
+			setpointStreams[i].open = false;
+		}
+		currentStream = 0;
+#endif
+#ifdef IoTScheduleCount
+		for (i = 0; i < IoTScheduleCount; i++) {
+			scheduledScenes[i].clientId = InvalidClientId;
+			scheduledScenes[i].used = false;
+		}
+		scheduleHeapSize = 0;
+#endif
+#ifdef IoTRuleCount
+		for (i = 0; i < IoTRuleInputCount; i++)
+			ruleInputs[i].references = 0;
+		knownRuleInputs = 0;
+		for (i = 0; i < IoTRuleCount; i++) {
+			rules[i].clientId = InvalidClientId;
+			rules[i].used = false;
+		}
+		pendingRules = 0;
+#endif
+#ifdef IoTAggregateCount
+		const uint32_t now = (uint32_t)IoTMillis();
+		for (i = 0; i < IoTAggregateCount; i++) {
+			aggregates[i].start = now;
+			aggregates[i].count = 0;
+			aggregates[i].sum = 0;
+			aggregates[i].completedCount = 0;
+			aggregates[i].completedMinimum = 0;
+			aggregates[i].completedMaximum = 0;
+			aggregates[i].completedMean = 0;
+		}
+#endif
+
+		bufferOffset = ResponseHeaderLength;
+#ifdef IoTStreamingResponse
+		flushedLength = 0;
+#endif
+	}
+
+#ifdef IoTClientTimeout
+	// Must be called periodically (such as once every loop()), so that clients
+	// that have not sent any messages for IoTClientTimeout milliseconds lose
+	// their client ids (each tick only visits one wheel slot)
+	// The wheel only drives that expiry: scheduled scenes are ordered in a heap
+	// (processSchedule()), while cookies, cached properties and aggregate
+	// windows are checked against IoTMillis() only when used, so there is
+	// nothing else to scan periodically
+	static void tick() {
+		uint32_t elapsedTicks = ((uint32_t)IoTMillis() - timerTime) / IoTTimerTickTime;
+		if (!elapsedTicks)
+			return;
+		timerTime += elapsedTicks * IoTTimerTickTime;
+		// Every client has expired after these many ticks (this also prevents
+		// timerTick from getting too far from the values in clientLastSeen)
+		if (elapsedTicks > ((IoTClientTimeout / IoTTimerTickTime) + IoTTimerWheelSlots))
+			elapsedTicks = (IoTClientTimeout / IoTTimerTickTime) + IoTTimerWheelSlots;
+		if (elapsedTicks > IoTTimerWheelSlots) {
+			// Visiting every slot once is enough to catch up after a long pause
+			timerTick += (uint16_t)(elapsedTicks - IoTTimerWheelSlots);
+			elapsedTicks = IoTTimerWheelSlots;
+		}
+		while (elapsedTicks--) {
+			timerTick++;
+			processTimerSlot();
+		}
+	}
+#endif
+
+#ifdef IoTScheduleCount
+	// Must be called periodically, from the same thread that calls process(),
+	// and returns true when a scheduled scene is due, and it must be handled
+	// just like MessageScene, but its response is never sent (the earliest
+	// scenes are always applied first)
+	static uint8_t processSchedule() {
+#ifdef IoTExternalResponseBuffer
+		if (!buffer)
+			return false;
+#endif
+		if (!scheduleHeapSize)
+			return false;
+		const uint32_t now = (uint32_t)IoTMillis();
+		_IoTScheduledScene* const scheduledScene = &(scheduledScenes[scheduleHeap[0]]);
+		if ((int32_t)(scheduledScene->time - now) > 0)
+			return false;
+
+		// The slot is only reused by process(), after the scene has been handled
+		if (scheduledScene->interval) {
+			scheduledScene->time += scheduledScene->interval;
+			if ((int32_t)(scheduledScene->time - now) <= 0)
+				scheduledScene->time += ((now - scheduledScene->time) / scheduledScene->interval + 1) * scheduledScene->interval;
+			siftScheduledDown(0);
+		} else {
+			unscheduleSlot(scheduleHeap[0]);
+		}
+		beginStoredScene(scheduledScene->clientId, scheduledScene->sequenceNumber, scheduledScene->scene, scheduledScene->length);
+		return true;
+	}
+
+	// Milliseconds until the next scheduled scene is due (0xFFFFFFFF when
+	// there are no scenes scheduled)
+	static uint32_t scheduleDelay() {
+		if (!scheduleHeapSize)
+			return 0xFFFFFFFF;
+		const int32_t delay = (int32_t)(scheduledScenes[scheduleHeap[0]].time - (uint32_t)IoTMillis());
+		return ((delay <= 0) ? 0 : (uint32_t)delay);
+	}
+#endif
+
+#ifdef IoTRuleCount
+	// Must be called from the same thread that calls process(), with the first
+	// element of the property converted to float, every time it changes (it
+	// returns true when an action became due, so processRules() must be called)
+	// Only the rules reading that property are evaluated, once all of their
+	// inputs are known, so no values are ever polled (rules are not saved by
+	// IoTPersistentState)
+	static uint8_t propertyChanged(uint8_t interfaceIndex, uint8_t propertyIndex, float value) {
+		uint8_t i;
+		for (i = 0; i < IoTRuleInputCount; i++) {
+			if (ruleInputs[i].references &&
+				ruleInputs[i].interfaceIndex == interfaceIndex &&
+				ruleInputs[i].propertyIndex == propertyIndex)
+				break;
+		}
+		if (i >= IoTRuleInputCount)
+			return false;
+
+		const uint32_t inputBit = ((uint32_t)1 << i);
+		if ((knownRuleInputs & inputBit) && ruleInputs[i].value == value)
+			return false;
+		ruleInputs[i].value = value;
+		knownRuleInputs |= inputBit;
+
+		const uint8_t previouslyPending = pendingRules;
+		for (i = 0; i < IoTRuleCount; i++) {
+			_IoTRule* const rule = &(rules[i]);
+			if (!rule->used || !(rule->inputMask & inputBit) || (rule->inputMask & knownRuleInputs) != rule->inputMask)
+				continue;
+			const uint8_t active = evaluateRule(rule->program);
+			if (active && !rule->active && !rule->pending) {
+				rule->pending = true;
+				pendingRules++;
+			}
+			rule->active = active;
+		}
+		return (pendingRules != previouslyPending);
+	}
+
+	// Returns true when the action of a rule is due, and it must be handled
+	// just like MessageScene, but its response is never sent (rules are
+	// handled in slot order)
+	static uint8_t processRules() {
+#ifdef IoTExternalResponseBuffer
+		if (!buffer)
+			return false;
+#endif
+		if (!pendingRules)
+			return false;
+		for (uint8_t i = 0; i < IoTRuleCount; i++) {
+			_IoTRule* const rule = &(rules[i]);
+			if (rule->pending) {
+				rule->pending = false;
+				pendingRules--;
+				beginStoredScene(rule->clientId, rule->sequenceNumber, rule->program + rule->codeLength, rule->length - rule->codeLength);
+				return true;
+			}
+		}
+		return false;
+	}
+#endif
 
-					if (clientMessage == MessageGoodBye) {
-						clientResponseReady = true;
-						buildGoodByeResponse();
-					}
-				}
+#ifdef IoTAggregateCount
+	// Must be called from the same thread that calls process(), with the first
+	// element of the property converted to float, every time it is sampled
+	// (properties without aggregates are ignored), updating each aggregate in
+	// O(1), without storing the samples; windows are aligned to the moment
+	// begin() was called, and a window ends when a sample or a request arrives
+	// after its end (aggregates are not saved by IoTPersistentState)
+	static void propertySampled(uint8_t interfaceIndex, uint8_t propertyIndex, float value) {
+		const uint32_t now = (uint32_t)IoTMillis();
+		for (uint8_t i = 0; i < IoTAggregateCount; i++) {
+			const IoTAggregateDescriptor* const aggregateDescriptor = &(IoTAggregates[i]);
+			if (aggregateDescriptor->interfaceIndex != interfaceIndex || aggregateDescriptor->propertyIndex != propertyIndex)
+				continue;
+			_IoTAggregate* const aggregate = &(aggregates[i]);
+			rollAggregate(aggregate, aggregateDescriptor->window, now);
+			if (!aggregate->count) {
+				aggregate->minimum = value;
+				aggregate->maximum = value;
+			} else if (value < aggregate->minimum) {
+				aggregate->minimum = value;
+			} else if (value > aggregate->maximum) {
+				aggregate->maximum = value;
 			}
-			break;
+			aggregate->count++;
+			aggregate->sum += value;
 		}
+	}
+#endif
+
+	inline static uint8_t isBigEndian() {
+		const uint32_t x = 0x03020100;
+		return ((uint8_t*)&x)[0];
+	}
 
+	static uint8_t process(const uint8_t* srcBuffer, uint16_t length) {
+#ifdef IoTTrace
+		// The packet has not been parsed yet, so the event is only completed,
+		// and announced, afterwards (responses built during processPacket()
+		// still come after it)
+		clientId = InvalidClientId;
+		clientSequenceNumber = MaximumSequenceNumber;
+		clientMessage = 0xFF;
+		clientMessageRepeated = false;
+		IoTTraceEvent* const received = appendTraceEvent(TraceReceived, length);
+		const uint8_t accepted = processPacket(srcBuffer, length);
+		received->clientId = clientId;
+		received->sequenceNumber = clientSequenceNumber;
+		received->message = clientMessage;
+		TraceProbe(received);
+		if (!accepted) {
+			trace(TraceVerdict, 0);
+			return false;
+		}
+		trace(TraceVerdict, TraceAccepted | (clientResponseReady ? TraceAnswered : 0) | (clientMessageRepeated ? TraceRepeated : 0));
+		if (!clientResponseReady)
+			trace(TraceHandler, 0);
 		return true;
+#else
+		return processPacket(srcBuffer, length);
+#endif
+	}
+
+#ifdef IoTTrace
+	static void trace(uint8_t type, uint16_t argument) {
+		IoTTraceEvent* const event = appendTraceEvent(type, argument);
+		TraceProbe(event);
+	}
+
+	inline static uint32_t traceCount() {
+		return traceEventCount;
+	}
+
+	// Returns 0 if the event has not been recorded yet, or if it has already
+	// been overwritten (the oldest event still available is
+	// traceCount() - IoTTrace, when traceCount() > IoTTrace)
+	static const IoTTraceEvent* tracedEvent(uint32_t index) {
+		if ((uint32_t)(traceEventCount - index - 1) >= (uint32_t)((traceEventCount < IoTTrace) ? traceEventCount : IoTTrace))
+			return 0;
+		return traceEvents + (index & (IoTTrace - 1));
 	}
+#endif
 
 	inline static uint8_t storedNameLength() {
 		return nameLength;
@@ -866,16 +4477,22 @@ public:
 	static uint8_t storedName(const uint8_t* newName, uint8_t newNameLength = 255) {
 		if (newNameLength && !newName)
 			return false;
-		nameLength = (newNameLength == 255 ? (uint8_t)strlen((const char*)newName) : newNameLength);
+		if (newNameLength == 255)
+			newNameLength = (uint8_t)strlen((const char*)newName);
 #ifdef IoTNameReadOnly
+		nameLength = newNameLength;
 		name = newName;
 #else
 		if (newNameLength > IoTMaxNameLength)
 			return false;
+		nameLength = newNameLength;
 		for (newNameLength = 0; newNameLength < nameLength; newNameLength++)
 			name[newNameLength] = newName[newNameLength];
 		for (; newNameLength < IoTMaxNameLength; newNameLength++)
 			name[newNameLength] = 0;
+#ifdef IoTPersistentState
+		stateDirty = true;
+#endif
 #endif
 		return true;
 	}
@@ -900,23 +4517,177 @@ public:
 #ifndef IoTNoPassword
 		if (newPasswordLength && !newPassword)
 			return false;
-		passwordLength = (newPasswordLength == 255 ? (uint8_t)strlen((const char*)newPassword) : newPasswordLength);
+		if (newPasswordLength == 255)
+			newPasswordLength = (uint8_t)strlen((const char*)newPassword);
 #ifdef IoTPasswordReadOnly
+		passwordLength = newPasswordLength;
 		password = newPassword;
 #else
 		if (newPasswordLength > IoTMaxPasswordLength)
 			return false;
+		passwordLength = newPasswordLength;
 		for (newPasswordLength = 0; newPasswordLength < passwordLength; newPasswordLength++)
 			password[newPasswordLength] = newPassword[newPasswordLength];
 		for (; newPasswordLength < IoTMaxPasswordLength; newPasswordLength++)
 			password[newPasswordLength] = 0;
+#ifdef IoTPersistentState
+		stateDirty = true;
+#endif
 #endif
 		return true;
 #else
+		(void)newPassword;
+		(void)newPasswordLength;
 		return false;
 #endif
 	}
 
+#ifdef IoTPersistentState
+	static uint32_t stateSize() {
+		return StateHeaderLength +
+#ifndef IoTNameReadOnly
+			1 + IoTMaxNameLength +
+#endif
+#ifndef IoTPasswordReadOnly
+			1 + IoTMaxPasswordLength +
+#endif
+#ifdef IoTGroupCount
+			(IoTGroupCount * GroupStateLength) + GroupCounterStateLength +
+#endif
+			((uint32_t)IoTClientCount * ClientStateLength);
+	}
+
+	inline static uint8_t isStateDirty() {
+		return stateDirty;
+	}
+
+	// dstBuffer must have room for stateSize() bytes
+	static void saveState(uint8_t* dstBuffer) {
+		*dstBuffer++ = 'I';
+		*dstBuffer++ = 'o';
+		*dstBuffer++ = 'T';
+		*dstBuffer++ = 'S';
+		*dstBuffer++ = StateVersion;
+#ifndef IoTNameReadOnly
+		*dstBuffer++ = nameLength;
+		for (uint8_t i = 0; i < IoTMaxNameLength; i++)
+			*dstBuffer++ = name[i];
+#endif
+#ifndef IoTPasswordReadOnly
+		*dstBuffer++ = passwordLength;
+		for (uint8_t i = 0; i < IoTMaxPasswordLength; i++)
+			*dstBuffer++ = password[i];
+#endif
+#ifdef IoTGroupCount
+		for (uint8_t i = 0; i < IoTGroupCount; i++) {
+			dstBuffer = saveStateValue(dstBuffer, groupIds[i], 2);
+			dstBuffer = saveStateValue(dstBuffer, groupSequenceNumbers[i], 2);
+			*dstBuffer++ = groupSynchronized[i];
+#ifdef IoTEncryptionRequired
+			dstBuffer = saveStateValue(dstBuffer, groupEpochs[i], 2);
+#endif
+		}
+#ifdef IoTEncryptionRequired
+		dstBuffer = saveStateValue(dstBuffer, groupResponseCounter, 4);
+#endif
+#endif
+#ifndef IoTEncryptionRequired
+		// Saves are batched, so a restored sequence number could be behind the
+		// last request accepted, which is only harmless without encryption
+		// (captured requests would be accepted again, and, unlike response
+		// counters, sequence numbers cannot be advanced)
+		for (IoTClientId i = 0; i < IoTClientCount; i++) {
+			dstBuffer = saveStateValue(dstBuffer, clientIPs[i], 4);
+			dstBuffer = saveStateValue(dstBuffer, clientPorts[i], 2);
+			dstBuffer = saveStateValue(dstBuffer, clientSequenceNumbers[i], 2);
+		}
+#endif
+		stateDirty = false;
+	}
+
+	// Must be called after begin() (and after joinGroup(), as only the sequence
+	// numbers of groups already joined are restored), and returns false, changing nothing, when
+	// srcBuffer was not created by saveState() with the same configuration
+	static uint8_t loadState(const uint8_t* srcBuffer, uint32_t length) {
+		if (!srcBuffer ||
+			length != stateSize() ||
+			srcBuffer[0] != 'I' ||
+			srcBuffer[1] != 'o' ||
+			srcBuffer[2] != 'T' ||
+			srcBuffer[3] != 'S' ||
+			srcBuffer[4] != StateVersion)
+			return false;
+		srcBuffer += StateHeaderLength;
+#ifndef IoTNameReadOnly
+		if (srcBuffer[0] > IoTMaxNameLength)
+			return false;
+#ifndef IoTPasswordReadOnly
+		if (srcBuffer[1 + IoTMaxNameLength] > IoTMaxPasswordLength)
+			return false;
+#endif
+		nameLength = *srcBuffer++;
+		for (uint8_t i = 0; i < IoTMaxNameLength; i++)
+			name[i] = *srcBuffer++;
+#elif !defined(IoTPasswordReadOnly)
+		if (srcBuffer[0] > IoTMaxPasswordLength)
+			return false;
+#endif
+#ifndef IoTPasswordReadOnly
+		passwordLength = *srcBuffer++;
+		for (uint8_t i = 0; i < IoTMaxPasswordLength; i++)
+			password[i] = *srcBuffer++;
+#endif
+#ifdef IoTGroupCount
+		for (uint8_t i = 0; i < IoTGroupCount; i++) {
+			// Groups are joined by the user, so only their sequence numbers are restored
+			const uint16_t groupId = (uint16_t)loadStateValue(srcBuffer, 2);
+			const uint8_t j = findGroup(groupId);
+			if (groupId != InvalidGroupId && j < IoTGroupCount) {
+				groupSequenceNumbers[j] = (uint16_t)loadStateValue(srcBuffer + 2, 2);
+				groupSynchronized[j] = srcBuffer[4];
+#ifdef IoTEncryptionRequired
+				groupEpochs[j] = (uint16_t)loadStateValue(srcBuffer + 5, 2);
+#endif
+			}
+			srcBuffer += GroupStateLength;
+		}
+#ifdef IoTEncryptionRequired
+		// Up to StateCounterGap responses may have been sent after the last
+		// saveState(), and their nonces must never be reused
+		groupResponseCounter = loadStateValue(srcBuffer, 4) + StateCounterGap;
+		srcBuffer += 4;
+#endif
+#endif
+#ifndef IoTEncryptionRequired
+#ifdef IoTClientTimeout
+		for (uint16_t i = 0; i < IoTTimerWheelSlots; i++)
+			timerWheel[i] = InvalidClientId;
+#endif
+		for (IoTClientId i = 0; i < IoTClientCount; i++) {
+			clientIPs[i] = loadStateValue(srcBuffer, 4);
+			clientPorts[i] = (uint16_t)loadStateValue(srcBuffer + 4, 2);
+			clientSequenceNumbers[i] = (uint16_t)loadStateValue(srcBuffer + 6, 2);
+			srcBuffer += 8;
+#ifdef IoTClientTimeout
+			// Restored clients get a whole IoTClientTimeout to show up again
+			clientTimerNext[i] = InvalidClientId;
+			clientTimerPrevious[i] = InvalidClientId;
+			if (clientIPs[i]) {
+				clientLastSeen[i] = timerTick;
+				linkClientTimer(i);
+			}
+#endif
+		}
+#endif
+#ifdef IoTPropertyCacheCount
+		invalidatePropertyCache();
+#endif
+		// The advanced counters must be saved before being used
+		stateDirty = true;
+		return true;
+	}
+#endif
+
 	inline static uint8_t message() {
 		return clientMessage;
 	}
@@ -929,9 +4700,24 @@ public:
 		return bufferOffset;
 	}
 
+#ifndef IoTStreamingResponse
 	inline static const uint8_t* responseBuffer() {
 		return buffer;
 	}
+#endif
+
+#ifdef IoTExternalResponseBuffer
+	// newBuffer must have room for MaximumResponseLength bytes, allowing hosts
+	// to build each response directly inside a buffer owned by the transport
+	// (such as a buffer registered with the kernel), and to keep several
+	// responses in flight
+	// Every call that can build a response (process(), processSchedule() and
+	// processRules()) writes to the last buffer set here, so it must be set
+	// before each of them, and those calls do nothing while it is null
+	inline static void responseBuffer(uint8_t* newBuffer) {
+		buffer = newBuffer;
+	}
+#endif
 
 	inline static uint16_t payloadLength() {
 		return clientPayloadLength;
@@ -945,21 +4731,310 @@ public:
 		return clientResponseReady;
 	}
 
+	// When false, the response must not be sent (such as in group messages
+	// that do not request an ack), even though the message must be handled
+	inline static uint8_t responseRequired() {
+		return clientResponseRequired;
+	}
+
+#ifdef IoTSetpointStreamCount
+	// Only valid while handling MessageStreamFrame, whose value is in
+	// payloadBuffer() (its length has already been validated), and which must
+	// be applied without building a response (when responseRequired() is true,
+	// ServerMessageStreamReport has already been built)
+	inline static uint8_t streamInterfaceIndex() {
+		return setpointStreams[currentStream].interfaceIndex;
+	}
+
+	inline static uint8_t streamPropertyIndex() {
+		return setpointStreams[currentStream].propertyIndex;
+	}
+#endif
+
+#ifdef IoTMulticastDiscovery
+	// How many milliseconds the host must wait before sending the response
+	// (only MessageQueryDevice carrying a fleet size estimate is delayed, at
+	// random, by up to IoTDiscoverySlotTime milliseconds per device, limited
+	// to IoTDiscoveryMaxDelay, so hundreds of devices do not answer at once)
+	inline static uint16_t responseDelay() {
+		return clientResponseDelay;
+	}
+#endif
+
+#ifdef IoTPropertyCacheCount
+	// Must be called whenever a property changes outside of a message (such
+	// as a sensor reading or a physical button), unless IoTPropertyCacheTime
+	// is short enough for the clients to tolerate stale values
+	static void invalidatePropertyCache(uint8_t interfaceIndex, uint8_t propertyIndex) {
+		_IoTPropertyCacheEntry* entry = findCachedProperty(interfaceIndex, propertyIndex);
+		if (entry)
+			entry->used = false;
+	}
+
+	static void invalidatePropertyCache() {
+		for (uint8_t i = 0; i < IoTPropertyCacheCount; i++)
+			propertyCache[i].used = false;
+	}
+#endif
+
+#ifdef IoTPropertyPlane
+	// The block is mapped by the host in every process (shm_open() + mmap(),
+	// CreateFileMapping() and so on), and should be aligned to
+	// IoTPropertyPlaneSlotLength bytes, so each slot sits in its own cache line
+	static uint32_t propertyPlaneSize() {
+		layOutPropertyPlane();
+		return (uint32_t)propertyPlaneSlotCount * IoTPropertyPlaneSlotLength;
+	}
+
+	// Must be called only once, by the process creating the shared memory,
+	// before any processes call attachPropertyPlane()
+	static void initializePropertyPlane(void* plane) {
+		const uint32_t size = propertyPlaneSize();
+		uint8_t* const dstBuffer = (uint8_t*)plane;
+		for (uint32_t i = 0; i < size; i++)
+			dstBuffer[i] = 0;
+		dstBuffer[0] = 'I';
+		dstBuffer[1] = 'o';
+		dstBuffer[2] = 'T';
+		dstBuffer[3] = 'P';
+		dstBuffer[4] = PlaneVersion;
+		dstBuffer[5] = (uint8_t)(IoTPropertyPlaneSlotLength - 1);
+		dstBuffer[6] = (uint8_t)propertyPlaneSlotCount;
+		dstBuffer[7] = (uint8_t)(propertyPlaneSlotCount >> 8);
+		IoTMemoryBarrier();
+	}
+
+	// Fails if plane was not initialized with the same layout (same
+	// IoTInterfaces and IoTPropertyPlaneSlotLength), and passing 0 detaches
+	static uint8_t attachPropertyPlane(void* plane) {
+		propertyPlane = 0;
+		if (!plane)
+			return true;
+		layOutPropertyPlane();
+		const uint8_t* const srcBuffer = (const uint8_t*)plane;
+		if (srcBuffer[0] != 'I' ||
+			srcBuffer[1] != 'o' ||
+			srcBuffer[2] != 'T' ||
+			srcBuffer[3] != 'P' ||
+			srcBuffer[4] != PlaneVersion ||
+			srcBuffer[5] != (uint8_t)(IoTPropertyPlaneSlotLength - 1) ||
+			srcBuffer[6] != (uint8_t)propertyPlaneSlotCount ||
+			srcBuffer[7] != (uint8_t)(propertyPlaneSlotCount >> 8))
+			return false;
+		propertyPlane = (IoTPropertyPlaneSlot*)plane;
+		propertyPlaneCursor = 1;
+		return true;
+	}
+
+	// Called by the only process allowed to write this property (length must
+	// not exceed IoTPropertyPlaneSlotLength - 12 bytes)
+	static uint8_t publishProperty(uint8_t interfaceIndex, uint8_t propertyIndex, const void* srcBuffer, uint16_t length) {
+		IoTPropertyPlaneSlot* const slot = findPropertySlot(interfaceIndex, propertyIndex);
+		if (!slot || length > PlaneValueLength)
+			return false;
+		const uint32_t sequence = slot->sequence;
+		slot->sequence = sequence + 1;
+		IoTMemoryBarrier();
+		for (uint16_t i = 0; i < length; i++)
+			slot->value[i] = ((const uint8_t*)srcBuffer)[i];
+		slot->valueLength = length;
+		IoTMemoryBarrier();
+		// Skip 0 when wrapping around, as it means "never published"
+		slot->sequence = ((sequence + 2) ? (sequence + 2) : 2);
+		return true;
+	}
+
+	// dstBuffer must have room for IoTPropertyPlaneSlotLength - 12 bytes
+	static uint8_t readPublishedProperty(uint8_t interfaceIndex, uint8_t propertyIndex, void* dstBuffer, uint16_t& length) {
+		const IoTPropertyPlaneSlot* const slot = findPropertySlot(interfaceIndex, propertyIndex);
+		if (!slot)
+			return false;
+		// Give up after a few attempts, rather than waiting for a driver that
+		// could have died halfway through a write
+		for (uint8_t attempt = 0; attempt < 8; attempt++) {
+			const uint32_t sequence = slot->sequence;
+			if (!sequence)
+				return false;
+			if (sequence & 1)
+				continue;
+			IoTMemoryBarrier();
+			length = slot->valueLength;
+			if (length > PlaneValueLength)
+				continue;
+			for (uint16_t i = 0; i < length; i++)
+				((uint8_t*)dstBuffer)[i] = slot->value[i];
+			IoTMemoryBarrier();
+			if (slot->sequence == sequence)
+				return true;
+		}
+		return false;
+	}
+
+	// Returns false when no properties have been published since they were
+	// last returned by this method (a property published several times in a
+	// row is returned only once)
+	static uint8_t nextPropertyChange(uint8_t& interfaceIndex, uint8_t& propertyIndex) {
+		if (!propertyPlane)
+			return false;
+		for (uint16_t i = 1; i < propertyPlaneSlotCount; i++) {
+			// Resume from where the last call stopped, so a driver publishing
+			// all the time does not hide the others
+			const uint16_t slotIndex = propertyPlaneCursor;
+			if (++propertyPlaneCursor >= propertyPlaneSlotCount)
+				propertyPlaneCursor = 1;
+			IoTPropertyPlaneSlot* const slot = propertyPlane + slotIndex;
+			const uint32_t sequence = slot->sequence;
+			if (!sequence || (sequence & 1) || sequence == slot->acknowledgedSequence)
+				continue;
+			slot->acknowledgedSequence = sequence;
+			for (interfaceIndex = IoTInterfaceCount - 1; propertyPlaneFirstSlots[interfaceIndex] > slotIndex; interfaceIndex--) {
+			}
+			propertyIndex = (uint8_t)(slotIndex - propertyPlaneFirstSlots[interfaceIndex]);
+			return true;
+		}
+		return false;
+	}
+#endif
+
+#ifdef IoTGroupCount
+	static uint8_t joinGroup(uint16_t groupId) {
+		if (groupId == InvalidGroupId)
+			return false;
+		if (findGroup(groupId) < IoTGroupCount)
+			return true;
+		const uint8_t i = findGroup(InvalidGroupId);
+		if (i >= IoTGroupCount)
+			return false;
+		groupIds[i] = groupId;
+		groupSynchronized[i] = false;
+#ifdef IoTEncryptionRequired
+		uint8_t groupNonce[AeadNonceLength], zeroNonce[AeadNonceLength];
+		for (uint8_t j = 0; j < AeadNonceLength; j++) {
+			groupNonce[j] = 0xFF;
+			zeroNonce[j] = 0;
+		}
+		groupNonce[6] = (uint8_t)groupId;
+		groupNonce[7] = (uint8_t)(groupId >> 8);
+		_IoTAead::deriveKey(groupKeys[i], IoTServerEncryptionKey, groupNonce, zeroNonce);
+#endif
+		return true;
+	}
+
+	static uint8_t leaveGroup(uint16_t groupId) {
+		if (groupId == InvalidGroupId)
+			return false;
+		const uint8_t i = findGroup(groupId);
+		if (i >= IoTGroupCount)
+			return false;
+		groupIds[i] = InvalidGroupId;
+		return true;
+	}
+
+	inline static uint8_t isGroupMember(uint16_t groupId) {
+		return (groupId != InvalidGroupId && findGroup(groupId) < IoTGroupCount);
+	}
+#endif
+
+#ifdef IoTActuatorQueue
+	// Only the thread calling process() may queue values, and mailboxes that
+	// are not waiting are released for other commands/properties, so these
+	// return false only when every mailbox is waiting to be applied (or being
+	// read), or when length > IoTActuatorValueLength (the value should then be
+	// applied right away)
+	inline static uint8_t queueCommand(uint8_t interfaceIndex, uint8_t interfaceCommand) {
+		return queueActuation(SceneExecute, interfaceIndex, 0, &interfaceCommand, 1);
+	}
+
+	inline static uint8_t queueProperty(uint8_t interfaceIndex, uint8_t propertyIndex, const void* value, uint16_t length) {
+		return queueActuation(SceneSetProperty, interfaceIndex, propertyIndex, value, length);
+	}
+
+	// Called by the actuator thread (only one), returning false when there is
+	// nothing left to be applied, in the order the mailboxes were first queued
+	// (no locks are needed, as each mailbox is protected by a seqlock)
+	static uint8_t nextActuation(IoTActuation& actuation) {
+		const uint16_t head = actuatorHead;
+		if (head == actuatorTail)
+			return false;
+		IoTMemoryBarrier();
+		_IoTActuatorMailbox* const mailbox = actuatorMailboxes + actuatorRing[head & (IoTActuatorQueue - 1)];
+		IoTMemoryBarrier();
+		actuatorHead = head + 1;
+		IoTMemoryBarrier();
+		mailbox->pending = false;
+		IoTMemoryBarrier();
+
+		actuation.operation = mailbox->operation;
+		actuation.interfaceIndex = mailbox->interfaceIndex;
+		actuation.propertyIndex = mailbox->propertyIndex;
+		// The producer never stops halfway through a write, so just try again
+		for (;;) {
+			const uint32_t sequence = mailbox->sequence;
+			if (sequence & 1)
+				continue;
+			IoTMemoryBarrier();
+			actuation.propertyValueLength = mailbox->valueLength;
+			if (actuation.propertyValueLength > IoTActuatorValueLength)
+				continue;
+			for (uint8_t i = 0; i < actuation.propertyValueLength; i++)
+				actuation.propertyValue[i] = mailbox->value[i];
+			IoTMemoryBarrier();
+			if (mailbox->sequence == sequence)
+				break;
+		}
+		IoTMemoryBarrier();
+		actuatorDone = head + 1;
+		if (actuation.operation == SceneExecute) {
+			actuation.interfaceCommand = actuation.propertyValue[0];
+			actuation.propertyValueLength = 0;
+		} else {
+			actuation.interfaceCommand = 0;
+		}
+		return true;
+	}
+#endif
+
+	// Returns the first operation of a MessageScene (operation[0] is either
+	// SceneExecute or SceneSetProperty, and operation + 1 can be used as
+	// IoTMessageExecute or IoTMessageSetProperty, respectively)
+	inline static const uint8_t* firstSceneOperation() {
+		return (clientPayloadBuffer[0] ? (clientPayloadBuffer + 1) : 0);
+	}
+
+	// Returns the operation following operation, or 0 after the last one
+	static const uint8_t* nextSceneOperation(const uint8_t* operation) {
+		operation += ((operation[0] == SceneExecute) ? 3 : (5 + (((uint16_t)operation[3]) | (((uint16_t)operation[4]) << 8))));
+		return ((operation < clientPayloadBuffer + clientPayloadLength) ? operation : 0);
+	}
+
 	inline static void writeResponse(uint8_t value) {
-		buffer[bufferOffset++] = value;
+		*reserveResponse(1) = value;
 	}
 
 	static void writeResponse(const void* srcBuffer, uint16_t length) {
 		const uint8_t* srcBuffer8 = (const uint8_t*)srcBuffer;
-		uint8_t* dstBuffer = buffer + bufferOffset;
+#ifdef IoTStreamingResponse
+		while (length) {
+			uint16_t available = IoTStreamingChunkLength - (bufferOffset - flushedLength);
+			if (!available) {
+				flushResponse();
+				available = IoTStreamingChunkLength;
+			}
+			if (available > length)
+				available = length;
+			memcpy(buffer + (bufferOffset - flushedLength), srcBuffer8, available);
+			bufferOffset += available;
+			srcBuffer8 += available;
+			length -= available;
+		}
+#else
+		memcpy(buffer + bufferOffset, srcBuffer8, length);
 		bufferOffset += length;
-		while (length--)
-			*dstBuffer++ = *srcBuffer8++;
+#endif
 	}
 
 	static void writeResponseProperty8(uint8_t interfaceIndex, uint8_t propertyIndex, uint8_t value) {
-		uint8_t* dstBuffer = buffer + bufferOffset;
-		bufferOffset += 5;
+		uint8_t* dstBuffer = reserveResponse(5);
 		*dstBuffer++ = interfaceIndex;
 		*dstBuffer++ = propertyIndex;
 		*dstBuffer++ = 1;
@@ -967,47 +5042,119 @@ public:
 		*dstBuffer++ = value;
 	}
 
-	static void writeResponseProperty16(uint8_t interfaceIndex, uint8_t propertyIndex, uint16_t value) {
-		uint8_t* dstBuffer = buffer + bufferOffset;
-		bufferOffset += 6;
-		*dstBuffer++ = interfaceIndex;
-		*dstBuffer++ = propertyIndex;
-		*dstBuffer++ = 2;
-		*dstBuffer++ = 0;
-		*dstBuffer++ = (uint8_t)value;
-		*dstBuffer++ = (uint8_t)(value >> 8);
+	// Writes count elements (count is the property's elementCount, and
+	// T must match its dataType, such as uint16_t for DataTypeU16, or
+	// IoTRGBTriplet for DataTypeRGBTriplet)
+	template<typename T> inline static void writeResponseProperty(uint8_t interfaceIndex, uint8_t propertyIndex, const T* values, uint16_t count = 1) {
+		const uint16_t length = count * (uint16_t)sizeof(T);
+		if (count == 1) {
+			uint8_t* dstBuffer = reserveResponse(4 + sizeof(T));
+			dstBuffer[0] = interfaceIndex;
+			dstBuffer[1] = propertyIndex;
+			dstBuffer[2] = (uint8_t)sizeof(T);
+			dstBuffer[3] = 0;
+			_IoTDataType<T>::store(dstBuffer + 4, *values);
+			return;
+		}
+		uint8_t* dstBuffer = reserveResponse(4);
+		dstBuffer[0] = interfaceIndex;
+		dstBuffer[1] = propertyIndex;
+		dstBuffer[2] = (uint8_t)length;
+		dstBuffer[3] = (uint8_t)(length >> 8);
+		writeResponseElements(values, count);
 	}
 
-	static void writeResponseProperty32(uint8_t interfaceIndex, uint8_t propertyIndex, uint32_t value) {
-		uint8_t* dstBuffer = buffer + bufferOffset;
-		bufferOffset += 8;
-		*dstBuffer++ = interfaceIndex;
-		*dstBuffer++ = propertyIndex;
-		*dstBuffer++ = 4;
-		*dstBuffer++ = 0;
-		*dstBuffer++ = (uint8_t)value;
-		*dstBuffer++ = (uint8_t)(value >> 8);
-		*dstBuffer++ = (uint8_t)(value >> 16);
-		*dstBuffer++ = (uint8_t)(value >> 24);
+	// Answers MessageGetPropertyRange/MessageSetPropertyRange, where values
+	// points to the element at offset (not to the first element)
+	template<typename T> inline static void writeResponsePropertyRange(uint8_t interfaceIndex, uint8_t propertyIndex, uint8_t offset, const T* values, uint8_t count) {
+		uint8_t* dstBuffer = reserveResponse(4);
+		dstBuffer[0] = interfaceIndex;
+		dstBuffer[1] = propertyIndex;
+		dstBuffer[2] = offset;
+		dstBuffer[3] = count;
+		writeResponseElements(values, count);
 	}
 
-	static void writeResponsePropertyFloat(uint8_t interfaceIndex, uint8_t propertyIndex, float value) {
-		uint8_t* dstBuffer = buffer + bufferOffset;
-		bufferOffset += 8;
-		const uint32_t v = *((uint32_t*)&value);
-		*dstBuffer++ = interfaceIndex;
-		*dstBuffer++ = propertyIndex;
-		*dstBuffer++ = 4;
-		*dstBuffer++ = 0;
-		*dstBuffer++ = (uint8_t)v;
-		*dstBuffer++ = (uint8_t)(v >> 8);
-		*dstBuffer++ = (uint8_t)(v >> 16);
-		*dstBuffer++ = (uint8_t)(v >> 24);
+#ifdef IoTTimeSeries
+	// Answers MessageGetSeries with the oldest samples that fit in the response
+	// (T must match the property's dataType, as in writeResponseProperty()),
+	// returning how many of them were written, and it must be the only thing
+	// written to the response
+	template<typename T> static uint16_t writeResponseSeries(uint8_t interfaceIndex, uint8_t propertyIndex, uint8_t encoding, const uint32_t* timestamps, const T* values, uint16_t count) {
+		const uint8_t dataType = (uint8_t)_IoTDataType<T>::Type;
+		const uint16_t maximumLength = IoTMaxPayloadLength - SeriesHeaderLength;
+		uint8_t valueBuffer[sizeof(T)];
+		uint16_t i;
+		if (encoding != SeriesCompressed) {
+			encoding = SeriesPlain;
+			if (count > maximumLength / (4 + sizeof(T)))
+				count = maximumLength / (4 + sizeof(T));
+		} else {
+			// Measures the samples first, so the count can be written before them
+			_IoTSeriesEncoder encoder;
+			encoder.bitCount = 0;
+			encoder.dry = true;
+			for (i = 0; i < count; i++) {
+				_IoTDataType<T>::store(valueBuffer, values[i]);
+				seriesWriteSample(encoder, dataType, !i, timestamps[i], seriesValue(dataType, valueBuffer));
+				if (((encoder.bitCount + 7) >> 3) > maximumLength)
+					break;
+			}
+			count = i;
+		}
+
+		uint8_t* const dstBuffer = reserveResponse(SeriesHeaderLength);
+		dstBuffer[0] = interfaceIndex;
+		dstBuffer[1] = propertyIndex;
+		dstBuffer[2] = dataType;
+		dstBuffer[3] = encoding;
+		_IoTLittleEndian::store16(dstBuffer + 4, count);
+
+		if (encoding == SeriesPlain) {
+			for (i = 0; i < count; i++) {
+				uint8_t* const sampleBuffer = reserveResponse(4 + sizeof(T));
+				_IoTLittleEndian::store32(sampleBuffer, timestamps[i]);
+				_IoTDataType<T>::store(sampleBuffer + 4, values[i]);
+			}
+		} else {
+			_IoTSeriesEncoder encoder;
+			encoder.bitCount = 0;
+			encoder.pending = 0;
+			encoder.pendingBits = 0;
+			encoder.dry = false;
+			for (i = 0; i < count; i++) {
+				_IoTDataType<T>::store(valueBuffer, values[i]);
+				seriesWriteSample(encoder, dataType, !i, timestamps[i], seriesValue(dataType, valueBuffer));
+			}
+			if (encoder.pendingBits)
+				writeResponse((uint8_t)(encoder.pending << (8 - encoder.pendingBits)));
+		}
+		return count;
+	}
+#endif
+
+	inline static void writeResponseProperty16(uint8_t interfaceIndex, uint8_t propertyIndex, uint16_t value) {
+		writeResponseProperty(interfaceIndex, propertyIndex, &value);
+	}
+
+	inline static void writeResponseProperty32(uint8_t interfaceIndex, uint8_t propertyIndex, uint32_t value) {
+		writeResponseProperty(interfaceIndex, propertyIndex, &value);
+	}
+
+	inline static void writeResponseProperty64(uint8_t interfaceIndex, uint8_t propertyIndex, uint64_t value) {
+		writeResponseProperty(interfaceIndex, propertyIndex, &value);
+	}
+
+	inline static void writeResponsePropertyFloat(uint8_t interfaceIndex, uint8_t propertyIndex, float value) {
+		writeResponseProperty(interfaceIndex, propertyIndex, &value);
+	}
+
+	inline static void writeResponsePropertyDouble(uint8_t interfaceIndex, uint8_t propertyIndex, double value) {
+		writeResponseProperty(interfaceIndex, propertyIndex, &value);
 	}
 
 	static void writeResponsePropertyRGB(uint8_t interfaceIndex, uint8_t propertyIndex, uint8_t r, uint8_t g, uint8_t b) {
-		uint8_t* dstBuffer = buffer + bufferOffset;
-		bufferOffset += 7;
+		uint8_t* dstBuffer = reserveResponse(7);
 		*dstBuffer++ = interfaceIndex;
 		*dstBuffer++ = propertyIndex;
 		*dstBuffer++ = 3;
@@ -1018,8 +5165,7 @@ public:
 	}
 
 	static void writeResponsePropertyRGB(uint8_t interfaceIndex, uint8_t propertyIndex, const uint8_t* rgb) {
-		uint8_t* dstBuffer = buffer + bufferOffset;
-		bufferOffset += 7;
+		uint8_t* dstBuffer = reserveResponse(7);
 		*dstBuffer++ = interfaceIndex;
 		*dstBuffer++ = propertyIndex;
 		*dstBuffer++ = 3;
@@ -1030,29 +5176,62 @@ public:
 	}
 
 	static void writeResponsePropertyBuffer(uint8_t interfaceIndex, uint8_t propertyIndex, const void* srcBuffer, uint16_t length) {
-		uint8_t* dstBuffer = buffer + bufferOffset;
-		bufferOffset += length + 4;
+		uint8_t* dstBuffer = reserveResponse(4);
 		*dstBuffer++ = interfaceIndex;
 		*dstBuffer++ = propertyIndex;
 		*dstBuffer++ = (uint8_t)length;
-		*dstBuffer++ = (uint8_t)(length >> 8);
-		const uint8_t* srcBuffer8 = (const uint8_t*)srcBuffer;
-		while (length--)
-			*dstBuffer++ = *srcBuffer8++;
+		*dstBuffer = (uint8_t)(length >> 8);
+		writeResponse(srcBuffer, length);
 	}
 
 	static void buildResponse(uint8_t responseCode) {
-		const uint16_t payloadLength = bufferOffset - ResponseHeaderLength;
-		buffer[0] = StartOfPacket;
-		buffer[1] = clientMessage;
-		buffer[2] = clientId;
-		buffer[3] = (uint8_t)clientSequenceNumber;
-		buffer[4] = (uint8_t)(clientSequenceNumber >> 8);
-		buffer[5] = responseCode;
-		buffer[6] = (uint8_t)payloadLength;
-		buffer[7] = (uint8_t)(payloadLength >> 8);
-		buffer[ResponseHeaderLength + payloadLength] = EndOfPacket;
+#ifdef IoTTrace
+		trace(TraceResponse, responseCode);
+#endif
+#ifdef IoTPropertyCacheCount
+		if (!clientResponseReady &&
+			clientMessage == MessageGetProperty &&
+			responseCode == ResponseOK
+#ifdef IoTStreamingResponse
+			&& !flushedLength
+#endif
+			) {
+#ifdef IoTEncryptionRequired
+			const uint16_t payloadOffset = CurrentResponseHeaderLength + (clientEncrypted ? AeadCounterLength : 0);
+#else
+			const uint16_t payloadOffset = CurrentResponseHeaderLength;
+#endif
+			cacheProperty(buffer + payloadOffset, bufferOffset - payloadOffset);
+		}
+#endif
+#ifdef IoTEncryptionRequired
+		// The associated data must be ready before sealing
+		if (clientEncrypted) {
+			buildHeader(responseCode, 0);
+			sealResponse();
+		}
+#endif
+		const uint16_t payloadLength = bufferOffset - CurrentResponseHeaderLength;
+#ifdef IoTStreamingResponse
+		// There is always room for the trailer and EndOfPacket in the chunk
+		uint8_t* dstBuffer = buffer + (bufferOffset - flushedLength);
+		if (!flushedLength) {
+			buildHeader(responseCode, payloadLength);
+		} else {
+			*dstBuffer++ = responseCode;
+			*dstBuffer++ = (uint8_t)payloadLength;
+			*dstBuffer++ = (uint8_t)(payloadLength >> 8);
+			bufferOffset += StreamedTrailerLength;
+		}
+		*dstBuffer = EndOfPacket;
+		bufferOffset += EndOfPacketLength;
+		IoTResponseSinkWrite(buffer, bufferOffset - flushedLength);
+		flushedLength = bufferOffset;
+#else
+		buildHeader(responseCode, payloadLength);
+		buffer[CurrentResponseHeaderLength + payloadLength] = EndOfPacket;
 		bufferOffset += EndOfPacketLength;
+#endif
 	}
 
 	inline static void buildResponseEnumDescriptor8(uint8_t interfaceIndex, uint8_t propertyIndex, const IoTEnumDescriptor8* enumDescriptors, uint8_t count) {
@@ -1068,14 +5247,28 @@ public:
 	}
 };
 
-_IoTServer::_IoTClient _IoTServer::clients[IoTClientCount];
+uint32_t _IoTServer::clientIPs[IoTClientCount];
+uint16_t _IoTServer::clientPorts[IoTClientCount];
+uint16_t _IoTServer::clientSequenceNumbers[IoTClientCount];
+#ifdef IoTClientTimeout
+uint16_t _IoTServer::clientLastSeen[IoTClientCount];
+IoTClientId _IoTServer::clientTimerNext[IoTClientCount];
+IoTClientId _IoTServer::clientTimerPrevious[IoTClientCount];
+uint8_t _IoTServer::clientTimerSlot[IoTClientCount];
+IoTClientId _IoTServer::timerWheel[IoTTimerWheelSlots];
+uint16_t _IoTServer::timerTick;
+uint32_t _IoTServer::timerTime;
+#endif
+#ifdef IoTPropertyCacheCount
+_IoTServer::_IoTPropertyCacheEntry _IoTServer::propertyCache[IoTPropertyCacheCount];
+#endif
 
 
 uint8_t _IoTServer::nameLength;
 #ifdef IoTNameReadOnly
 const uint8_t* _IoTServer::name;
 #else
-const uint8_t _IoTServer::name[IoTMaxNameLength];
+uint8_t _IoTServer::name[IoTMaxNameLength];
 #endif
 
 #ifndef IoTNoPassword
@@ -1089,27 +5282,145 @@ uint8_t _IoTServer::password[IoTMaxPasswordLength];
 #undef passwordLength
 #endif
 
-uint8_t _IoTServer::clientId;
+IoTClientId _IoTServer::clientId;
+#ifdef IoTExtendedClientId
+uint8_t _IoTServer::clientExtendedHeader;
+#endif
 uint16_t _IoTServer::clientSequenceNumber;
 uint8_t _IoTServer::clientMessage;
 uint8_t _IoTServer::clientMessageRepeated;
 const uint8_t* _IoTServer::clientPayloadBuffer;
 uint16_t _IoTServer::clientPayloadLength;
 uint8_t _IoTServer::clientResponseReady;
+uint8_t _IoTServer::clientResponseRequired;
+#ifdef IoTMulticastDiscovery
+uint16_t _IoTServer::clientResponseDelay;
+#endif
+#ifdef IoTPersistentState
+uint8_t _IoTServer::stateDirty;
+#endif
+#ifdef IoTTrace
+IoTTraceEvent _IoTServer::traceEvents[IoTTrace];
+uint32_t _IoTServer::traceEventCount;
+#endif
+#ifdef IoTActuatorQueue
+_IoTServer::_IoTActuatorMailbox _IoTServer::actuatorMailboxes[IoTActuatorQueue];
+volatile uint8_t _IoTServer::actuatorRing[IoTActuatorQueue];
+volatile uint16_t _IoTServer::actuatorHead;
+volatile uint16_t _IoTServer::actuatorDone;
+volatile uint16_t _IoTServer::actuatorTail;
+#endif
+#ifdef IoTPropertyPlane
+IoTPropertyPlaneSlot* _IoTServer::propertyPlane;
+uint16_t _IoTServer::propertyPlaneFirstSlots[IoTInterfaceCount];
+uint16_t _IoTServer::propertyPlaneSlotCount;
+uint16_t _IoTServer::propertyPlaneCursor;
+#endif
+#ifdef IoTGroupCount
+uint16_t _IoTServer::groupIds[IoTGroupCount];
+uint16_t _IoTServer::groupSequenceNumbers[IoTGroupCount];
+uint8_t _IoTServer::groupSynchronized[IoTGroupCount];
+#ifdef IoTEncryptionRequired
+uint8_t _IoTServer::groupKeys[IoTGroupCount][AeadKeyLength];
+uint8_t _IoTServer::currentGroup;
+uint16_t _IoTServer::groupEpochs[IoTGroupCount];
+uint32_t _IoTServer::groupResponseCounter;
+#endif
+#endif
+#ifdef IoTHandshakeCookies
+uint8_t _IoTServer::handshakeCookieSecret[AeadKeyLength];
+#endif
+#ifdef IoTEncryptionRequired
+uint8_t _IoTServer::clientKeys[IoTClientCount][AeadKeyLength];
+uint32_t _IoTServer::clientResponseCounters[IoTClientCount];
+uint32_t _IoTServer::clientSequenceAdvances[IoTClientCount];
+uint8_t _IoTServer::clientEncrypted;
+uint8_t _IoTServer::plaintextBuffer[IoTMaxPayloadLength];
+#endif
+#ifdef IoTSetpointStreamCount
+_IoTServer::_IoTSetpointStream _IoTServer::setpointStreams[IoTSetpointStreamCount];
+uint8_t _IoTServer::currentStream;
+#endif
+#ifdef IoTScheduleCount
+_IoTServer::_IoTScheduledScene _IoTServer::scheduledScenes[IoTScheduleCount];
+uint8_t _IoTServer::scheduleHeap[IoTScheduleCount];
+uint8_t _IoTServer::scheduleHeapSize;
+#endif
+#ifdef IoTRuleCount
+_IoTServer::_IoTRuleInput _IoTServer::ruleInputs[IoTRuleInputCount];
+uint32_t _IoTServer::knownRuleInputs;
+_IoTServer::_IoTRule _IoTServer::rules[IoTRuleCount];
+uint8_t _IoTServer::pendingRules;
+#endif
+#ifdef IoTAggregateCount
+_IoTServer::_IoTAggregate _IoTServer::aggregates[IoTAggregateCount];
+#endif
 uint32_t _IoTServer::currentClientIP;
 uint16_t _IoTServer::currentClientPort;
 
 uint16_t _IoTServer::bufferOffset;
-uint8_t _IoTServer::buffer[ResponseHeaderLength + IoTMaxPayloadLength + EndOfPacketLength];
+#ifdef IoTStreamingResponse
+uint16_t _IoTServer::flushedLength;
+#endif
+#ifdef IoTExternalResponseBuffer
+uint8_t* _IoTServer::buffer;
+#else
+uint8_t _IoTServer::buffer[ResponseBufferLength];
+#endif
 
 _IoTServer IoTServer;
 
 #undef StartOfPacket
+#undef StartOfExtendedPacket
+#undef StartOfStreamFrame
 #undef Escape
 #undef EndOfPacket
+#undef StreamFrameHeaderLength
+#undef StreamReportLength
+#undef RuleStackDepth
+#undef SeriesHeaderLength
+#undef AggregateReportLength
 #undef ResponseHeaderLength
 #undef RequestHeaderLength
 #undef EndOfPacketLength
+#undef StreamedResponseCode
+#undef StreamedPayloadLength
+#undef StreamedTrailerLength
+#undef ExtendedHeaderLength
+#undef CurrentResponseHeaderLength
+#undef CurrentRequestHeaderLength
+#ifdef IoTExtendedClientId
+#undef ShortClientCount
+#endif
+#undef EncryptionOverheadLength
+#undef HandshakePayloadLength
+#undef HandshakeCookieLength
+#ifdef LittleEndianHost
+#undef LittleEndianHost
+#endif
+#ifdef IoTTrace
+#undef TraceProbe
+#endif
+#ifdef IoTPropertyPlane
+#undef PlaneVersion
+#undef PlaneSlotHeaderLength
+#undef PlaneValueLength
+#endif
+#ifdef IoTPersistentState
+#undef StateVersion
+#undef StateHeaderLength
+#undef StateCounterGap
+#undef ClientStateLength
+#undef GroupStateLength
+#undef GroupCounterStateLength
+#endif
+#undef ResponseBufferLength
+#if defined(IoTEncryptionRequired) || defined(IoTHandshakeCookies)
+#undef AeadKeyLength
+#undef AeadNonceLength
+#undef AeadCounterLength
+#undef AeadTagLength
+#endif
 
 #pragma pack(pop)
 
@@ -0,0 +1,1469 @@
+//
+// IoTDCP is distributed under the FreeBSD License
+//
+// Copyright (c) 2017, Carlos Rafael Gimenes das Neves
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// https://github.com/carlosrafaelgn/IoTDCP
+//
+#ifndef IoTDCPClient_h
+#define IoTDCPClient_h
+
+#include <inttypes.h>
+#include <string.h>
+
+// Client side helpers, which do not depend on any sockets or on IoTDCP.h, so
+// they can be used by any host (even by another device)
+
+// Discovery (IoTDiscoveryCollector)
+// - buildQuery() assembles MessageQueryDevice, carrying the fleet size
+//   estimate, to be sent to IoTMulticastGroupAddress:IoTPort (or broadcast)
+// - Every datagram received afterwards must be given to collect(), which
+//   keeps up to IoTDiscoveryMaxDevices devices, de-duplicated by their UUID
+// - Devices may delay their responses by up to IoTDiscoveryMaxDelay
+//   milliseconds (as configured on the devices), so the host should keep
+//   collecting for at least that long
+// - fleetSizeEstimate() should be used as the estimate of the next query
+
+// Time series (IoTSeriesDecoder)
+// - begin() takes the payload of a response to MessageGetSeries (in either
+//   encoding), and next() returns its samples in order, without any
+//   allocations, returning false when they are over (or when the payload is
+//   truncated)
+// - Values are returned as 64 bits (signed integers already sign extended,
+//   floats as their bits, so they are kept exactly), or converted to double
+// - The timestamp of the last sample should be given as Since to the next
+//   request, to fetch only the samples that did not fit
+
+// Client (IoTDCPClient)
+// - Transport agnostic: datagrams are sent through the IoTDCPClientSend
+//   function given to the constructor, and every datagram received must be
+//   given to receive(), so thousands of devices can share one socket
+// - IoTMillis() must be defined, and poll() must be called periodically (it
+//   returns how many milliseconds are left until it must be called again)
+// - Every request completes exactly once, by calling its callback with either
+//   a response code, ResultTimeout or ResultCancelled
+// - Up to IoTDCPClientPipelineDepth requests are kept in flight per device,
+//   and the others wait, in order, in the device queue
+// - The retransmission timeout of each device follows RFC 6298 (smoothed RTT
+//   and RTT variance, exponential backoff, and no RTT samples are taken from
+//   retransmitted requests)
+// - Devices take any sequence number ahead of the last one they have seen,
+//   treat the same one as a repetition, and silently drop older ones, so a
+//   request is retransmitted with its own sequence number only while no other
+//   requests were sent after it (so the device can detect the repetition),
+//   otherwise it gets a fresh sequence number
+// - MessageHandshake, MessageReset, MessageExecute, MessageScene,
+//   MessageOpenStream, MessageScheduleScene, MessageScheduleTimer,
+//   MessageCancelSchedule, MessageSetRule and MessageDeleteRule are not
+//   idempotent: they wait for all requests in flight, and the requests queued
+//   after them wait for them, so they always keep their own sequence number and
+//   are applied at most once
+// - Any other request may be renumbered, and applied twice if only its
+//   response was lost (a MessageSetProperty or MessageSetPropertyRange applied
+//   again may overwrite a newer value sent meanwhile)
+// - ResultTimeout means the outcome is unknown: the device may or may not have
+//   applied the request
+// - Messages without a client id (DescribeInterface and so on) are sent one at
+//   a time per device, as their responses can only be matched by message type
+// - ResponseCookieRequired is handled internally, by repeating the handshake
+//   along with the cookie
+// - openStream() binds a property to a setpoint stream (IoTSetpointStreamCount
+//   must be defined on the device), and its callback payload is the stream id;
+//   sendStreamFrame() then sends the whole value right away, without queueing,
+//   retransmissions or responses (the stream sequence number is up to the host,
+//   and must be incremented for every frame)
+// - ServerMessageStreamReport, sent by the device every report interval, is
+//   given to the callback set with streamReports() (result is the response
+//   code), and readStreamReport() decodes its payload, which is also the
+//   payload of the response to closeStream()
+// - syncTime() sends MessagePing carrying the client clock (IoTScheduleCount
+//   must be defined on the device), and every response updates the estimate of
+//   the device clock, keeping the sample with the shortest round trip (unless
+//   it is older than IoTDCPClientTimeSyncMaxAge milliseconds), so it should be
+//   called a few times, now and then
+// - scheduleScene() converts a time given in the client clock to the device
+//   clock, so the same time can be given to all the devices that must apply
+//   their scenes at the same moment
+// - scheduleTimer() does not need syncTime(), as its delay is relative to the
+//   moment the device receives it, and the scene is applied every interval
+//   milliseconds (or just once, when interval is 0), until cancelSchedule()
+// - readScheduleEntry() walks through the payload of the response to
+//   listSchedule()
+// - setRule() uploads the code of a condition, built with the Rule* operations
+//   (IoTRuleCount must be defined on the device), along with the scene the
+//   device applies on its own whenever that condition becomes true
+// - getAggregates() asks for the last completed windows of a property
+//   (IoTAggregateCount must be defined on the device), and readAggregateReport()
+//   walks through the payload of its response
+// - Responses streamed by devices with IoTStreamingResponse, which carry their
+//   response code and payload length in a trailer when they do not fit in a
+//   single chunk, are accepted by collect() and by receive()
+// - Encrypted devices (IoTEncryptionRequired) and 16-bit client ids are not
+//   supported
+// - All memory is allocated along with the object (there are no allocations
+//   afterwards), so it is usually better to declare it static
+
+#ifndef IoTDCPClientMaxDevices
+#define IoTDCPClientMaxDevices 256
+#endif
+#if (IoTDCPClientMaxDevices <= 0)
+#error("IoTDCPClientMaxDevices <= 0")
+#endif
+#if (IoTDCPClientMaxDevices > 65534)
+#error("IoTDCPClientMaxDevices > 65534")
+#endif
+#ifndef IoTDCPClientMaxRequests
+#define IoTDCPClientMaxRequests 1024
+#endif
+#if (IoTDCPClientMaxRequests <= 0)
+#error("IoTDCPClientMaxRequests <= 0")
+#endif
+#if (IoTDCPClientMaxRequests > 65534)
+#error("IoTDCPClientMaxRequests > 65534")
+#endif
+// Must be a power of 2
+#ifndef IoTDCPClientHashSize
+#define IoTDCPClientHashSize 512
+#endif
+#if (IoTDCPClientHashSize < 2 || (IoTDCPClientHashSize & (IoTDCPClientHashSize - 1)))
+#error("IoTDCPClientHashSize must be a power of 2")
+#endif
+#ifndef IoTDCPClientPipelineDepth
+#define IoTDCPClientPipelineDepth 8
+#endif
+#if (IoTDCPClientPipelineDepth < 1 || IoTDCPClientPipelineDepth > 255)
+#error("IoTDCPClientPipelineDepth must be between 1 and 255")
+#endif
+#ifndef IoTDCPClientMaxPayloadLength
+#define IoTDCPClientMaxPayloadLength 64
+#endif
+#if (IoTDCPClientMaxPayloadLength < 8)
+#error("IoTDCPClientMaxPayloadLength < 8")
+#endif
+#if (IoTDCPClientMaxPayloadLength > 1024)
+#error("IoTDCPClientMaxPayloadLength > 1024")
+#endif
+#ifndef IoTDCPClientInitialRto
+#define IoTDCPClientInitialRto 1000
+#endif
+#ifndef IoTDCPClientMinRto
+#define IoTDCPClientMinRto 50
+#endif
+#ifndef IoTDCPClientMaxRto
+#define IoTDCPClientMaxRto 8000
+#endif
+#if (IoTDCPClientMinRto < 1 || IoTDCPClientMinRto > IoTDCPClientInitialRto || IoTDCPClientInitialRto > IoTDCPClientMaxRto)
+#error("IoTDCPClientMinRto <= IoTDCPClientInitialRto <= IoTDCPClientMaxRto is required")
+#endif
+#ifndef IoTDCPClientMaxRetries
+#define IoTDCPClientMaxRetries 4
+#endif
+#ifndef IoTDCPClientTimeSyncMaxAge
+#define IoTDCPClientTimeSyncMaxAge 60000
+#endif
+
+#ifndef IoTDiscoveryMaxDevices
+#define IoTDiscoveryMaxDevices 32
+#endif
+#if (IoTDiscoveryMaxDevices <= 0)
+#error("IoTDiscoveryMaxDevices <= 0")
+#endif
+#if (IoTDiscoveryMaxDevices > 65535)
+#error("IoTDiscoveryMaxDevices > 65535")
+#endif
+
+// 2570 = 0x0A0A (at the present date it is not assigned to any services)
+#define IoTPort 2570
+
+#ifndef IoTMulticastGroupAddressDefined
+#define IoTMulticastGroupAddressDefined
+// 239.255.10.10 (administratively scoped), used by MessageGroup and by discovery
+const uint8_t IoTMulticastGroupAddress[] = { 239, 255, 10, 10 };
+#endif
+
+class _IoTResponseFrame {
+public:
+	// Returns false if srcBuffer is not a well formed response; when the
+	// payload length in the header is 0xFFFF, the response code and the
+	// payload length are taken from the trailer, right before EndOfPacket
+	static uint8_t read(const uint8_t* srcBuffer, uint16_t length, uint8_t& code, uint16_t& payloadLength) {
+		if (length < (8 + 1) ||
+			srcBuffer[0] != 0x55 ||
+			srcBuffer[length - 1] != 0x33)
+			return false;
+		code = srcBuffer[5];
+		payloadLength = ((uint16_t)srcBuffer[6]) | (((uint16_t)srcBuffer[7]) << 8);
+		if (payloadLength != 0xFFFF)
+			return (payloadLength == length - (8 + 1));
+		if (length < (8 + 3 + 1))
+			return false;
+		code = srcBuffer[length - 4];
+		payloadLength = ((uint16_t)srcBuffer[length - 3]) | (((uint16_t)srcBuffer[length - 2]) << 8);
+		return (payloadLength == length - (8 + 3 + 1));
+	}
+};
+
+struct IoTDiscoveredDevice {
+public:
+	uint32_t ip; // Same byte order as the socket address
+	uint16_t port; // Same byte order as the socket address
+	uint8_t flags;
+	uint8_t categoryUuid[16]; // Element 0 is the least significant
+	uint8_t uuid[16]; // Element 0 is the least significant
+	uint8_t interfaceCount;
+	uint8_t nameLength;
+	char name[65]; // UTF-8 encoded, always null terminated
+};
+
+class IoTDiscoveryCollector {
+private:
+	uint16_t previousDeviceCount;
+
+public:
+	enum _QueryLengths {
+		QueryLength = 11
+	};
+
+	uint16_t deviceCount;
+	IoTDiscoveredDevice devices[IoTDiscoveryMaxDevices];
+
+	IoTDiscoveryCollector() : previousDeviceCount(0), deviceCount(0) {
+	}
+
+	// Must be called before each new query
+	void reset() {
+		if (previousDeviceCount < deviceCount)
+			previousDeviceCount = deviceCount;
+		deviceCount = 0;
+	}
+
+	// Largest amount of devices found so far
+	uint16_t fleetSizeEstimate() const {
+		return ((previousDeviceCount > deviceCount) ? previousDeviceCount : deviceCount);
+	}
+
+	// dstBuffer must have room for QueryLength bytes (0 means "unknown", in
+	// which case the devices answer right away)
+	static uint16_t buildQuery(uint8_t* dstBuffer, uint16_t fleetSizeEstimate) {
+		dstBuffer[0] = 0x55; // StartOfPacket
+		dstBuffer[1] = 0x00; // MessageQueryDevice
+		dstBuffer[2] = 0xFF; // InvalidClientId
+		dstBuffer[3] = 0xFF; // MaximumSequenceNumber
+		dstBuffer[4] = 0xFF;
+		dstBuffer[5] = 0; // No password
+		if (!fleetSizeEstimate) {
+			dstBuffer[6] = 0;
+			dstBuffer[7] = 0;
+			dstBuffer[8] = 0x33; // EndOfPacket
+			return QueryLength - 2;
+		}
+		dstBuffer[6] = 2;
+		dstBuffer[7] = 0;
+		dstBuffer[8] = (uint8_t)fleetSizeEstimate;
+		dstBuffer[9] = (uint8_t)(fleetSizeEstimate >> 8);
+		dstBuffer[10] = 0x33; // EndOfPacket
+		return QueryLength;
+	}
+
+	// Returns the device, only the first time it answers (even if it changed
+	// its address), or 0 if srcBuffer is not a valid response, or if there
+	// is no more room
+	IoTDiscoveredDevice* collect(const uint8_t* srcBuffer, uint16_t length, uint32_t ip, uint16_t port) {
+		// StartOfPacket, MessageQueryDevice, InvalidClientId, MaximumSequenceNumber,
+		// ResponseOK, payload length, payload (at least 35 bytes), EndOfPacket
+		uint8_t code;
+		uint16_t payloadLength;
+		if (!_IoTResponseFrame::read(srcBuffer, length, code, payloadLength) ||
+			srcBuffer[1] != 0x00 ||
+			code != 0x00 ||
+			payloadLength < 35)
+			return 0;
+
+		const uint8_t* payload = srcBuffer + 8;
+		const uint8_t interfaceCount = payload[33];
+		if (payloadLength < 35 + interfaceCount)
+			return 0;
+		const uint8_t nameLength = payload[34 + interfaceCount];
+		if (payloadLength != 35 + interfaceCount + nameLength || nameLength > 64)
+			return 0;
+
+		for (uint16_t i = 0; i < deviceCount; i++) {
+			if (!memcmp(devices[i].uuid, payload + 17, 16))
+				return 0;
+		}
+		if (deviceCount >= IoTDiscoveryMaxDevices)
+			return 0;
+
+		IoTDiscoveredDevice* device = devices + deviceCount;
+		deviceCount++;
+		device->ip = ip;
+		device->port = port;
+		device->flags = payload[0];
+		memcpy(device->categoryUuid, payload + 1, 16);
+		memcpy(device->uuid, payload + 17, 16);
+		device->interfaceCount = interfaceCount;
+		device->nameLength = nameLength;
+		memcpy(device->name, payload + 35 + interfaceCount, nameLength);
+		device->name[nameLength] = 0;
+		return device;
+	}
+};
+
+class IoTSeriesDecoder {
+public:
+	enum _SeriesEncodings {
+		SeriesPlain = 0x00,
+		SeriesCompressed = 0x01
+	};
+
+private:
+	enum _DataTypes {
+		DataTypeS8 = 0x00,
+		DataTypeS16 = 0x01,
+		DataTypeS32 = 0x02,
+		DataTypeS64 = 0x03,
+		DataTypeU8 = 0x04,
+		DataTypeU16 = 0x05,
+		DataTypeU32 = 0x06,
+		DataTypeU64 = 0x07,
+		DataTypeFloat32 = 0x08,
+		DataTypeFloat64 = 0x09,
+		DataTypeRGBTriplet = 0x0A,
+		HeaderLength = 6
+	};
+
+	const uint8_t* payload;
+	uint32_t bitOffset, bitLength;
+	uint64_t value;
+	uint32_t timestamp;
+	int32_t delta;
+	uint16_t sampleCount, remainingCount;
+	uint8_t size, leading, trailing;
+
+	static uint8_t dataTypeSize(uint8_t dataType) {
+		switch (dataType) {
+		case DataTypeS8:
+		case DataTypeU8:
+			return 1;
+		case DataTypeS16:
+		case DataTypeU16:
+			return 2;
+		case DataTypeRGBTriplet:
+			return 3;
+		case DataTypeS32:
+		case DataTypeU32:
+		case DataTypeFloat32:
+			return 4;
+		case DataTypeS64:
+		case DataTypeU64:
+		case DataTypeFloat64:
+			return 8;
+		}
+		return 0;
+	}
+
+	uint64_t extend(uint64_t bits) const {
+		switch (dataType()) {
+		case DataTypeS8:
+			return (uint64_t)(int64_t)(int8_t)bits;
+		case DataTypeS16:
+			return (uint64_t)(int64_t)(int16_t)bits;
+		case DataTypeS32:
+			return (uint64_t)(int64_t)(int32_t)bits;
+		}
+		return bits;
+	}
+
+	// Reads up to 57 bits, most significant bit first
+	uint8_t readBits(uint8_t count, uint64_t& bits) {
+		if (count > bitLength - bitOffset)
+			return false;
+		bits = 0;
+		while (count) {
+			const uint8_t available = (uint8_t)(8 - (bitOffset & 7));
+			const uint8_t taken = ((count < available) ? count : available);
+			bits = (bits << taken) | ((payload[bitOffset >> 3] >> (available - taken)) & ((1 << taken) - 1));
+			bitOffset += taken;
+			count -= taken;
+		}
+		return true;
+	}
+
+	uint8_t readBits64(uint8_t count, uint64_t& bits) {
+		uint64_t low;
+		if (count <= 32)
+			return readBits(count, bits);
+		if (!readBits(count - 32, bits) || !readBits(32, low))
+			return false;
+		bits = (bits << 32) | low;
+		return true;
+	}
+
+	uint8_t readVarint(uint64_t& value) {
+		uint64_t byte;
+		value = 0;
+		for (uint8_t shift = 0; shift < 70; shift += 7) {
+			if (!readBits(8, byte))
+				return false;
+			value |= (byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	uint8_t readCompressed() {
+		uint64_t bits;
+		const uint8_t first = (remainingCount == sampleCount);
+		if (first) {
+			if (!readBits(32, bits))
+				return false;
+			timestamp = (uint32_t)bits;
+			delta = 0;
+		} else {
+			if (!readVarint(bits))
+				return false;
+			const int32_t deltaOfDeltas = (int32_t)((uint32_t)(bits >> 1) ^ (uint32_t)(0 - (uint32_t)(bits & 1)));
+			delta = (int32_t)((uint32_t)delta + (uint32_t)deltaOfDeltas);
+			timestamp += (uint32_t)delta;
+		}
+
+		if (dataType() == DataTypeFloat32 || dataType() == DataTypeFloat64) {
+			const uint8_t bitSize = (uint8_t)(size << 3);
+			if (first) {
+				leading = 0xFF;
+				return readBits64(bitSize, value);
+			}
+			if (!readBits(1, bits))
+				return false;
+			if (!bits)
+				return true;
+			if (!readBits(1, bits))
+				return false;
+			if (bits) {
+				uint64_t leadingBits, meaningfulBits;
+				if (!readBits(5, leadingBits) || !readBits((bitSize == 32) ? 5 : 6, meaningfulBits) || leadingBits + meaningfulBits + 1 > bitSize)
+					return false;
+				leading = (uint8_t)leadingBits;
+				trailing = (uint8_t)(bitSize - leading - (meaningfulBits + 1));
+			} else if (leading == 0xFF) {
+				return false;
+			}
+			if (!readBits64(bitSize - leading - trailing, bits))
+				return false;
+			value ^= (bits << trailing);
+			return true;
+		}
+
+		if (!readVarint(bits))
+			return false;
+		bits = (bits >> 1) ^ (0 - (bits & 1));
+		value = (first ? bits : (value + bits));
+		return true;
+	}
+
+public:
+	IoTSeriesDecoder() : payload(0), bitOffset(0), bitLength(0), sampleCount(0), remainingCount(0), size(0) {
+	}
+
+	uint8_t begin(const uint8_t* payload, uint16_t payloadLength) {
+		remainingCount = 0;
+		if (!payload || payloadLength < HeaderLength)
+			return false;
+		size = dataTypeSize(payload[2]);
+		const uint16_t count = (uint16_t)(payload[4] | (payload[5] << 8));
+		if (!size ||
+			payload[3] > SeriesCompressed ||
+			(payload[3] == SeriesPlain && payloadLength != HeaderLength + (uint32_t)count * (4 + size)))
+			return false;
+		this->payload = payload;
+		bitOffset = HeaderLength << 3;
+		bitLength = (uint32_t)payloadLength << 3;
+		sampleCount = count;
+		remainingCount = count;
+		return true;
+	}
+
+	uint8_t interfaceIndex() const {
+		return payload[0];
+	}
+
+	uint8_t propertyIndex() const {
+		return payload[1];
+	}
+
+	uint8_t dataType() const {
+		return payload[2];
+	}
+
+	uint8_t encoding() const {
+		return payload[3];
+	}
+
+	uint16_t count() const {
+		return sampleCount;
+	}
+
+	// Signed integers come sign extended, and floats as their bits
+	uint8_t next(uint32_t& timestamp, uint64_t& value) {
+		if (!remainingCount)
+			return false;
+		if (encoding() == SeriesPlain) {
+			const uint8_t* const srcBuffer = payload + (bitOffset >> 3);
+			uint64_t bits = 0;
+			for (uint8_t i = size; i; i--)
+				bits = (bits << 8) | srcBuffer[3 + i];
+			this->timestamp = (uint32_t)srcBuffer[0] | ((uint32_t)srcBuffer[1] << 8) | ((uint32_t)srcBuffer[2] << 16) | ((uint32_t)srcBuffer[3] << 24);
+			this->value = extend(bits);
+			bitOffset += (uint32_t)(4 + size) << 3;
+		} else if (!readCompressed()) {
+			remainingCount = 0;
+			return false;
+		}
+		remainingCount--;
+		timestamp = this->timestamp;
+		value = this->value;
+		return true;
+	}
+
+	uint8_t next(uint32_t& timestamp, double& value) {
+		uint64_t bits;
+		if (!next(timestamp, bits))
+			return false;
+		switch (dataType()) {
+		case DataTypeS8:
+		case DataTypeS16:
+		case DataTypeS32:
+		case DataTypeS64:
+			value = (double)(int64_t)bits;
+			break;
+		case DataTypeFloat32:
+			{
+				const uint32_t bits32 = (uint32_t)bits;
+				float f;
+				memcpy(&f, &bits32, sizeof(f));
+				value = f;
+			}
+			break;
+		case DataTypeFloat64:
+			memcpy(&value, &bits, sizeof(value));
+			break;
+		default:
+			value = (double)bits;
+			break;
+		}
+		return true;
+	}
+};
+
+struct IoTStreamReport {
+public:
+	uint8_t streamId;
+	uint16_t sequenceNumber; // Last frame accepted by the device
+	uint32_t receivedFrames;
+	uint32_t lostFrames;
+	uint32_t lateFrames; // Received after a newer one, and never applied
+	uint16_t jitter; // Milliseconds (RFC 3550 interarrival jitter)
+};
+
+struct IoTAggregateReport {
+public:
+	uint32_t window; // Milliseconds
+	uint32_t age; // Milliseconds since the end of the window
+	uint32_t count; // 0 when no samples arrived during the window
+	float minimum;
+	float maximum;
+	float mean;
+};
+
+#ifdef IoTMillis
+// buffer only remains valid during the call
+typedef void (*IoTDCPClientSend)(void* sendContext, uint32_t ip, uint16_t port, const uint8_t* buffer, uint16_t length);
+// payload only remains valid during the call (it is 0 when result is
+// ResultTimeout or ResultCancelled)
+typedef void (*IoTDCPClientCallback)(void* context, uint16_t device, uint8_t message, uint16_t result, const uint8_t* payload, uint16_t payloadLength);
+
+class IoTDCPClient {
+public:
+	enum _Devices {
+		InvalidDevice = 0xFFFF
+	};
+
+	enum _Results {
+		// Values below 0x100 are response codes sent by the device
+		ResultTimeout = 0x100,
+		ResultCancelled = 0x101
+	};
+
+	enum _Messages {
+		MessageQueryDevice = 0x00,
+		MessageDescribeInterface = 0x01,
+		MessageDescribeEnum = 0x02,
+		MessageHandshake = 0x05,
+		MessagePing = 0x06,
+		MessageReset = 0x07,
+		MessageGoodBye = 0x08,
+		MessageExecute = 0x09,
+		MessageGetProperty = 0x0A,
+		MessageSetProperty = 0x0B,
+		MessageScene = 0x0C,
+		MessageGetPropertyRange = 0x0E,
+		MessageSetPropertyRange = 0x0F,
+		MessageOpenStream = 0x10,
+		MessageCloseStream = 0x11,
+		MessageScheduleScene = 0x13,
+		MessageScheduleTimer = 0x14,
+		MessageListSchedule = 0x15,
+		MessageCancelSchedule = 0x16,
+		MessageSetRule = 0x17,
+		MessageDeleteRule = 0x18,
+		MessageGetSeries = 0x19,
+		MessageGetAggregates = 0x1A,
+		ServerMessageStreamReport = 0x81
+	};
+
+	enum _RuleOperations {
+		RuleEnd = 0x00,
+		RuleLoad = 0x01, // Followed by Interface index and Property index
+		RuleConstant = 0x02, // Followed by a 4-byte little endian float
+		RuleAdd = 0x03,
+		RuleSubtract = 0x04,
+		RuleMultiply = 0x05,
+		RuleLess = 0x06,
+		RuleLessOrEqual = 0x07,
+		RuleGreater = 0x08,
+		RuleGreaterOrEqual = 0x09,
+		RuleEqual = 0x0A,
+		RuleNotEqual = 0x0B,
+		RuleAnd = 0x0C,
+		RuleOr = 0x0D,
+		RuleNot = 0x0E
+	};
+
+private:
+	enum _Internal {
+		InvalidIndex = 0xFFFF,
+		InvalidClientId = 0xFF,
+		ResponseOK = 0x00,
+		ResponseUnknownClient = 0x02,
+		ResponseCookieRequired = 0x13,
+		HeaderLength = 8,
+		MaxPasswordLength = 64,
+		CookieLength = 8,
+		TimeSyncLength = 12,
+		StreamFrameHeaderLength = 6,
+		StreamReportLength = 17
+	};
+
+	struct _Device {
+	public:
+		uint32_t ip;
+		uint16_t port;
+		uint8_t used;
+		uint8_t clientId;
+		uint8_t exclusiveInFlight; // Nothing else is sent while a request that is not idempotent is in flight
+		uint8_t inFlightCount;
+		uint8_t passwordLength;
+		uint8_t timeSynchronized;
+		uint16_t nextSequenceNumber;
+		uint16_t lastSequenceNumber; // The last one sent along with a client id
+		uint16_t hashNext;
+		uint16_t firstInFlight;
+		uint16_t firstQueued;
+		uint16_t lastQueued;
+		uint32_t smoothedRtt; // << 3, as in RFC 6298
+		uint32_t rttVariance; // << 2, as in RFC 6298
+		uint32_t rto;
+		uint32_t timeOffset; // Device clock - client clock
+		uint32_t timeRoundTrip; // Of the sample timeOffset came from
+		uint32_t timeSampled;
+		uint8_t password[MaxPasswordLength];
+	};
+
+	struct _Request {
+	public:
+		uint16_t next; // Next request in the same list (in flight, queued or free)
+		uint16_t device;
+		uint16_t heapIndex;
+		uint16_t sequenceNumber;
+		uint16_t payloadLength;
+		uint8_t message;
+		uint8_t retries;
+		uint32_t sentTime;
+		uint32_t deadline;
+		IoTDCPClientCallback callback;
+		void* context;
+		uint8_t payload[IoTDCPClientMaxPayloadLength];
+	};
+
+	IoTDCPClientSend send;
+	void* sendContext;
+	IoTDCPClientCallback streamCallback;
+	void* streamContext;
+	uint16_t firstFreeDevice;
+	uint16_t firstFreeRequest;
+	uint16_t heapLength;
+	uint16_t buckets[IoTDCPClientHashSize];
+	uint16_t heap[IoTDCPClientMaxRequests]; // Requests in flight, by deadline
+	_Device devices[IoTDCPClientMaxDevices];
+	_Request requests[IoTDCPClientMaxRequests];
+	uint8_t packet[HeaderLength + MaxPasswordLength + IoTDCPClientMaxPayloadLength + 1];
+
+	static uint16_t hash(uint32_t ip, uint16_t port) {
+		const uint32_t h = (ip ^ ((uint32_t)port << 16) ^ port) * 0x9E3779B1;
+		return (uint16_t)((h >> 16) & (IoTDCPClientHashSize - 1));
+	}
+
+	static uint8_t hasClientId(uint8_t message) {
+		return (message > MessageDescribeEnum && message != MessageHandshake);
+	}
+
+	// Requests the device must not apply twice, which are sent alone, so they
+	// are never renumbered
+	static uint8_t isExclusive(uint8_t message) {
+		switch (message) {
+		case MessageHandshake:
+		case MessageReset:
+		case MessageExecute:
+		case MessageScene:
+		case MessageOpenStream:
+		case MessageScheduleScene:
+		case MessageScheduleTimer:
+		case MessageCancelSchedule:
+		case MessageSetRule:
+		case MessageDeleteRule:
+			return true;
+		}
+		return false;
+	}
+
+	void heapSwap(uint16_t a, uint16_t b) {
+		const uint16_t r = heap[a];
+		heap[a] = heap[b];
+		heap[b] = r;
+		requests[heap[a]].heapIndex = a;
+		requests[heap[b]].heapIndex = b;
+	}
+
+	// Deadlines are compared as differences, so IoTMillis() can wrap around
+	uint8_t heapLess(uint16_t a, uint16_t b) const {
+		return ((int32_t)(requests[heap[a]].deadline - requests[heap[b]].deadline) < 0);
+	}
+
+	void heapUp(uint16_t i) {
+		while (i) {
+			const uint16_t parent = (i - 1) >> 1;
+			if (!heapLess(i, parent))
+				break;
+			heapSwap(i, parent);
+			i = parent;
+		}
+	}
+
+	void heapDown(uint16_t i) {
+		for (;;) {
+			const uint16_t left = (i << 1) + 1;
+			if (left >= heapLength)
+				break;
+			uint16_t child = left;
+			if (left + 1 < heapLength && heapLess(left + 1, left))
+				child = left + 1;
+			if (!heapLess(child, i))
+				break;
+			heapSwap(i, child);
+			i = child;
+		}
+	}
+
+	void heapPush(uint16_t r) {
+		heap[heapLength] = r;
+		requests[r].heapIndex = heapLength;
+		heapUp(heapLength++);
+	}
+
+	void heapRemove(uint16_t r) {
+		const uint16_t i = requests[r].heapIndex;
+		heapLength--;
+		if (i != heapLength) {
+			heapSwap(i, heapLength);
+			heapDown(i);
+			heapUp(i);
+		}
+		requests[r].heapIndex = InvalidIndex;
+	}
+
+	void unlinkInFlight(_Device& device, uint16_t r) {
+		uint16_t* link = &device.firstInFlight;
+		while (*link != r)
+			link = &requests[*link].next;
+		*link = requests[r].next;
+		device.inFlightCount--;
+		if (isExclusive(requests[r].message))
+			device.exclusiveInFlight = false;
+	}
+
+	uint16_t findInFlight(const _Device& device, uint8_t message, uint16_t sequenceNumber) const {
+		for (uint16_t r = device.firstInFlight; r != InvalidIndex; r = requests[r].next) {
+			const _Request& request = requests[r];
+			if (request.message != message)
+				continue;
+			// Messages without a client id are matched only by message type
+			if (!hasClientId(message) || request.sequenceNumber == sequenceNumber)
+				return r;
+		}
+		return InvalidIndex;
+	}
+
+	uint16_t allocateRequest(uint16_t d, uint8_t message, const void* payload, uint16_t payloadLength, IoTDCPClientCallback callback, void* context) {
+		if (d >= IoTDCPClientMaxDevices ||
+			!devices[d].used ||
+			payloadLength > IoTDCPClientMaxPayloadLength ||
+			firstFreeRequest == InvalidIndex)
+			return InvalidIndex;
+		const uint16_t r = firstFreeRequest;
+		_Request& request = requests[r];
+		firstFreeRequest = request.next;
+		request.next = InvalidIndex;
+		request.device = d;
+		request.heapIndex = InvalidIndex;
+		request.message = message;
+		request.retries = 0;
+		request.callback = callback;
+		request.context = context;
+		request.payloadLength = payloadLength;
+		for (uint16_t i = 0; i < payloadLength; i++)
+			request.payload[i] = ((const uint8_t*)payload)[i];
+		return r;
+	}
+
+	void releaseRequest(uint16_t r) {
+		requests[r].next = firstFreeRequest;
+		firstFreeRequest = r;
+	}
+
+	// The request must have already been removed from all lists
+	void complete(uint16_t r, uint16_t result, const uint8_t* payload, uint16_t payloadLength) {
+		_Request& request = requests[r];
+		const IoTDCPClientCallback callback = request.callback;
+		void* const context = request.context;
+		const uint16_t d = request.device;
+		const uint8_t message = request.message;
+		// Released first, so the callback can issue new requests
+		releaseRequest(r);
+		if (callback)
+			callback(context, d, message, result, payload, payloadLength);
+	}
+
+	void transmit(uint16_t r) {
+		_Request& request = requests[r];
+		const _Device& device = devices[request.device];
+		request.sentTime = IoTMillis();
+		// Time synchronization pings carry the time of each transmission (T1)
+		if (request.message == MessagePing && request.payloadLength == 4) {
+			request.payload[0] = (uint8_t)request.sentTime;
+			request.payload[1] = (uint8_t)(request.sentTime >> 8);
+			request.payload[2] = (uint8_t)(request.sentTime >> 16);
+			request.payload[3] = (uint8_t)(request.sentTime >> 24);
+		}
+		uint8_t* dstBuffer = packet;
+		*dstBuffer++ = 0x55; // StartOfPacket
+		*dstBuffer++ = request.message;
+		*dstBuffer++ = (hasClientId(request.message) ? device.clientId : (uint8_t)InvalidClientId);
+		*dstBuffer++ = (uint8_t)request.sequenceNumber;
+		*dstBuffer++ = (uint8_t)(request.sequenceNumber >> 8);
+		if (request.message > MessageDescribeEnum) {
+			*dstBuffer++ = device.passwordLength;
+			for (uint8_t i = 0; i < device.passwordLength; i++)
+				*dstBuffer++ = device.password[i];
+		} else {
+			*dstBuffer++ = 0;
+		}
+		*dstBuffer++ = (uint8_t)request.payloadLength;
+		*dstBuffer++ = (uint8_t)(request.payloadLength >> 8);
+		for (uint16_t i = 0; i < request.payloadLength; i++)
+			*dstBuffer++ = request.payload[i];
+		*dstBuffer++ = 0x33; // EndOfPacket
+
+		request.deadline = request.sentTime + device.rto;
+		heapPush(r);
+		send(sendContext, device.ip, device.port, packet, (uint16_t)(dstBuffer - packet));
+	}
+
+	void assignSequenceNumber(_Device& device, _Request& request) {
+		if (!hasClientId(request.message)) {
+			if (request.message == MessageHandshake) {
+				// The device takes the handshake sequence number as its last one
+				request.sequenceNumber = device.nextSequenceNumber++;
+				device.lastSequenceNumber = request.sequenceNumber;
+			} else {
+				request.sequenceNumber = 0xFFFF; // MaximumSequenceNumber
+			}
+			return;
+		}
+		request.sequenceNumber = device.nextSequenceNumber++;
+		device.lastSequenceNumber = request.sequenceNumber;
+	}
+
+	// Sends as many queued requests as possible, in order
+	void dispatch(uint16_t d) {
+		_Device& device = devices[d];
+		while (device.firstQueued != InvalidIndex && device.inFlightCount < IoTDCPClientPipelineDepth) {
+			const uint16_t r = device.firstQueued;
+			_Request& request = requests[r];
+			if (device.exclusiveInFlight)
+				return;
+			if (isExclusive(request.message)) {
+				if (device.firstInFlight != InvalidIndex)
+					return;
+			} else if (!hasClientId(request.message)) {
+				if (findInFlight(device, request.message, 0xFFFF) != InvalidIndex)
+					return;
+			}
+
+			device.firstQueued = request.next;
+			if (device.firstQueued == InvalidIndex)
+				device.lastQueued = InvalidIndex;
+
+			if (hasClientId(request.message) && device.clientId == InvalidClientId) {
+				complete(r, ResponseUnknownClient, 0, 0);
+				continue;
+			}
+
+			if (isExclusive(request.message))
+				device.exclusiveInFlight = true;
+			assignSequenceNumber(device, request);
+			request.next = device.firstInFlight;
+			device.firstInFlight = r;
+			device.inFlightCount++;
+			transmit(r);
+		}
+	}
+
+	void sampleRtt(_Device& device, uint32_t rtt) {
+		// RFC 6298, section 2, with alpha = 1/8 and beta = 1/4 (and G = 1 ms)
+		if (!device.smoothedRtt) {
+			// Never 0, which means there are no samples yet
+			device.smoothedRtt = (rtt << 3) | 1;
+			device.rttVariance = rtt << 1;
+		} else {
+			const uint32_t srtt = device.smoothedRtt >> 3;
+			const uint32_t delta = ((rtt > srtt) ? (rtt - srtt) : (srtt - rtt));
+			device.rttVariance = device.rttVariance - (device.rttVariance >> 2) + delta;
+			device.smoothedRtt = device.smoothedRtt - (device.smoothedRtt >> 3) + rtt;
+		}
+		const uint32_t variance = device.rttVariance;
+		uint32_t rto = (device.smoothedRtt >> 3) + (variance ? variance : 1);
+		if (rto < IoTDCPClientMinRto)
+			rto = IoTDCPClientMinRto;
+		else if (rto > IoTDCPClientMaxRto)
+			rto = IoTDCPClientMaxRto;
+		device.rto = rto;
+	}
+
+	// NTP-like estimate, using T1 echoed by the device, so retransmitted
+	// requests also provide valid samples
+	void sampleClock(_Device& device, const uint8_t* payload) {
+		const uint32_t t4 = IoTMillis();
+		const uint32_t t1 = (uint32_t)payload[0] | ((uint32_t)payload[1] << 8) | ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24);
+		const uint32_t t2 = (uint32_t)payload[4] | ((uint32_t)payload[5] << 8) | ((uint32_t)payload[6] << 16) | ((uint32_t)payload[7] << 24);
+		const uint32_t t3 = (uint32_t)payload[8] | ((uint32_t)payload[9] << 8) | ((uint32_t)payload[10] << 16) | ((uint32_t)payload[11] << 24);
+		int32_t roundTrip = (int32_t)((t4 - t1) - (t3 - t2));
+		if (roundTrip < 0)
+			roundTrip = 0;
+		if (device.timeSynchronized &&
+			(uint32_t)roundTrip > device.timeRoundTrip &&
+			(t4 - device.timeSampled) <= IoTDCPClientTimeSyncMaxAge)
+			return;
+		// ((T2 - T1) + (T3 - T4)) / 2 = (T2 - T1) - (round trip / 2), which
+		// also works when the clocks wrap around
+		device.timeOffset = (t2 - t1) - ((uint32_t)roundTrip >> 1);
+		device.timeRoundTrip = (uint32_t)roundTrip;
+		device.timeSampled = t4;
+		device.timeSynchronized = true;
+	}
+
+	void retransmit(uint16_t r) {
+		_Request& request = requests[r];
+		_Device& device = devices[request.device];
+		// RFC 6298, section 5.5
+		device.rto <<= 1;
+		if (device.rto > IoTDCPClientMaxRto)
+			device.rto = IoTDCPClientMaxRto;
+
+		if (request.retries >= IoTDCPClientMaxRetries) {
+			unlinkInFlight(device, r);
+			const uint16_t d = request.device;
+			complete(r, ResultTimeout, 0, 0);
+			dispatch(d);
+			return;
+		}
+		request.retries++;
+		// Repeating an old sequence number, after newer ones have been sent,
+		// would make the device drop the request (requests that are not
+		// idempotent are sent alone, so this never happens to them)
+		if (hasClientId(request.message) && request.sequenceNumber != device.lastSequenceNumber)
+			assignSequenceNumber(device, request);
+		transmit(r);
+	}
+
+	void cancelAll(uint16_t d) {
+		_Device& device = devices[d];
+		while (device.firstInFlight != InvalidIndex) {
+			const uint16_t r = device.firstInFlight;
+			device.firstInFlight = requests[r].next;
+			heapRemove(r);
+			complete(r, ResultCancelled, 0, 0);
+		}
+		device.inFlightCount = 0;
+		device.exclusiveInFlight = false;
+		while (device.firstQueued != InvalidIndex) {
+			const uint16_t r = device.firstQueued;
+			device.firstQueued = requests[r].next;
+			complete(r, ResultCancelled, 0, 0);
+		}
+		device.lastQueued = InvalidIndex;
+	}
+
+public:
+	IoTDCPClient(IoTDCPClientSend send, void* sendContext) : send(send), sendContext(sendContext), streamCallback(0), streamContext(0), heapLength(0) {
+		uint16_t i;
+		for (i = 0; i < IoTDCPClientHashSize; i++)
+			buckets[i] = InvalidIndex;
+		for (i = 0; i < IoTDCPClientMaxDevices; i++) {
+			devices[i].used = false;
+			devices[i].hashNext = ((i + 1 < IoTDCPClientMaxDevices) ? (uint16_t)(i + 1) : (uint16_t)InvalidIndex);
+		}
+		for (i = 0; i < IoTDCPClientMaxRequests; i++)
+			requests[i].next = ((i + 1 < IoTDCPClientMaxRequests) ? (uint16_t)(i + 1) : (uint16_t)InvalidIndex);
+		firstFreeDevice = 0;
+		firstFreeRequest = 0;
+	}
+
+	// ip and port must be in the same byte order given to receive(), and
+	// password is only used by messages that carry a client id
+	uint16_t addDevice(uint32_t ip, uint16_t port, const char* password = 0, uint8_t passwordLength = 255) {
+		if (findDevice(ip, port) != InvalidDevice || firstFreeDevice == InvalidIndex)
+			return InvalidDevice;
+		if (passwordLength == 255)
+			passwordLength = (uint8_t)(password ? strlen(password) : 0);
+		if (passwordLength > MaxPasswordLength)
+			return InvalidDevice;
+
+		const uint16_t d = firstFreeDevice;
+		_Device& device = devices[d];
+		firstFreeDevice = device.hashNext;
+		const uint16_t h = hash(ip, port);
+		device.hashNext = buckets[h];
+		buckets[h] = d;
+
+		device.ip = ip;
+		device.port = port;
+		device.used = true;
+		device.clientId = InvalidClientId;
+		device.exclusiveInFlight = false;
+		device.inFlightCount = 0;
+		device.passwordLength = passwordLength;
+		for (uint8_t i = 0; i < passwordLength; i++)
+			device.password[i] = (uint8_t)password[i];
+		// Any starting point will do, as the handshake tells the device which one was chosen
+		device.nextSequenceNumber = (uint16_t)(IoTMillis() ^ (d << 4));
+		device.lastSequenceNumber = device.nextSequenceNumber;
+		device.firstInFlight = InvalidIndex;
+		device.firstQueued = InvalidIndex;
+		device.lastQueued = InvalidIndex;
+		device.smoothedRtt = 0;
+		device.rttVariance = 0;
+		device.rto = IoTDCPClientInitialRto;
+		device.timeSynchronized = false;
+		device.timeOffset = 0;
+		device.timeRoundTrip = 0;
+		device.timeSampled = 0;
+		return d;
+	}
+
+	// All requests still pending complete with ResultCancelled
+	void removeDevice(uint16_t d) {
+		if (d >= IoTDCPClientMaxDevices || !devices[d].used)
+			return;
+		_Device& device = devices[d];
+		// Callbacks must not be able to queue new requests from now on
+		device.used = false;
+		cancelAll(d);
+		uint16_t* link = &buckets[hash(device.ip, device.port)];
+		while (*link != d)
+			link = &devices[*link].hashNext;
+		*link = device.hashNext;
+		device.hashNext = firstFreeDevice;
+		firstFreeDevice = d;
+	}
+
+	uint16_t findDevice(uint32_t ip, uint16_t port) const {
+		for (uint16_t d = buckets[hash(ip, port)]; d != InvalidIndex; d = devices[d].hashNext) {
+			if (devices[d].ip == ip && devices[d].port == port)
+				return d;
+		}
+		return InvalidDevice;
+	}
+
+	uint8_t isConnected(uint16_t d) const {
+		return (d < IoTDCPClientMaxDevices && devices[d].used && devices[d].clientId != InvalidClientId);
+	}
+
+	// Current retransmission timeout of the device, in milliseconds
+	uint32_t rto(uint16_t d) const {
+		return ((d < IoTDCPClientMaxDevices) ? devices[d].rto : 0);
+	}
+
+	uint8_t isTimeSynchronized(uint16_t d) const {
+		return (d < IoTDCPClientMaxDevices && devices[d].used && devices[d].timeSynchronized);
+	}
+
+	// Converts a time given in the client clock (IoTMillis()) to the device clock
+	uint32_t deviceTime(uint16_t d, uint32_t clientTime) const {
+		return ((d < IoTDCPClientMaxDevices) ? (clientTime + devices[d].timeOffset) : clientTime);
+	}
+
+	// Round trip of the sample the current estimate came from, in milliseconds
+	// (the estimate is off by half of it, at most)
+	uint32_t timeRoundTrip(uint16_t d) const {
+		return ((d < IoTDCPClientMaxDevices) ? devices[d].timeRoundTrip : 0);
+	}
+
+	// Queues any message (payload is copied), returning false if there are no
+	// free requests, or if payloadLength > IoTDCPClientMaxPayloadLength
+	uint8_t request(uint16_t d, uint8_t message, const void* payload, uint16_t payloadLength, IoTDCPClientCallback callback, void* context) {
+		const uint16_t r = allocateRequest(d, message, payload, payloadLength, callback, context);
+		if (r == InvalidIndex)
+			return false;
+		_Device& device = devices[d];
+		if (device.lastQueued == InvalidIndex)
+			device.firstQueued = r;
+		else
+			requests[device.lastQueued].next = r;
+		device.lastQueued = r;
+		dispatch(d);
+		return true;
+	}
+
+	uint8_t handshake(uint16_t d, IoTDCPClientCallback callback, void* context) {
+		return request(d, MessageHandshake, 0, 0, callback, context);
+	}
+
+	uint8_t ping(uint16_t d, IoTDCPClientCallback callback, void* context) {
+		return request(d, MessagePing, 0, 0, callback, context);
+	}
+
+	uint8_t syncTime(uint16_t d, IoTDCPClientCallback callback, void* context) {
+		// T1 is only filled in when the request is actually sent
+		const uint8_t payload[4] = { 0, 0, 0, 0 };
+		return request(d, MessagePing, payload, 4, callback, context);
+	}
+
+	// scene holds the same payload as MessageScene (operation count, followed
+	// by the operations), and clientTime is converted with deviceTime()
+	uint8_t scheduleScene(uint16_t d, uint32_t clientTime, const void* scene, uint16_t sceneLength, IoTDCPClientCallback callback, void* context) {
+		if (sceneLength > IoTDCPClientMaxPayloadLength - 4)
+			return false;
+		const uint32_t time = deviceTime(d, clientTime);
+		uint8_t payload[IoTDCPClientMaxPayloadLength];
+		payload[0] = (uint8_t)time;
+		payload[1] = (uint8_t)(time >> 8);
+		payload[2] = (uint8_t)(time >> 16);
+		payload[3] = (uint8_t)(time >> 24);
+		for (uint16_t i = 0; i < sceneLength; i++)
+			payload[4 + i] = ((const uint8_t*)scene)[i];
+		return request(d, MessageScheduleScene, payload, 4 + sceneLength, callback, context);
+	}
+
+	uint8_t scheduleTimer(uint16_t d, uint32_t delay, uint32_t interval, const void* scene, uint16_t sceneLength, IoTDCPClientCallback callback, void* context) {
+		if (sceneLength > IoTDCPClientMaxPayloadLength - 8)
+			return false;
+		uint8_t payload[IoTDCPClientMaxPayloadLength];
+		payload[0] = (uint8_t)delay;
+		payload[1] = (uint8_t)(delay >> 8);
+		payload[2] = (uint8_t)(delay >> 16);
+		payload[3] = (uint8_t)(delay >> 24);
+		payload[4] = (uint8_t)interval;
+		payload[5] = (uint8_t)(interval >> 8);
+		payload[6] = (uint8_t)(interval >> 16);
+		payload[7] = (uint8_t)(interval >> 24);
+		for (uint16_t i = 0; i < sceneLength; i++)
+			payload[8 + i] = ((const uint8_t*)scene)[i];
+		return request(d, MessageScheduleTimer, payload, 8 + sceneLength, callback, context);
+	}
+
+	uint8_t listSchedule(uint16_t d, IoTDCPClientCallback callback, void* context) {
+		return request(d, MessageListSchedule, 0, 0, callback, context);
+	}
+
+	uint8_t cancelSchedule(uint16_t d, uint8_t slot, IoTDCPClientCallback callback, void* context) {
+		return request(d, MessageCancelSchedule, &slot, 1, callback, context);
+	}
+
+	// code must end with RuleEnd, and the response payload is the rule slot
+	uint8_t setRule(uint16_t d, const void* code, uint8_t codeLength, const void* scene, uint16_t sceneLength, IoTDCPClientCallback callback, void* context) {
+		if (1 + (uint32_t)codeLength + sceneLength > IoTDCPClientMaxPayloadLength)
+			return false;
+		uint8_t payload[IoTDCPClientMaxPayloadLength];
+		payload[0] = codeLength;
+		for (uint16_t i = 0; i < codeLength; i++)
+			payload[1 + i] = ((const uint8_t*)code)[i];
+		for (uint16_t i = 0; i < sceneLength; i++)
+			payload[1 + codeLength + i] = ((const uint8_t*)scene)[i];
+		return request(d, MessageSetRule, payload, 1 + codeLength + sceneLength, callback, context);
+	}
+
+	uint8_t deleteRule(uint16_t d, uint8_t slot, IoTDCPClientCallback callback, void* context) {
+		return request(d, MessageDeleteRule, &slot, 1, callback, context);
+	}
+
+	// The response payload must be given to IoTSeriesDecoder (IoTTimeSeries
+	// must be defined on the device)
+	uint8_t getSeries(uint16_t d, uint8_t interfaceIndex, uint8_t propertyIndex, uint8_t encoding, uint32_t since, IoTDCPClientCallback callback, void* context) {
+		const uint8_t payload[7] = { interfaceIndex, propertyIndex, encoding, (uint8_t)since, (uint8_t)(since >> 8), (uint8_t)(since >> 16), (uint8_t)(since >> 24) };
+		return request(d, MessageGetSeries, payload, 7, callback, context);
+	}
+
+	uint8_t getAggregates(uint16_t d, uint8_t interfaceIndex, uint8_t propertyIndex, IoTDCPClientCallback callback, void* context) {
+		const uint8_t payload[2] = { interfaceIndex, propertyIndex };
+		return request(d, MessageGetAggregates, payload, 2, callback, context);
+	}
+
+	// Reads the report at index from the payload of a response to
+	// getAggregates() (returns false when there are no more reports)
+	static uint8_t readAggregateReport(const uint8_t* payload, uint16_t payloadLength, uint16_t index, IoTAggregateReport& report) {
+		if (!payload || 2 + (uint32_t)(index + 1) * 24 > payloadLength)
+			return false;
+		payload += 2 + index * 24;
+		uint32_t bits[6];
+		for (uint8_t i = 0; i < 6; i++, payload += 4)
+			bits[i] = (uint32_t)payload[0] | ((uint32_t)payload[1] << 8) | ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24);
+		report.window = bits[0];
+		report.age = bits[1];
+		report.count = bits[2];
+		memcpy(&report.minimum, bits + 3, sizeof(report.minimum));
+		memcpy(&report.maximum, bits + 4, sizeof(report.maximum));
+		memcpy(&report.mean, bits + 5, sizeof(report.mean));
+		return true;
+	}
+
+	// Reads the entry at index from the payload of a response to listSchedule()
+	// (returns false when there are no more entries)
+	static uint8_t readScheduleEntry(const uint8_t* payload, uint16_t payloadLength, uint16_t index, uint8_t& slot, uint32_t& delay, uint32_t& interval) {
+		if (!payload || (uint32_t)(index + 1) * 9 > payloadLength)
+			return false;
+		payload += index * 9;
+		slot = payload[0];
+		delay = (uint32_t)payload[1] | ((uint32_t)payload[2] << 8) | ((uint32_t)payload[3] << 16) | ((uint32_t)payload[4] << 24);
+		interval = (uint32_t)payload[5] | ((uint32_t)payload[6] << 8) | ((uint32_t)payload[7] << 16) | ((uint32_t)payload[8] << 24);
+		return true;
+	}
+
+	uint8_t goodBye(uint16_t d, IoTDCPClientCallback callback, void* context) {
+		return request(d, MessageGoodBye, 0, 0, callback, context);
+	}
+
+	uint8_t describeInterface(uint16_t d, uint8_t interfaceIndex, IoTDCPClientCallback callback, void* context) {
+		return request(d, MessageDescribeInterface, &interfaceIndex, 1, callback, context);
+	}
+
+	uint8_t describeEnum(uint16_t d, uint8_t interfaceIndex, uint8_t propertyIndex, IoTDCPClientCallback callback, void* context) {
+		const uint8_t payload[2] = { interfaceIndex, propertyIndex };
+		return request(d, MessageDescribeEnum, payload, 2, callback, context);
+	}
+
+	uint8_t execute(uint16_t d, uint8_t interfaceIndex, uint8_t command, IoTDCPClientCallback callback, void* context) {
+		const uint8_t payload[2] = { interfaceIndex, command };
+		return request(d, MessageExecute, payload, 2, callback, context);
+	}
+
+	uint8_t getProperty(uint16_t d, uint8_t interfaceIndex, uint8_t propertyIndex, IoTDCPClientCallback callback, void* context) {
+		const uint8_t payload[2] = { interfaceIndex, propertyIndex };
+		return request(d, MessageGetProperty, payload, 2, callback, context);
+	}
+
+	uint8_t setProperty(uint16_t d, uint8_t interfaceIndex, uint8_t propertyIndex, const void* value, uint16_t valueLength, IoTDCPClientCallback callback, void* context) {
+		if (valueLength > IoTDCPClientMaxPayloadLength - 4)
+			return false;
+		uint8_t payload[IoTDCPClientMaxPayloadLength];
+		payload[0] = interfaceIndex;
+		payload[1] = propertyIndex;
+		payload[2] = (uint8_t)valueLength;
+		payload[3] = (uint8_t)(valueLength >> 8);
+		for (uint16_t i = 0; i < valueLength; i++)
+			payload[4 + i] = ((const uint8_t*)value)[i];
+		return request(d, MessageSetProperty, payload, 4 + valueLength, callback, context);
+	}
+
+	uint8_t getPropertyRange(uint16_t d, uint8_t interfaceIndex, uint8_t propertyIndex, uint8_t offset, uint8_t count, IoTDCPClientCallback callback, void* context) {
+		const uint8_t payload[4] = { interfaceIndex, propertyIndex, offset, count };
+		return request(d, MessageGetPropertyRange, payload, 4, callback, context);
+	}
+
+	// values holds count elements (valueLength bytes), already little endian
+	uint8_t setPropertyRange(uint16_t d, uint8_t interfaceIndex, uint8_t propertyIndex, uint8_t offset, uint8_t count, const void* values, uint16_t valueLength, IoTDCPClientCallback callback, void* context) {
+		if (valueLength > IoTDCPClientMaxPayloadLength - 4)
+			return false;
+		uint8_t payload[IoTDCPClientMaxPayloadLength];
+		payload[0] = interfaceIndex;
+		payload[1] = propertyIndex;
+		payload[2] = offset;
+		payload[3] = count;
+		for (uint16_t i = 0; i < valueLength; i++)
+			payload[4 + i] = ((const uint8_t*)values)[i];
+		return request(d, MessageSetPropertyRange, payload, 4 + valueLength, callback, context);
+	}
+
+	// reportInterval is given in frames (0 = no reports)
+	uint8_t openStream(uint16_t d, uint8_t interfaceIndex, uint8_t propertyIndex, uint16_t reportInterval, IoTDCPClientCallback callback, void* context) {
+		const uint8_t payload[4] = { interfaceIndex, propertyIndex, (uint8_t)reportInterval, (uint8_t)(reportInterval >> 8) };
+		return request(d, MessageOpenStream, payload, 4, callback, context);
+	}
+
+	uint8_t closeStream(uint16_t d, uint8_t streamId, IoTDCPClientCallback callback, void* context) {
+		return request(d, MessageCloseStream, &streamId, 1, callback, context);
+	}
+
+	// value holds the whole property (dataTypeSize * elementCount bytes), already
+	// little endian, and is sent right away (returns false if the device is not
+	// connected, or if valueLength > IoTDCPClientMaxPayloadLength)
+	uint8_t sendStreamFrame(uint16_t d, uint8_t streamId, uint16_t sequenceNumber, const void* value, uint16_t valueLength) {
+		if (!isConnected(d) || valueLength > IoTDCPClientMaxPayloadLength)
+			return false;
+		const uint16_t sentTime = (uint16_t)IoTMillis();
+		uint8_t* dstBuffer = packet;
+		*dstBuffer++ = 0x57; // StartOfStreamFrame
+		*dstBuffer++ = streamId;
+		*dstBuffer++ = (uint8_t)sequenceNumber;
+		*dstBuffer++ = (uint8_t)(sequenceNumber >> 8);
+		*dstBuffer++ = (uint8_t)sentTime;
+		*dstBuffer++ = (uint8_t)(sentTime >> 8);
+		for (uint16_t i = 0; i < valueLength; i++)
+			*dstBuffer++ = ((const uint8_t*)value)[i];
+		*dstBuffer++ = 0x33; // EndOfPacket
+		send(sendContext, devices[d].ip, devices[d].port, packet, (uint16_t)(dstBuffer - packet));
+		return true;
+	}
+
+	// callback is called with message = ServerMessageStreamReport
+	void streamReports(IoTDCPClientCallback callback, void* context) {
+		streamCallback = callback;
+		streamContext = context;
+	}
+
+	static uint8_t readStreamReport(const uint8_t* payload, uint16_t payloadLength, IoTStreamReport& report) {
+		if (payloadLength != StreamReportLength)
+			return false;
+		report.streamId = payload[0];
+		report.sequenceNumber = (uint16_t)(payload[1] | (payload[2] << 8));
+		report.receivedFrames = (uint32_t)payload[3] | ((uint32_t)payload[4] << 8) | ((uint32_t)payload[5] << 16) | ((uint32_t)payload[6] << 24);
+		report.lostFrames = (uint32_t)payload[7] | ((uint32_t)payload[8] << 8) | ((uint32_t)payload[9] << 16) | ((uint32_t)payload[10] << 24);
+		report.lateFrames = (uint32_t)payload[11] | ((uint32_t)payload[12] << 8) | ((uint32_t)payload[13] << 16) | ((uint32_t)payload[14] << 24);
+		report.jitter = (uint16_t)(payload[15] | (payload[16] << 8));
+		return true;
+	}
+
+	// Returns false if srcBuffer is not a response to any requests in flight
+	// (such as duplicates and responses arriving after the timeout)
+	uint8_t receive(uint32_t ip, uint16_t port, const uint8_t* srcBuffer, uint16_t length) {
+		uint8_t code;
+		uint16_t payloadLength;
+		if (!_IoTResponseFrame::read(srcBuffer, length, code, payloadLength))
+			return false;
+		const uint16_t d = findDevice(ip, port);
+		if (d == InvalidDevice)
+			return false;
+		_Device& device = devices[d];
+		const uint8_t message = srcBuffer[1];
+		if (message == ServerMessageStreamReport) {
+			// Not a response to any requests, so nothing is completed
+			if (!streamCallback)
+				return false;
+			streamCallback(streamContext, d, message, code, srcBuffer + HeaderLength, payloadLength);
+			return true;
+		}
+		const uint16_t sequenceNumber = ((uint16_t)srcBuffer[3]) | (((uint16_t)srcBuffer[4]) << 8);
+		const uint16_t r = findInFlight(device, message, sequenceNumber);
+		if (r == InvalidIndex)
+			return false;
+		_Request& request = requests[r];
+		if (message == MessageHandshake && request.sequenceNumber != sequenceNumber)
+			return false;
+
+		// Karn's algorithm: only samples from requests sent only once are used
+		if (!request.retries)
+			sampleRtt(device, IoTMillis() - request.sentTime);
+		heapRemove(r);
+
+		const uint8_t* const payload = srcBuffer + HeaderLength;
+		if (message == MessageHandshake) {
+			// The device wants proof that we own our address (the cookie sent
+			// before, if any, has expired)
+			if (code == ResponseCookieRequired &&
+				payloadLength == CookieLength &&
+				(request.payloadLength != CookieLength || memcmp(request.payload, payload, CookieLength))) {
+				for (uint8_t i = 0; i < CookieLength; i++)
+					request.payload[i] = payload[i];
+				request.payloadLength = CookieLength;
+				assignSequenceNumber(device, request);
+				transmit(r);
+				return true;
+			}
+			if (code == ResponseOK && payloadLength >= 1)
+				device.clientId = payload[0];
+		} else if (code == ResponseUnknownClient) {
+			// The device restarted, or forgot about us
+			device.clientId = InvalidClientId;
+		} else if (message == MessageGoodBye && code == ResponseOK) {
+			device.clientId = InvalidClientId;
+		} else if (message == MessagePing && code == ResponseOK && payloadLength == TimeSyncLength) {
+			sampleClock(device, payload);
+		}
+
+		unlinkInFlight(device, r);
+		complete(r, code, payload, payloadLength);
+		dispatch(d);
+		return true;
+	}
+
+	// Retransmits or times out requests whose deadline has passed, returning
+	// how many milliseconds are left until the next deadline (0xFFFFFFFF when
+	// there are no requests in flight)
+	uint32_t poll() {
+		const uint32_t now = IoTMillis();
+		while (heapLength) {
+			const uint16_t r = heap[0];
+			const int32_t left = (int32_t)(requests[r].deadline - now);
+			if (left > 0)
+				return (uint32_t)left;
+			heapRemove(r);
+			retransmit(r);
+		}
+		return 0xFFFFFFFF;
+	}
+};
+#endif
+
+#endif
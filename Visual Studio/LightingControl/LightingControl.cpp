@@ -55,24 +55,205 @@
 #define IoTInterfaceCount 1
 #define IoTMaxPayloadLength 256
 
+//**************************************
+// If the device requires encryption
+// (IoTEncryptionKey must be shared with
+// the clients, and must be exactly 32
+// bytes long, and IoTSetpointStreamCount
+// must not be defined, as stream frames
+// are not authenticated)
+//#define IoTEncryptionRequired
+//#define IoTEncryptionKey {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F}
+//**************************************
+
+//**************************************
+// If more than 255 clients must be
+// served at the same time (clients must
+// use 16-bit client ids to get ids
+// above 254)
+//#define IoTExtendedClientId
+//#define IoTClientCount 1024
+//**************************************
+
+//**************************************
+// If the device must also listen to
+// MessageGroup (joinGroup() must be
+// called for every group)
+#define IoTGroupCount 4
+//**************************************
+
+//**************************************
+// If the device must also answer
+// MessageQueryDevice sent to
+// IoTMulticastGroupAddress, spreading
+// the responses over time when clients
+// send a fleet size estimate (run
+// LightingControl -discover <estimate>
+// to try it over loopback)
+#define IoTMulticastDiscovery
+#define IoTRandom32() ((((uint32_t)rand()) << 16) ^ (uint32_t)rand())
+//**************************************
+
+//**************************************
+// If repeated MessageGetProperty must
+// be answered by IoTServer, for up to
+// IoTPropertyCacheTime milliseconds,
+// without calling getProperty()
+#define IoTPropertyCacheCount 4
+#define IoTPropertyCacheTime 1000
+#define IoTMillis() currentTime()
+//**************************************
+
+//**************************************
+// If MessageHandshake must first be
+// answered with a cookie, so that only
+// clients that prove they own their
+// address get a client slot (IoTMillis()
+// and IoTRandom32() must be defined)
+//#define IoTHandshakeCookies
+//#define IoTHandshakeCookieTime 10000
+//**************************************
+
+//**************************************
+// If clients that have been quiet for
+// IoTClientTimeout milliseconds must
+// lose their client ids (IoTMillis()
+// must be defined, and tick() must be
+// called periodically)
+#define IoTClientTimeout 60000
+//**************************************
+
+//**************************************
+// If client sessions (along with the
+// name and the password, when they are
+// not read-only) must survive restarts
+#define IoTPersistentState
+//**************************************
+
+//**************************************
+// If other processes (such as sensor
+// drivers) must be able to publish
+// property values through shared
+// memory, to be returned without
+// calling getProperty() (run
+// LightingControl -publish <interface>
+// <property> <byte> to try it)
+//#define IoTPropertyPlane
+//#define IoTMemoryBarrier() MemoryBarrier()
+//**************************************
+
+//**************************************
+// If the last requests must be traced
+// (their timelines are printed when
+// the server exits)
+//#define IoTTrace 1024
+//**************************************
+
+//**************************************
+// If Set/Execute should only be
+// validated and answered, leaving the
+// (slow) hardware to another thread,
+// which applies only the latest value
+// of each property (see
+// actuatorThread() below)
+#define IoTActuatorQueue 4
+#define IoTActuatorValueLength 180 // Pixels (60 RGB triplets) is the longest property
+#define IoTMemoryBarrier() MemoryBarrier()
+//**************************************
+
+//**************************************
+// If properties must also accept
+// unacknowledged streams of values
+// (MessageOpenStream), for animations
+// and other high-rate updates (run
+// LightingControl -stream to try it)
+#define IoTSetpointStreamCount 2
+//**************************************
+
+//**************************************
+// If clients must be able to schedule
+// scenes for a given time (their clocks
+// are synchronized through
+// MessagePing), so that many devices
+// switch at the same moment (run
+// LightingControl -schedule <delay> to
+// try it), or to schedule recurring
+// scenes that keep running without any
+// clients (LightingControl -blink)
+#define IoTScheduleCount 4
+//**************************************
+
+//**************************************
+// If clients must be able to upload
+// rules, which apply scenes as soon as
+// the properties given to
+// propertyChanged() meet a condition
+// (run LightingControl -rule to try it)
+#define IoTRuleCount 4
+//**************************************
+
+//**************************************
+// If clients must be able to fetch the
+// recent samples of a property at once
+// (MessageGetSeries), optionally
+// compressed (run LightingControl
+// -series to try it)
+#define IoTTimeSeries
+//**************************************
+
+//**************************************
+// If the device must keep the minimum,
+// maximum and mean of some properties
+// over fixed windows (listed in
+// IoTAggregates), so clients do not
+// have to poll them all the time (run
+// LightingControl -aggregates to try
+// it)
+#define IoTAggregateCount 3
+//**************************************
+
+// Replays take the time from the capture file instead (see replay())
+bool replaying;
+DWORD replayTime;
+
+DWORD currentTime() {
+	return (replaying ? replayTime : GetTickCount());
+}
+
 #include "IoTDCP.h"
+#include "IoTDCPClient.h"
 
 // Just to make it easier to reference the interfaces and properties
 #define Interface0 0
 #define PropState 0
 #define PropColor 1
 #define PropSampleEnum 2
+#define PropPixels 3
+#define PropTemperature 4
+#define PixelCount 60
+#define TemperatureSampleInterval 100
+#define TemperatureSampleCount 1024 // Must be a power of 2
 
 const IoTPropertyDescriptor IoTInterface0Properties[] = {
 	{ "State", IoTProperty.ModeReadOnly, IoTProperty.DataTypeU8, 1, IoTProperty.UnitEnum, IoTProperty.UnitOne, 0 },
 	{ "Color", IoTProperty.ModeReadWrite, IoTProperty.DataTypeRGBTriplet, 1, IoTProperty.UnitRGB, IoTProperty.UnitOne, 0 },
-	{ "Sample Enum", IoTProperty.ModeReadWrite, IoTProperty.DataTypeS16, 1, IoTProperty.UnitEnum, IoTProperty.UnitOne, 0 }
+	{ "Sample Enum", IoTProperty.ModeReadWrite, IoTProperty.DataTypeS16, 1, IoTProperty.UnitEnum, IoTProperty.UnitOne, 0 },
+	{ "Pixels", IoTProperty.ModeReadWrite, IoTProperty.DataTypeRGBTriplet, PixelCount, IoTProperty.UnitRGB, IoTProperty.UnitOne, 0 },
+	{ "Temperature", IoTProperty.ModeReadOnly, IoTProperty.DataTypeFloat32, 1, IoTProperty.UnitDegreeCelsius, IoTProperty.UnitOne, 0 }
 };
 
 const IoTInterfaceDescriptor IoTInterfaces[IoTInterfaceCount] = {
 	{ "Sample Interface", IoTInterface.TypeOnOff, countof(IoTInterface0Properties), IoTInterface0Properties }
 };
 
+#ifdef IoTAggregateCount
+const IoTAggregateDescriptor IoTAggregates[IoTAggregateCount] = {
+	{ Interface0, PropTemperature, 1000 }, // 1 second
+	{ Interface0, PropTemperature, 60000 }, // 1 minute
+	{ Interface0, PropTemperature, 900000 } // 15 minutes
+};
+#endif
+
 const IoTEnumDescriptor16 IoTInterface0SampleEnum[] = {
 	{ "Value 0", 0 },
 	{ "Value 1", 1 },
@@ -83,14 +264,22 @@ const IoTEnumDescriptor16 IoTInterface0SampleEnum[] = {
 uint8_t onOff, color[3];
 uint8_t receivedBuffer[32 * 1024];
 uint16_t enumValue;
+IoTRGBTriplet pixels[PixelCount];
+float temperature, simulatedTemperature;
+DWORD nextTemperatureSampleTime;
+#ifdef IoTTimeSeries
+uint32_t temperatureSampleTotal;
+uint32_t temperatureTimestamps[TemperatureSampleCount];
+float temperatureSamples[TemperatureSampleCount];
+#endif
 
-void describeEnum(IoTMessageDescribeEnum* msg) {
-	if (msg->interfaceIndex) {
+void describeEnum(IoTDescribeEnumView msg) {
+	if (msg.interfaceIndex()) {
 		IoTServer.buildResponse(IoTServer.ResponseInvalidInterface);
 		return;
 	}
 
-	if (msg->propertyIndex != 2) {
+	if (msg.propertyIndex() != 2) {
 		// Since describing state's enum is not necessary and we do not have any other enums...
 		IoTServer.buildResponse(IoTServer.ResponseInvalidInterfaceProperty);
 	} else {
@@ -98,16 +287,56 @@ void describeEnum(IoTMessageDescribeEnum* msg) {
 	}
 }
 
-void executeCommand(IoTMessageExecute* msg) {
-	if (msg->interfaceIndex) {
+#ifdef IoTActuatorQueue
+void applyActuation(const IoTActuation& actuation);
+
+// Values are applied right away when they cannot be queued (every mailbox is
+// still waiting to be applied), instead of being lost
+void actuateCommand(uint8_t interfaceCommand) {
+	if (IoTServer.queueCommand(Interface0, interfaceCommand))
+		return;
+	IoTActuation actuation;
+	actuation.operation = IoTServer.SceneExecute;
+	actuation.interfaceIndex = Interface0;
+	actuation.interfaceCommand = interfaceCommand;
+	actuation.propertyIndex = 0;
+	actuation.propertyValueLength = 0;
+	applyActuation(actuation);
+}
+
+void actuateProperty(uint8_t propertyIndex, const void* value, uint16_t length) {
+	if (IoTServer.queueProperty(Interface0, propertyIndex, value, length))
+		return;
+	if (length > IoTActuatorValueLength) {
+		// IoTActuatorValueLength is too short for this property, so any other
+		// commands should go here
+		return;
+	}
+	IoTActuation actuation;
+	actuation.operation = IoTServer.SceneSetProperty;
+	actuation.interfaceIndex = Interface0;
+	actuation.interfaceCommand = 0;
+	actuation.propertyIndex = propertyIndex;
+	actuation.propertyValueLength = (uint8_t)length;
+	memcpy(actuation.propertyValue, value, length);
+	applyActuation(actuation);
+}
+#endif
+
+void executeCommand(IoTExecuteView msg) {
+	if (msg.interfaceIndex()) {
 		IoTServer.buildResponse(IoTServer.ResponseInvalidInterface);
 		return;
 	}
-	switch (msg->interfaceCommand) {
+	switch (msg.interfaceCommand()) {
 	case IoTInterfaceOnOff.CommandOff:
 		if (!IoTServer.isMessageRepeated()) {
 			onOff = IoTInterfaceOnOff.StateOff;
+#ifdef IoTActuatorQueue
+			actuateCommand(IoTInterfaceOnOff.CommandOff);
+#else
 			// Any other commands should go here
+#endif
 		}
 		IoTServer.writeResponseProperty8(Interface0, PropState, onOff);
 		IoTServer.buildResponse(IoTServer.ResponseOK);
@@ -115,7 +344,11 @@ void executeCommand(IoTMessageExecute* msg) {
 	case IoTInterfaceOnOff.CommandOn:
 		if (!IoTServer.isMessageRepeated()) {
 			onOff = IoTInterfaceOnOff.StateOn;
+#ifdef IoTActuatorQueue
+			actuateCommand(IoTInterfaceOnOff.CommandOn);
+#else
 			// Any other commands should go here
+#endif
 		}
 		IoTServer.writeResponseProperty8(Interface0, PropState, onOff);
 		IoTServer.buildResponse(IoTServer.ResponseOK);
@@ -126,12 +359,12 @@ void executeCommand(IoTMessageExecute* msg) {
 	}
 }
 
-void getProperty(IoTMessageGetProperty* msg) {
-	if (msg->interfaceIndex) {
+void getProperty(IoTGetPropertyView msg) {
+	if (msg.interfaceIndex()) {
 		IoTServer.buildResponse(IoTServer.ResponseInvalidInterface);
 		return;
 	}
-	switch (msg->propertyIndex) {
+	switch (msg.propertyIndex()) {
 	case PropState:
 		IoTServer.writeResponseProperty8(Interface0, PropState, onOff);
 		IoTServer.buildResponse(IoTServer.ResponseOK);
@@ -144,45 +377,110 @@ void getProperty(IoTMessageGetProperty* msg) {
 		IoTServer.writeResponseProperty16(Interface0, PropSampleEnum, enumValue);
 		IoTServer.buildResponse(IoTServer.ResponseOK);
 		break;
+	case PropPixels:
+		IoTServer.writeResponseProperty(Interface0, PropPixels, pixels, PixelCount);
+		IoTServer.buildResponse(IoTServer.ResponseOK);
+		break;
+	case PropTemperature:
+		IoTServer.writeResponsePropertyFloat(Interface0, PropTemperature, temperature);
+		IoTServer.buildResponse(IoTServer.ResponseOK);
+		break;
 	default:
 		IoTServer.buildResponse(IoTServer.ResponseInvalidInterfaceProperty);
 		return;
 	}
 }
 
-void setProperty(IoTMessageSetProperty* msg, uint16_t payloadLength) {
-	if (msg->interfaceIndex) {
+// Simulates a sensor read every TemperatureSampleInterval milliseconds (the
+// light warms up slowly while it is on, and cools down while it is off), and
+// catches up with the samples missed while waiting for messages
+void sampleTemperature() {
+	const DWORD now = currentTime();
+	while ((int32_t)(now - nextTemperatureSampleTime) >= 0) {
+		simulatedTemperature += (((onOff == IoTInterfaceOnOff.StateOn) ? 45.0f : 25.0f) - simulatedTemperature) * 0.01f;
+		// The sensor has a resolution of 0.1 degree
+		temperature = (float)(int32_t)(simulatedTemperature * 10.0f + 0.5f) / 10.0f;
+#ifdef IoTTimeSeries
+		const uint32_t index = temperatureSampleTotal & (TemperatureSampleCount - 1);
+		temperatureTimestamps[index] = nextTemperatureSampleTime;
+		temperatureSamples[index] = temperature;
+		temperatureSampleTotal++;
+#endif
+#ifdef IoTAggregateCount
+		IoTServer.propertySampled(Interface0, PropTemperature, temperature);
+#endif
+		nextTemperatureSampleTime += TemperatureSampleInterval;
+	}
+}
+
+#ifdef IoTTimeSeries
+// Answers with the samples taken after since, oldest first (only up to the end
+// of the buffers, when they wrap around, as the client asks again for the
+// samples that were not sent)
+void getSeries(IoTGetSeriesView msg) {
+	if (msg.interfaceIndex() != Interface0 || msg.propertyIndex() != PropTemperature) {
+		IoTServer.buildResponse(IoTServer.ResponseInvalidInterfaceProperty);
+		return;
+	}
+	uint32_t first = ((temperatureSampleTotal > TemperatureSampleCount) ? (temperatureSampleTotal - TemperatureSampleCount) : 0);
+	uint32_t last = temperatureSampleTotal;
+	while (first < last) {
+		const uint32_t middle = first + ((last - first) >> 1);
+		if ((int32_t)(temperatureTimestamps[middle & (TemperatureSampleCount - 1)] - msg.since()) <= 0)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+	const uint32_t index = first & (TemperatureSampleCount - 1);
+	uint32_t count = temperatureSampleTotal - first;
+	if (count > TemperatureSampleCount - index)
+		count = TemperatureSampleCount - index;
+	IoTServer.writeResponseSeries(Interface0, PropTemperature, msg.encoding(), temperatureTimestamps + index, temperatureSamples + index, (uint16_t)count);
+	IoTServer.buildResponse(IoTServer.ResponseOK);
+}
+#endif
+
+void setProperty(IoTSetPropertyView msg) {
+	if (msg.interfaceIndex()) {
 		IoTServer.buildResponse(IoTServer.ResponseInvalidInterface);
 		return;
 	}
 
-	switch (msg->propertyIndex) {
+	switch (msg.propertyIndex()) {
 	case PropState:
 		IoTServer.buildResponse(IoTServer.ResponseInterfacePropertyReadOnly);
 		break;
 	case PropColor:
-		if (msg->propertyValueLength != 3) {
+		if (msg.valueLength() != 3) {
 			IoTServer.buildResponse(IoTServer.ResponseInvalidInterfacePropertyValue);
 		} else {
-			color[0] = msg->propertyValue[0];
-			color[1] = msg->propertyValue[1];
-			color[2] = msg->propertyValue[2];
+			color[0] = msg.value()[0];
+			color[1] = msg.value()[1];
+			color[2] = msg.value()[2];
+#ifdef IoTActuatorQueue
+			actuateProperty(PropColor, color, 3);
+#else
 			// Any other commands should go here
+#endif
 			IoTServer.writeResponsePropertyRGB(Interface0, PropColor, color);
 			IoTServer.buildResponse(IoTServer.ResponseOK);
 		}
 		break;
 	case PropSampleEnum:
-		if (msg->propertyValueLength != 2) {
+		if (msg.valueLength() != 2) {
 			IoTServer.buildResponse(IoTServer.ResponseInvalidInterfacePropertyValue);
 		} else {
-			switch (*((uint16_t*)msg->propertyValue)) {
+			switch (msg.value16()) {
 			case 0:
 			case 1:
 			case 2:
 			case 255:
-				enumValue = *((uint16_t*)msg->propertyValue);
+				enumValue = msg.value16();
+#ifdef IoTActuatorQueue
+				actuateProperty(PropSampleEnum, &enumValue, 2);
+#else
 				// Any other commands should go here
+#endif
 				IoTServer.writeResponseProperty16(Interface0, PropSampleEnum, enumValue);
 				IoTServer.buildResponse(IoTServer.ResponseOK);
 				break;
@@ -192,33 +490,288 @@ void setProperty(IoTMessageSetProperty* msg, uint16_t payloadLength) {
 			}
 		}
 		break;
+	case PropPixels:
+		if (msg.valueLength() != sizeof(pixels)) {
+			IoTServer.buildResponse(IoTServer.ResponseInvalidInterfacePropertyValue);
+		} else {
+			memcpy(pixels, msg.value(), sizeof(pixels));
+			// Any other commands should go here
+			IoTServer.writeResponseProperty(Interface0, PropPixels, pixels, PixelCount);
+			IoTServer.buildResponse(IoTServer.ResponseOK);
+		}
+		break;
 	default:
 		IoTServer.buildResponse(IoTServer.ResponseInvalidInterfaceProperty);
 		return;
 	}
 }
 
+// Ranges have already been validated against PixelCount, so only the
+// property itself must be checked
+void getPropertyRange(IoTGetPropertyRangeView msg) {
+	if (msg.interfaceIndex() || msg.propertyIndex() != PropPixels) {
+		IoTServer.buildResponse(msg.interfaceIndex() ? IoTServer.ResponseInvalidInterface : IoTServer.ResponseInvalidInterfaceProperty);
+		return;
+	}
+	IoTServer.writeResponsePropertyRange(Interface0, PropPixels, msg.offset(), pixels + msg.offset(), msg.count());
+	IoTServer.buildResponse(IoTServer.ResponseOK);
+}
+
+void setPropertyRange(IoTSetPropertyRangeView msg) {
+	if (msg.interfaceIndex() || msg.propertyIndex() != PropPixels) {
+		IoTServer.buildResponse(msg.interfaceIndex() ? IoTServer.ResponseInvalidInterface : IoTServer.ResponseInvalidInterfaceProperty);
+		return;
+	}
+	// Only the pixels that have actually changed are sent and applied
+	memcpy(pixels + msg.offset(), msg.value(), msg.count() * sizeof(IoTRGBTriplet));
+	// Any other commands should go here
+	IoTServer.writeResponsePropertyRange(Interface0, PropPixels, msg.offset(), pixels + msg.offset(), msg.count());
+	IoTServer.buildResponse(IoTServer.ResponseOK);
+}
+
+void executeScene() {
+	const uint8_t* operation;
+	uint8_t i;
+
+	// Interfaces, commands, properties and value lengths have already been
+	// validated by IoTServer, so only the values themselves must be checked,
+	// before applying anything
+	for (operation = IoTServer.firstSceneOperation(), i = 0; operation; operation = IoTServer.nextSceneOperation(operation), i++) {
+		if (operation[0] != IoTServer.SceneSetProperty)
+			continue;
+		IoTSetPropertyView msg(operation + 1);
+		if (msg.propertyIndex() == PropSampleEnum) {
+			switch (msg.value16()) {
+			case 0:
+			case 1:
+			case 2:
+			case 255:
+				break;
+			default:
+				IoTServer.writeResponse(i);
+				IoTServer.buildResponse(IoTServer.ResponseInvalidInterfacePropertyValue);
+				return;
+			}
+		}
+	}
+
+	if (!IoTServer.isMessageRepeated()) {
+		for (operation = IoTServer.firstSceneOperation(); operation; operation = IoTServer.nextSceneOperation(operation)) {
+			if (operation[0] == IoTServer.SceneExecute) {
+				IoTExecuteView msg(operation + 1);
+				onOff = ((msg.interfaceCommand() == IoTInterfaceOnOff.CommandOn) ? IoTInterfaceOnOff.StateOn : IoTInterfaceOnOff.StateOff);
+#ifdef IoTActuatorQueue
+				actuateCommand(msg.interfaceCommand());
+#endif
+			} else {
+				IoTSetPropertyView msg(operation + 1);
+				switch (msg.propertyIndex()) {
+				case PropColor:
+					color[0] = msg.value()[0];
+					color[1] = msg.value()[1];
+					color[2] = msg.value()[2];
+					break;
+				case PropSampleEnum:
+					enumValue = msg.value16();
+					break;
+				case PropPixels:
+					memcpy(pixels, msg.value(), sizeof(pixels));
+					break;
+				}
+#ifdef IoTActuatorQueue
+				actuateProperty(msg.propertyIndex(), msg.value(), msg.valueLength());
+#endif
+			}
+		}
+#ifndef IoTActuatorQueue
+		// Any other commands should go here
+#endif
+	}
+
+	// Since there is only one interface, all of its states are sent back
+	IoTServer.writeResponseProperty8(Interface0, PropState, onOff);
+	IoTServer.writeResponsePropertyRGB(Interface0, PropColor, color);
+	IoTServer.writeResponseProperty16(Interface0, PropSampleEnum, enumValue);
+	IoTServer.buildResponse(IoTServer.ResponseOK);
+}
+
+#ifdef IoTActuatorQueue
+void applyActuation(const IoTActuation& actuation) {
+	// This is where the LEDs would actually be driven (values are sent back
+	// to the client long before this function is called)
+	if (actuation.operation == IoTServer.SceneExecute) {
+		printf("*** Applying command %d\n", actuation.interfaceCommand);
+	} else if (actuation.propertyIndex == PropColor) {
+		printf("*** Applying color %02X%02X%02X\n", actuation.propertyValue[0], actuation.propertyValue[1], actuation.propertyValue[2]);
+	} else {
+		printf("*** Applying property %d\n", actuation.propertyIndex);
+	}
+	// Simulate a slow driver, so that values queued in the meantime are coalesced
+	Sleep(100);
+}
+
+void actuatorThread(volatile bool* alive) {
+	IoTActuation actuation;
+	while (*alive) {
+		if (IoTServer.nextActuation(actuation))
+			applyActuation(actuation);
+		else
+			Sleep(5);
+	}
+}
+#endif
+
+#ifdef IoTSetpointStreamCount
+// Only the newest frame of each stream gets here, and its length has already
+// been checked, but there is no response to report invalid values, so they are
+// just ignored
+void applyStreamFrame() {
+	if (IoTServer.streamInterfaceIndex() != Interface0)
+		return;
+	switch (IoTServer.streamPropertyIndex()) {
+	case PropColor:
+		memcpy(color, IoTServer.payloadBuffer(), 3);
+#ifdef IoTActuatorQueue
+		actuateProperty(PropColor, color, 3);
+#else
+		// Any other commands should go here
+#endif
+		break;
+	case PropPixels:
+		memcpy(pixels, IoTServer.payloadBuffer(), sizeof(pixels));
+		// Any other commands should go here
+		break;
+	}
+}
+#endif
+
+#ifdef IoTRuleCount
+void handleMessage();
+
+// The rules only see the values given to propertyChanged(), and unchanged
+// values are ignored, so all of them can be given after every message (this
+// must not be called while a response is waiting to be sent, as the actions
+// are handled like any other message)
+void applyRules() {
+	for (;;) {
+		IoTServer.propertyChanged(Interface0, PropState, (float)onOff);
+		IoTServer.propertyChanged(Interface0, PropSampleEnum, (float)(int16_t)enumValue);
+		IoTServer.propertyChanged(Interface0, PropTemperature, temperature);
+		if (!IoTServer.processRules())
+			break;
+		printf("*** Applying rule\n");
+		handleMessage();
+	}
+}
+#endif
+
 void handleMessage() {
 	switch (IoTServer.message()) {
 	case IoTServer.MessageDescribeEnum:
-		describeEnum((IoTMessageDescribeEnum*)IoTServer.payloadBuffer());
+		describeEnum(IoTDescribeEnumView(IoTServer.payloadBuffer()));
 		break;
 	case IoTServer.MessageExecute:
-		executeCommand((IoTMessageExecute*)IoTServer.payloadBuffer());
+		executeCommand(IoTExecuteView(IoTServer.payloadBuffer()));
 		break;
 	case IoTServer.MessageGetProperty:
-		getProperty((IoTMessageGetProperty*)IoTServer.payloadBuffer());
+		getProperty(IoTGetPropertyView(IoTServer.payloadBuffer()));
 		break;
 	case IoTServer.MessageSetProperty:
-		setProperty((IoTMessageSetProperty*)IoTServer.payloadBuffer(), IoTServer.payloadLength());
+		setProperty(IoTSetPropertyView(IoTServer.payloadBuffer()));
+		break;
+	case IoTServer.MessageGetPropertyRange:
+		getPropertyRange(IoTGetPropertyRangeView(IoTServer.payloadBuffer()));
+		break;
+	case IoTServer.MessageSetPropertyRange:
+		setPropertyRange(IoTSetPropertyRangeView(IoTServer.payloadBuffer()));
+		break;
+	case IoTServer.MessageScene:
+	case IoTServer.MessageGroup:
+		executeScene();
 		break;
+#ifdef IoTSetpointStreamCount
+	case IoTServer.MessageStreamFrame:
+		// Stream frames must not be answered (IoTServer builds the reports)
+		applyStreamFrame();
+		break;
+#endif
+#ifdef IoTTimeSeries
+	case IoTServer.MessageGetSeries:
+		getSeries(IoTGetSeriesView(IoTServer.payloadBuffer()));
+		break;
+#endif
 	default:
 		IoTServer.buildResponse(IoTServer.ResponseUnsupportedMessage);
 		break;
 	}
 }
 
-int main() {
+#ifdef IoTPersistentState
+#define StateFileName "LightingControl.state"
+#define StateTempFileName "LightingControl.state.tmp"
+#define SampleStateLength 6
+#define StateSaveInterval 5000
+
+uint8_t savedSampleState[SampleStateLength];
+DWORD lastStateSaveTime;
+
+void sampleState(uint8_t* dstBuffer) {
+	dstBuffer[0] = onOff;
+	dstBuffer[1] = color[0];
+	dstBuffer[2] = color[1];
+	dstBuffer[3] = color[2];
+	dstBuffer[4] = (uint8_t)enumValue;
+	dstBuffer[5] = (uint8_t)(enumValue >> 8);
+}
+
+void loadState() {
+	const uint32_t length = IoTServer.stateSize() + SampleStateLength;
+	uint8_t* buffer = new uint8_t[length];
+	FILE* file = fopen(StateFileName, "rb");
+	if (file) {
+		if (fread(buffer, 1, length, file) == length && IoTServer.loadState(buffer, length - SampleStateLength)) {
+			const uint8_t* srcBuffer = buffer + (length - SampleStateLength);
+			onOff = srcBuffer[0];
+			color[0] = srcBuffer[1];
+			color[1] = srcBuffer[2];
+			color[2] = srcBuffer[3];
+			enumValue = (uint16_t)(srcBuffer[4] | (srcBuffer[5] << 8));
+			printf("State loaded from %s\n", StateFileName);
+		}
+		fclose(file);
+	}
+	delete[] buffer;
+	sampleState(savedSampleState);
+	lastStateSaveTime = GetTickCount();
+}
+
+// Writes are batched (at most once every StateSaveInterval milliseconds), and
+// the file is replaced atomically, so a crash never leaves a partial state
+void saveState(bool force) {
+	if (!force && (GetTickCount() - lastStateSaveTime) < StateSaveInterval)
+		return;
+
+	uint8_t currentSampleState[SampleStateLength];
+	sampleState(currentSampleState);
+	if (!IoTServer.isStateDirty() && !memcmp(currentSampleState, savedSampleState, SampleStateLength))
+		return;
+
+	lastStateSaveTime = GetTickCount();
+	const uint32_t length = IoTServer.stateSize() + SampleStateLength;
+	uint8_t* buffer = new uint8_t[length];
+	IoTServer.saveState(buffer);
+	memcpy(buffer + (length - SampleStateLength), currentSampleState, SampleStateLength);
+	FILE* file = fopen(StateTempFileName, "wb");
+	if (file) {
+		const bool ok = (fwrite(buffer, 1, length, file) == length);
+		if (fclose(file) == 0 && ok && MoveFileExA(StateTempFileName, StateFileName, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+			memcpy(savedSampleState, currentSampleState, SampleStateLength);
+	}
+	delete[] buffer;
+}
+#endif
+
+void initializeDevice() {
 	IoTServer.begin();
 
 	IoTServer.storedName("Sample Device");
@@ -234,6 +787,860 @@ int main() {
 	color[1] = 0;
 	color[2] = 0;
 	enumValue = 0;
+	temperature = 25.0f;
+	simulatedTemperature = 25.0f;
+	nextTemperatureSampleTime = currentTime();
+
+	IoTServer.joinGroup(1);
+}
+
+// Everything that depends on the time, called by the server loop whenever it
+// wakes up, and by replay() along with the captured times
+void runTimers() {
+#ifdef IoTClientTimeout
+	IoTServer.tick();
+#endif
+	sampleTemperature();
+#ifdef IoTScheduleCount
+	// Scheduled scenes are handled just like MessageScene, but they are
+	// never answered
+	while (IoTServer.processSchedule()) {
+		printf("*** Applying scheduled scene\n");
+		handleMessage();
+	}
+#ifdef IoTRuleCount
+	applyRules();
+#endif
+#endif
+}
+
+//**************************************
+// Traffic capture and replay
+//
+// LightingControl -capture <file>
+//   Runs the server, appending every
+//   request and response to <file>
+//
+// LightingControl -replay <file> [speed]
+//   Feeds the requests in <file> to
+//   IoTServer.process(), without any
+//   sockets, comparing the responses
+//   byte-for-byte with the captured
+//   ones (speed 1 keeps the original
+//   timing, 2 is twice as fast, and so
+//   on, whereas 0, the default, replays
+//   as fast as possible)
+//
+// File format: "IoTC", version, and
+// then, for each record:
+// - Kind (CaptureSession/CaptureRequest/
+//   CaptureResponse)
+// - Time in milliseconds (4 bytes, since
+//   the session started, or the value of
+//   IoTMillis() when it started, for
+//   CaptureSession)
+// - Client IP (4 bytes, as in currentClientIP)
+// - Client port (2 bytes, as in currentClientPort)
+// - Length (2 bytes)
+// - Datagram bytes
+//
+// The device is replayed on a clock
+// rebuilt from the captured times, which
+// wakes up just like the server loop
+// (runTimers()), so client timeouts, the
+// property cache, scheduled scenes and
+// the temperature follow the capture
+//
+// Replays are only deterministic when
+// the device starts from the same state
+// (IoTPersistentState is not used while
+// replaying), and when nothing random is
+// involved (IoTEncryptionRequired and
+// IoTHandshakeCookies make the responses
+// differ from the captured ones)
+//**************************************
+#define CaptureVersion 2
+#define CaptureRequest 0
+#define CaptureResponse 1
+#define CaptureSession 2
+#define CaptureRecordHeaderLength 13
+
+FILE* captureFile;
+DWORD captureStartTime;
+
+void captureDatagram(uint8_t kind, uint32_t ip, uint16_t port, const uint8_t* srcBuffer, uint16_t length) {
+	const uint32_t time = ((kind == CaptureSession) ? captureStartTime : (GetTickCount() - captureStartTime));
+	const uint8_t header[CaptureRecordHeaderLength] = {
+		kind,
+		(uint8_t)time, (uint8_t)(time >> 8), (uint8_t)(time >> 16), (uint8_t)(time >> 24),
+		(uint8_t)ip, (uint8_t)(ip >> 8), (uint8_t)(ip >> 16), (uint8_t)(ip >> 24),
+		(uint8_t)port, (uint8_t)(port >> 8),
+		(uint8_t)length, (uint8_t)(length >> 8)
+	};
+	fwrite(header, 1, CaptureRecordHeaderLength, captureFile);
+	fwrite(srcBuffer, 1, length, captureFile);
+}
+
+bool startCapture(const char* fileName) {
+	captureFile = fopen(fileName, "ab");
+	if (!captureFile)
+		return false;
+	// The file is append-only, so the header is only written once
+	fseek(captureFile, 0, SEEK_END);
+	if (!ftell(captureFile)) {
+		const uint8_t header[5] = { 'I', 'o', 'T', 'C', CaptureVersion };
+		fwrite(header, 1, sizeof(header), captureFile);
+	}
+	captureStartTime = GetTickCount();
+	captureDatagram(CaptureSession, 0, 0, 0, 0);
+	return true;
+}
+
+struct CaptureRecord {
+	uint8_t kind;
+	uint32_t time;
+	uint32_t ip;
+	uint16_t port;
+	uint16_t length;
+	uint8_t data[sizeof(receivedBuffer)];
+};
+
+bool readCaptureRecord(FILE* file, CaptureRecord* record) {
+	uint8_t header[CaptureRecordHeaderLength];
+	if (fread(header, 1, CaptureRecordHeaderLength, file) != CaptureRecordHeaderLength)
+		return false;
+	record->kind = header[0];
+	record->time = (uint32_t)header[1] | ((uint32_t)header[2] << 8) | ((uint32_t)header[3] << 16) | ((uint32_t)header[4] << 24);
+	record->ip = (uint32_t)header[5] | ((uint32_t)header[6] << 8) | ((uint32_t)header[7] << 16) | ((uint32_t)header[8] << 24);
+	record->port = (uint16_t)(header[9] | (header[10] << 8));
+	record->length = (uint16_t)(header[11] | (header[12] << 8));
+	return (record->length <= sizeof(record->data) && fread(record->data, 1, record->length, file) == record->length);
+}
+
+struct ReplayStats {
+	uint32_t count;
+	uint32_t mismatches;
+	uint64_t totalTicks;
+	uint64_t maxTicks;
+};
+
+int replay(const char* fileName, double speed) {
+	FILE* file = fopen(fileName, "rb");
+	uint8_t header[5];
+	if (!file || fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "IoTC", 4) || header[4] != CaptureVersion) {
+		printf("Invalid capture file: %s\n", fileName);
+		if (file)
+			fclose(file);
+		return 1;
+	}
+
+	replaying = true;
+
+	static CaptureRecord request, next;
+	ReplayStats stats[256];
+	memset(stats, 0, sizeof(stats));
+	bool nextAvailable = readCaptureRecord(file, &next);
+	uint32_t totalCount = 0, totalMismatches = 0, sessionTime = 0;
+	LARGE_INTEGER frequency, replayStart, sessionStart, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&replayStart);
+	sessionStart = replayStart;
+
+	while (nextAvailable) {
+		request = next;
+		nextAvailable = readCaptureRecord(file, &next);
+		if (request.kind == CaptureSession) {
+			// Every session was captured by a server that had just started
+			sessionTime = request.time;
+			replayTime = sessionTime;
+			initializeDevice();
+			QueryPerformanceCounter(&sessionStart);
+			continue;
+		}
+		if (request.kind != CaptureRequest)
+			continue;
+
+		// Wake up just like the server loop did: in time for every scheduled
+		// scene, and at least every 500ms
+		const DWORD time = sessionTime + request.time;
+		do {
+			DWORD step = 500;
+#ifdef IoTScheduleCount
+			const uint32_t delay = IoTServer.scheduleDelay();
+			if (delay < step)
+				step = (delay ? delay : 1);
+#endif
+			replayTime = (((time - replayTime) > step) ? (replayTime + step) : time);
+			runTimers();
+		} while (replayTime != time);
+
+		if (speed > 0) {
+			const LONGLONG due = sessionStart.QuadPart + (LONGLONG)((double)request.time * (double)frequency.QuadPart / (1000.0 * speed));
+			QueryPerformanceCounter(&start);
+			if (start.QuadPart < due)
+				Sleep((DWORD)(((due - start.QuadPart) * 1000) / frequency.QuadPart));
+		}
+
+		IoTServer.currentClientIP = request.ip;
+		IoTServer.currentClientPort = request.port;
+		memcpy(receivedBuffer, request.data, request.length);
+
+		QueryPerformanceCounter(&start);
+		bool responded = false;
+		if (IoTServer.process(receivedBuffer, request.length)) {
+			if (!IoTServer.responseReady())
+				handleMessage();
+			responded = IoTServer.responseRequired();
+		}
+		QueryPerformanceCounter(&end);
+
+#ifdef IoTActuatorQueue
+		// Nothing is driven while replaying
+		IoTActuation actuation;
+		while (IoTServer.nextActuation(actuation))
+			;
+#endif
+
+		// The response, if any, was captured right after its request
+		const bool captured = (nextAvailable && next.kind == CaptureResponse);
+		const bool mismatch = (responded != captured ||
+			(responded && (next.length != IoTServer.responseLength() || memcmp(next.data, IoTServer.responseBuffer(), next.length))));
+		if (captured)
+			nextAvailable = readCaptureRecord(file, &next);
+
+#ifdef IoTRuleCount
+		// The server loop does the same once the response has been sent
+		applyRules();
+#endif
+
+		ReplayStats& stat = stats[request.length > 1 ? request.data[1] : 255];
+		const uint64_t ticks = (uint64_t)(end.QuadPart - start.QuadPart);
+		stat.count++;
+		stat.totalTicks += ticks;
+		if (stat.maxTicks < ticks)
+			stat.maxTicks = ticks;
+		totalCount++;
+		if (mismatch) {
+			stat.mismatches++;
+			totalMismatches++;
+		}
+	}
+
+	QueryPerformanceCounter(&end);
+	fclose(file);
+
+	const double seconds = (double)(end.QuadPart - replayStart.QuadPart) / (double)frequency.QuadPart;
+	printf("Message  Count       Average (us)  Max (us)      Mismatches\n");
+	for (int i = 0; i < 256; i++) {
+		if (!stats[i].count)
+			continue;
+		printf("0x%02X     %-11u %-13.3f %-13.3f %u\n", i, stats[i].count,
+			(double)stats[i].totalTicks * 1000000.0 / ((double)frequency.QuadPart * (double)stats[i].count),
+			(double)stats[i].maxTicks * 1000000.0 / (double)frequency.QuadPart,
+			stats[i].mismatches);
+	}
+	printf("%u requests in %.3f s (%.0f requests/s), %u mismatches\n", totalCount, seconds, (seconds > 0 ? (double)totalCount / seconds : 0.0), totalMismatches);
+	return (totalMismatches ? 2 : 0);
+}
+
+//**************************************
+// Per-packet overhead benchmark
+//
+// LightingControl -benchmark [count]
+//   Handshakes and then sends <count>
+//   MessageGetProperty (10000 by
+//   default) straight to
+//   IoTServer.process(), without any
+//   sockets, printing how long each
+//   request takes to be processed and
+//   answered (build it with and without
+//   IoTEncryptionRequired to measure
+//   what sealing costs per packet)
+//**************************************
+#define BenchmarkClientIP 0x0100007F
+#define BenchmarkClientPort 0xFFFF
+#ifdef IoTEncryptionRequired
+// A session key only covers 65535 sequence numbers
+#define BenchmarkMaxCount 65000
+#else
+#define BenchmarkMaxCount 1000000
+#endif
+
+uint16_t buildBenchmarkRequest(uint8_t* dstBuffer, uint8_t message, uint8_t clientId, uint16_t sequenceNumber, const char* password, const uint8_t* payload, uint16_t payloadLength) {
+	uint16_t length = 0;
+	dstBuffer[length++] = 0x55; // StartOfPacket
+	dstBuffer[length++] = message;
+	dstBuffer[length++] = clientId;
+	dstBuffer[length++] = (uint8_t)sequenceNumber;
+	dstBuffer[length++] = (uint8_t)(sequenceNumber >> 8);
+	const uint8_t passwordLength = (uint8_t)strlen(password);
+	dstBuffer[length++] = passwordLength;
+	memcpy(dstBuffer + length, password, passwordLength);
+	length += passwordLength;
+	uint8_t* const payloadLengthBuffer = dstBuffer + length;
+	length += 2;
+	memcpy(dstBuffer + length, payload, payloadLength);
+	length += payloadLength;
+	payloadLengthBuffer[0] = (uint8_t)payloadLength;
+	payloadLengthBuffer[1] = (uint8_t)(payloadLength >> 8);
+	dstBuffer[length++] = 0x33; // EndOfPacket
+	return length;
+}
+
+int benchmark(uint32_t count) {
+	if (!count || count > BenchmarkMaxCount)
+		count = BenchmarkMaxCount;
+
+	initializeDevice();
+	IoTServer.currentClientIP = BenchmarkClientIP;
+	IoTServer.currentClientPort = BenchmarkClientPort;
+
+	uint16_t sequenceNumber = 0;
+	const uint8_t clientNonce[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+#ifdef IoTEncryptionRequired
+	const uint16_t handshakePayloadLength = sizeof(clientNonce);
+#else
+	const uint16_t handshakePayloadLength = 0;
+#endif
+	uint16_t length = buildBenchmarkRequest(receivedBuffer, IoTServer.MessageHandshake, 0xFF, sequenceNumber, "Password", clientNonce, handshakePayloadLength);
+	if (!IoTServer.process(receivedBuffer, length) || !IoTServer.responseReady() || IoTServer.responseBuffer()[5] != IoTServer.ResponseOK) {
+		printf("Could not handshake\n");
+		return 1;
+	}
+	const uint8_t clientId = IoTServer.responseBuffer()[8];
+#ifdef IoTEncryptionRequired
+	uint8_t sessionKey[32];
+	_IoTAead::deriveKey(sessionKey, IoTServerEncryptionKey, clientNonce, IoTServer.responseBuffer() + 9);
+#endif
+
+	const uint8_t getColor[2] = { Interface0, PropColor };
+	uint32_t failures = 0;
+	uint64_t totalTicks = 0, maxTicks = 0;
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	for (uint32_t i = 0; i < count; i++) {
+		sequenceNumber++;
+#ifdef IoTEncryptionRequired
+		// Sealing is the client's job, so it is not measured
+		uint8_t payload[sizeof(getColor) + 16];
+		memcpy(payload, getColor, sizeof(getColor));
+		length = buildBenchmarkRequest(receivedBuffer, IoTServer.MessageGetProperty, clientId, sequenceNumber, "", payload, sizeof(payload));
+		uint8_t nonce[12] = { 0, (uint8_t)sequenceNumber, (uint8_t)(sequenceNumber >> 8) };
+		_IoTAead::seal(sessionKey, nonce, receivedBuffer + 1, 4, receivedBuffer + 8, sizeof(getColor), receivedBuffer + 8 + sizeof(getColor));
+#else
+		length = buildBenchmarkRequest(receivedBuffer, IoTServer.MessageGetProperty, clientId, sequenceNumber, "Password", getColor, sizeof(getColor));
+#endif
+
+		QueryPerformanceCounter(&start);
+		if (IoTServer.process(receivedBuffer, length)) {
+			if (!IoTServer.responseReady())
+				handleMessage();
+		}
+		QueryPerformanceCounter(&end);
+
+		if (!IoTServer.responseRequired() || IoTServer.responseBuffer()[5] != IoTServer.ResponseOK)
+			failures++;
+		const uint64_t ticks = (uint64_t)(end.QuadPart - start.QuadPart);
+		totalTicks += ticks;
+		if (maxTicks < ticks)
+			maxTicks = ticks;
+	}
+
+	const double seconds = (double)totalTicks / (double)frequency.QuadPart;
+#ifdef IoTEncryptionRequired
+	printf("Encryption: on\n");
+#else
+	printf("Encryption: off\n");
+#endif
+	printf("%u requests, average %.3f us, max %.3f us (%.0f requests/s), %u failures\n", count,
+		seconds * 1000000.0 / (double)count,
+		(double)maxTicks * 1000000.0 / (double)frequency.QuadPart,
+		(seconds > 0 ? (double)count / seconds : 0.0), failures);
+	return (failures ? 2 : 0);
+}
+
+#ifdef IoTTrace
+LARGE_INTEGER traceStartCounter;
+uint64_t traceStartTimestamp;
+
+void startTrace() {
+	QueryPerformanceCounter(&traceStartCounter);
+	traceStartTimestamp = IoTTraceTimestamp();
+}
+
+void dumpTrace() {
+	// The TSC frequency is measured against QueryPerformanceCounter(), over
+	// the whole time the server was running
+	LARGE_INTEGER frequency, endCounter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&endCounter);
+	const uint64_t endTimestamp = IoTTraceTimestamp();
+	double ticksPerMicrosecond = 1.0;
+	if (endCounter.QuadPart > traceStartCounter.QuadPart)
+		ticksPerMicrosecond = ((double)(endTimestamp - traceStartTimestamp) * (double)frequency.QuadPart) / ((double)(endCounter.QuadPart - traceStartCounter.QuadPart) * 1000000.0);
+
+	static const char* const eventNames[] = { "received", "verdict", "handler", "response", "sent" };
+	const uint32_t count = IoTServer.traceCount();
+	uint64_t requestTimestamp = 0;
+	for (uint32_t i = ((count > IoTTrace) ? (count - IoTTrace) : 0); i < count; i++) {
+		const IoTTraceEvent* event = IoTServer.tracedEvent(i);
+		if (event->type == IoTServer.TraceReceived) {
+			requestTimestamp = event->timestamp;
+			printf("Client %d, sequence %d, message %d\n", event->clientId, event->sequenceNumber, event->message);
+		} else if (!requestTimestamp) {
+			// The beginning of this request has already been overwritten
+			continue;
+		}
+		printf("\t%10.2f us %-8s %d\n", (double)(event->timestamp - requestTimestamp) / ticksPerMicrosecond, ((event->type < countof(eventNames)) ? eventNames[event->type] : "user"), event->argument);
+	}
+}
+#endif
+
+#ifdef IoTPropertyPlane
+// Both the server and the drivers map the same named block of memory, and
+// whoever creates it initializes it
+void* mapPropertyPlane() {
+	const uint32_t size = IoTServer.propertyPlaneSize();
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, "Local\\IoTDCPLightingControl");
+	if (!mapping)
+		return 0;
+	const bool created = (GetLastError() != ERROR_ALREADY_EXISTS);
+	void* plane = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!plane)
+		return 0;
+	if (created)
+		IoTServer.initializePropertyPlane(plane);
+	return (IoTServer.attachPropertyPlane(plane) ? plane : 0);
+}
+#endif
+
+// Acts as a client, sending MessageQueryDevice to IoTMulticastGroupAddress
+// (multicast loopback is enabled, so devices running on this computer are
+// also found)
+int discover(uint16_t fleetSizeEstimate) {
+	WSAData data;
+	WSAStartup(MAKEWORD(2, 2), &data);
+
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	DWORD value = 1;
+	setsockopt(s, IPPROTO_IP, IP_MULTICAST_LOOP, (char*)&value, sizeof(value));
+	value = 250;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&value, sizeof(value));
+
+	sockaddr_in remote;
+	memset(&remote, 0, sizeof(remote));
+	remote.sin_family = AF_INET;
+	remote.sin_port = htons(IoTPort);
+	memcpy(&remote.sin_addr.s_addr, IoTMulticastGroupAddress, 4);
+
+	static IoTDiscoveryCollector collector;
+	uint8_t query[IoTDiscoveryCollector::QueryLength];
+	const uint16_t queryLength = collector.buildQuery(query, fleetSizeEstimate);
+	sendto(s, (char*)query, queryLength, 0, (sockaddr*)&remote, sizeof(remote));
+
+	// Devices delay their responses by up to IoTDiscoveryMaxDelay milliseconds
+	const DWORD start = GetTickCount();
+	while ((GetTickCount() - start) < (IoTDiscoveryMaxDelay + 500)) {
+		int remoteLen = sizeof(remote);
+		int bytesInPacket = recvfrom(s, (char*)receivedBuffer, sizeof(receivedBuffer), 0, (sockaddr*)&remote, &remoteLen);
+		if (bytesInPacket <= 0)
+			continue;
+		const IoTDiscoveredDevice* device = collector.collect(receivedBuffer, (uint16_t)bytesInPacket, remote.sin_addr.S_un.S_addr, remote.sin_port);
+		if (!device)
+			continue;
+		char address[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &remote.sin_addr, address, sizeof(address));
+		printf("%s:%d after %d ms: %s (%d interfaces)\n", address, ntohs(remote.sin_port), (int)(GetTickCount() - start), device->name, device->interfaceCount);
+	}
+
+	printf("%d devices found\n", collector.deviceCount);
+	closesocket(s);
+	WSACleanup();
+	return 0;
+}
+
+#if defined(IoTSetpointStreamCount) || defined(IoTScheduleCount) || defined(IoTRuleCount) || defined(IoTTimeSeries) || defined(IoTAggregateCount)
+// Helpers for acting as a client of the device running on this computer,
+// with IoTDCPClient, waiting for each request before sending the next one
+struct ClientRequest {
+	volatile bool done;
+	uint16_t result;
+	uint16_t payloadLength;
+	uint8_t payload[IoTMaxPayloadLength];
+};
+
+void clientSend(void* sendContext, uint32_t ip, uint16_t port, const uint8_t* buffer, uint16_t length) {
+	sockaddr_in remote;
+	memset(&remote, 0, sizeof(remote));
+	remote.sin_family = AF_INET;
+	remote.sin_port = port;
+	remote.sin_addr.S_un.S_addr = ip;
+	sendto(*(SOCKET*)sendContext, (const char*)buffer, length, 0, (sockaddr*)&remote, sizeof(remote));
+}
+
+void clientRequestDone(void* context, uint16_t device, uint8_t message, uint16_t result, const uint8_t* payload, uint16_t payloadLength) {
+	ClientRequest* request = (ClientRequest*)context;
+	request->result = result;
+	request->payloadLength = ((payloadLength < sizeof(request->payload)) ? payloadLength : sizeof(request->payload));
+	if (payload)
+		memcpy(request->payload, payload, request->payloadLength);
+	request->done = true;
+}
+
+// Feeds every datagram received to the client, for duration milliseconds
+void pumpClient(IoTDCPClient& client, SOCKET s, DWORD duration) {
+	const DWORD start = GetTickCount();
+	do {
+		sockaddr_in remote;
+		int remoteLen = sizeof(remote);
+		int bytesInPacket = recvfrom(s, (char*)receivedBuffer, sizeof(receivedBuffer), 0, (sockaddr*)&remote, &remoteLen);
+		if (bytesInPacket > 0)
+			client.receive(remote.sin_addr.S_un.S_addr, remote.sin_port, receivedBuffer, (uint16_t)bytesInPacket);
+		client.poll();
+	} while ((GetTickCount() - start) < duration);
+}
+
+bool waitClientRequest(IoTDCPClient& client, SOCKET s, ClientRequest& request) {
+	// poll() times the request out eventually, so this always returns
+	while (!request.done)
+		pumpClient(client, s, 0);
+	request.done = false;
+	return (request.result == IoTServer.ResponseOK);
+}
+
+SOCKET openClientSocket() {
+	WSAData data;
+	WSAStartup(MAKEWORD(2, 2), &data);
+
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	DWORD value = 5;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&value, sizeof(value));
+	return s;
+}
+#endif
+
+#ifdef IoTSetpointStreamCount
+// Acts as a client, animating the color of the device running on this
+// computer at 60 frames per second, through a setpoint stream
+void printStreamReport(const char* title, const uint8_t* payload, uint16_t payloadLength) {
+	IoTStreamReport report;
+	if (IoTDCPClient::readStreamReport(payload, payloadLength, report))
+		printf("%s: stream %d, sequence %d, %u received, %u lost, %u late, jitter %d ms\n", title, report.streamId, report.sequenceNumber, report.receivedFrames, report.lostFrames, report.lateFrames, report.jitter);
+}
+
+void streamReportReceived(void* context, uint16_t device, uint8_t message, uint16_t result, const uint8_t* payload, uint16_t payloadLength) {
+	printStreamReport("Report", payload, payloadLength);
+}
+
+int stream() {
+	SOCKET s = openClientSocket();
+	static IoTDCPClient client(clientSend, &s);
+	client.streamReports(streamReportReceived, 0);
+	const uint16_t d = client.addDevice(htonl(INADDR_LOOPBACK), htons(IoTPort), "Password");
+	ClientRequest request = { false };
+
+	// The device reports the stream statistics every 60 frames (every second)
+	if (client.handshake(d, clientRequestDone, &request) && waitClientRequest(client, s, request) &&
+		client.openStream(d, Interface0, PropColor, 60, clientRequestDone, &request) && waitClientRequest(client, s, request) &&
+		request.payloadLength == 1) {
+		const uint8_t streamId = request.payload[0];
+		for (uint16_t frame = 0; frame < 300; frame++) {
+			const uint8_t level = (uint8_t)((frame & 0x40) ? ~(frame << 2) : (frame << 2));
+			const uint8_t rgb[3] = { level, 0, (uint8_t)(255 - level) };
+			client.sendStreamFrame(d, streamId, frame, rgb, 3);
+			pumpClient(client, s, 16);
+		}
+		if (client.closeStream(d, streamId, clientRequestDone, &request) && waitClientRequest(client, s, request))
+			printStreamReport("Final report", request.payload, request.payloadLength);
+		client.goodBye(d, clientRequestDone, &request);
+		waitClientRequest(client, s, request);
+	} else {
+		printf("Could not open the stream: %d\n", request.result);
+	}
+
+	closesocket(s);
+	WSACleanup();
+	return 0;
+}
+#endif
+
+#ifdef IoTScheduleCount
+// Acts as a client, synchronizing its clock with the device running on this
+// computer, and then scheduling the device to turn on after delay milliseconds
+// (a fleet would get the same client time, converted to each device's clock)
+int schedule(DWORD delay) {
+	SOCKET s = openClientSocket();
+	static IoTDCPClient client(clientSend, &s);
+	const uint16_t d = client.addDevice(htonl(INADDR_LOOPBACK), htons(IoTPort), "Password");
+	ClientRequest request = { false };
+
+	if (!client.handshake(d, clientRequestDone, &request) || !waitClientRequest(client, s, request)) {
+		printf("Could not connect: %d\n", request.result);
+	} else {
+		// Only the sample with the shortest round trip is kept
+		for (int i = 0; i < 4; i++) {
+			if (client.syncTime(d, clientRequestDone, &request))
+				waitClientRequest(client, s, request);
+		}
+		if (!client.isTimeSynchronized(d)) {
+			printf("Could not synchronize the clocks\n");
+		} else {
+			printf("Device clock - client clock = %d ms (round trip %u ms)\n", (int)client.deviceTime(d, 0), client.timeRoundTrip(d));
+			const uint8_t scene[] = { 1, IoTServer.SceneExecute, Interface0, IoTInterfaceOnOff.CommandOn };
+			if (client.scheduleScene(d, GetTickCount() + delay, scene, sizeof(scene), clientRequestDone, &request) && waitClientRequest(client, s, request))
+				printf("Scheduled in slot %d\n", request.payload[0]);
+			else
+				printf("Could not schedule the scene: %d\n", request.result);
+		}
+		client.goodBye(d, clientRequestDone, &request);
+		waitClientRequest(client, s, request);
+	}
+
+	closesocket(s);
+	WSACleanup();
+	return 0;
+}
+
+// Acts as a client, cancelling everything the device running on this computer
+// has scheduled, and then, unless stop is true, making it blink on its own
+// (turning on every 2 seconds, and off 1 second later), even after the client
+// is gone
+int blink(bool stop) {
+	SOCKET s = openClientSocket();
+	static IoTDCPClient client(clientSend, &s);
+	const uint16_t d = client.addDevice(htonl(INADDR_LOOPBACK), htons(IoTPort), "Password");
+	ClientRequest request = { false };
+
+	if (!client.handshake(d, clientRequestDone, &request) || !waitClientRequest(client, s, request) ||
+		!client.listSchedule(d, clientRequestDone, &request) || !waitClientRequest(client, s, request)) {
+		printf("Could not list the schedule: %d\n", request.result);
+	} else {
+		const ClientRequest list = request;
+		uint8_t slot;
+		uint32_t delay, interval;
+		for (uint16_t i = 0; IoTDCPClient::readScheduleEntry(list.payload, list.payloadLength, i, slot, delay, interval); i++) {
+			printf("Cancelling slot %d (due in %u ms, every %u ms)\n", slot, delay, interval);
+			if (client.cancelSchedule(d, slot, clientRequestDone, &request))
+				waitClientRequest(client, s, request);
+		}
+		if (!stop) {
+			const uint8_t sceneOn[] = { 1, IoTServer.SceneExecute, Interface0, IoTInterfaceOnOff.CommandOn };
+			const uint8_t sceneOff[] = { 1, IoTServer.SceneExecute, Interface0, IoTInterfaceOnOff.CommandOff };
+			if (client.scheduleTimer(d, 0, 2000, sceneOn, sizeof(sceneOn), clientRequestDone, &request) && waitClientRequest(client, s, request) &&
+				client.scheduleTimer(d, 1000, 2000, sceneOff, sizeof(sceneOff), clientRequestDone, &request) && waitClientRequest(client, s, request))
+				printf("Blinking (run LightingControl -blink off to stop)\n");
+			else
+				printf("Could not schedule the timers: %d\n", request.result);
+		}
+		client.goodBye(d, clientRequestDone, &request);
+		waitClientRequest(client, s, request);
+	}
+
+	closesocket(s);
+	WSACleanup();
+	return 0;
+}
+#endif
+
+#ifdef IoTRuleCount
+// Acts as a client, uploading a rule to the device running on this computer,
+// which turns the light red whenever it is on and Sample Enum is 2, and then
+// checking that rule without any further requests to change the color
+int rule() {
+	SOCKET s = openClientSocket();
+	static IoTDCPClient client(clientSend, &s);
+	const uint16_t d = client.addDevice(htonl(INADDR_LOOPBACK), htons(IoTPort), "Password");
+	ClientRequest request = { false };
+
+	const float two = 2.0f;
+	uint8_t code[14] = {
+		IoTDCPClient::RuleLoad, Interface0, PropState,
+		IoTDCPClient::RuleLoad, Interface0, PropSampleEnum,
+		IoTDCPClient::RuleConstant, 0, 0, 0, 0,
+		IoTDCPClient::RuleEqual,
+		IoTDCPClient::RuleAnd,
+		IoTDCPClient::RuleEnd
+	};
+	memcpy(code + 7, &two, sizeof(two));
+	const uint8_t sceneRed[] = { 1, IoTServer.SceneSetProperty, Interface0, PropColor, 3, 0, 255, 0, 0 };
+	const uint8_t black[] = { 0, 0, 0 };
+	const uint8_t enumValues[2][2] = { { 0, 0 }, { 2, 0 } };
+
+	if (!client.handshake(d, clientRequestDone, &request) || !waitClientRequest(client, s, request) ||
+		!client.setRule(d, code, sizeof(code), sceneRed, sizeof(sceneRed), clientRequestDone, &request) || !waitClientRequest(client, s, request)) {
+		printf("Could not upload the rule: %d\n", request.result);
+	} else {
+		const uint8_t slot = request.payload[0];
+		printf("Rule uploaded to slot %d\n", slot);
+		if (client.setProperty(d, Interface0, PropColor, black, sizeof(black), clientRequestDone, &request) && waitClientRequest(client, s, request) &&
+			client.setProperty(d, Interface0, PropSampleEnum, enumValues[0], 2, clientRequestDone, &request) && waitClientRequest(client, s, request) &&
+			client.execute(d, Interface0, IoTInterfaceOnOff.CommandOn, clientRequestDone, &request) && waitClientRequest(client, s, request) &&
+			client.setProperty(d, Interface0, PropSampleEnum, enumValues[1], 2, clientRequestDone, &request) && waitClientRequest(client, s, request)) {
+			// The rule is applied right after the last response has been sent
+			pumpClient(client, s, 100);
+			if (client.getProperty(d, Interface0, PropColor, clientRequestDone, &request) && waitClientRequest(client, s, request) && request.payloadLength >= 3)
+				printf("Color: %02X%02X%02X\n", request.payload[request.payloadLength - 3], request.payload[request.payloadLength - 2], request.payload[request.payloadLength - 1]);
+		} else {
+			printf("Request failed: %d\n", request.result);
+		}
+		if (client.deleteRule(d, slot, clientRequestDone, &request))
+			waitClientRequest(client, s, request);
+		client.goodBye(d, clientRequestDone, &request);
+		waitClientRequest(client, s, request);
+	}
+
+	closesocket(s);
+	WSACleanup();
+	return 0;
+}
+#endif
+
+#ifdef IoTTimeSeries
+// Acts as a client, fetching the temperature samples kept by the device running
+// on this computer, first as plain samples, and then compressed, comparing how
+// many samples fit in each response, and how long it takes to decode them
+int series() {
+	SOCKET s = openClientSocket();
+	static IoTDCPClient client(clientSend, &s);
+	const uint16_t d = client.addDevice(htonl(INADDR_LOOPBACK), htons(IoTPort), "Password");
+	ClientRequest request = { false };
+
+	if (!client.handshake(d, clientRequestDone, &request) || !waitClientRequest(client, s, request)) {
+		printf("Could not connect: %d\n", request.result);
+	} else {
+		LARGE_INTEGER frequency, start, end;
+		QueryPerformanceFrequency(&frequency);
+		for (uint8_t encoding = IoTSeriesDecoder::SeriesPlain; encoding <= IoTSeriesDecoder::SeriesCompressed; encoding++) {
+			uint32_t since = 0, responses = 0, samples = 0, bytes = 0, timestamp = 0;
+			uint16_t largestCount = 0;
+			double value = 0;
+			LONGLONG decodeTime = 0;
+			IoTSeriesDecoder decoder;
+			while (client.getSeries(d, Interface0, PropTemperature, encoding, since, clientRequestDone, &request) && waitClientRequest(client, s, request) &&
+				decoder.begin(request.payload, request.payloadLength) && decoder.count()) {
+				responses++;
+				bytes += request.payloadLength;
+				if (largestCount < decoder.count())
+					largestCount = decoder.count();
+				QueryPerformanceCounter(&start);
+				while (decoder.next(timestamp, value))
+					samples++;
+				QueryPerformanceCounter(&end);
+				decodeTime += end.QuadPart - start.QuadPart;
+				since = timestamp;
+			}
+			printf("%s: %u samples in %u responses (up to %u samples per response, %.2f bytes per sample, %.1f ns per sample), latest %.1f C\n",
+				((encoding == IoTSeriesDecoder::SeriesPlain) ? "Plain" : "Compressed"),
+				samples, responses, largestCount, (samples ? ((double)bytes / samples) : 0.0),
+				(samples ? ((double)decodeTime * 1000000000.0 / ((double)frequency.QuadPart * samples)) : 0.0), value);
+		}
+		client.goodBye(d, clientRequestDone, &request);
+		waitClientRequest(client, s, request);
+	}
+
+	closesocket(s);
+	WSACleanup();
+	return 0;
+}
+#endif
+
+#ifdef IoTAggregateCount
+// Acts as a client, reading the temperature summaries kept by the device
+// running on this computer
+int aggregates() {
+	SOCKET s = openClientSocket();
+	static IoTDCPClient client(clientSend, &s);
+	const uint16_t d = client.addDevice(htonl(INADDR_LOOPBACK), htons(IoTPort), "Password");
+	ClientRequest request = { false };
+
+	if (!client.handshake(d, clientRequestDone, &request) || !waitClientRequest(client, s, request) ||
+		!client.getAggregates(d, Interface0, PropTemperature, clientRequestDone, &request) || !waitClientRequest(client, s, request)) {
+		printf("Could not read the aggregates: %d\n", request.result);
+	} else {
+		IoTAggregateReport report;
+		for (uint16_t i = 0; IoTDCPClient::readAggregateReport(request.payload, request.payloadLength, i, report); i++) {
+			if (report.count)
+				printf("Last %u ms window (ended %u ms ago): %u samples, min %.1f C, max %.1f C, mean %.2f C\n", report.window, report.age, report.count, report.minimum, report.maximum, report.mean);
+			else
+				printf("Last %u ms window (ended %u ms ago): no samples\n", report.window, report.age);
+		}
+		client.goodBye(d, clientRequestDone, &request);
+		waitClientRequest(client, s, request);
+	}
+
+	closesocket(s);
+	WSACleanup();
+	return 0;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+	if (argc >= 3 && !strcmp(argv[1], "-replay"))
+		return replay(argv[2], (argc >= 4 ? atof(argv[3]) : 0));
+	if (argc >= 2 && !strcmp(argv[1], "-benchmark"))
+		return benchmark((uint32_t)(argc >= 3 ? atoi(argv[2]) : 10000));
+
+	if (argc >= 2 && !strcmp(argv[1], "-discover"))
+		return discover((uint16_t)(argc >= 3 ? atoi(argv[2]) : 0));
+
+#ifdef IoTSetpointStreamCount
+	if (argc >= 2 && !strcmp(argv[1], "-stream"))
+		return stream();
+#endif
+
+#ifdef IoTAggregateCount
+	if (argc >= 2 && !strcmp(argv[1], "-aggregates"))
+		return aggregates();
+#endif
+
+#ifdef IoTTimeSeries
+	if (argc >= 2 && !strcmp(argv[1], "-series"))
+		return series();
+#endif
+
+#ifdef IoTRuleCount
+	if (argc >= 2 && !strcmp(argv[1], "-rule"))
+		return rule();
+#endif
+
+#ifdef IoTScheduleCount
+	if (argc >= 2 && !strcmp(argv[1], "-schedule"))
+		return schedule((DWORD)(argc >= 3 ? atoi(argv[2]) : 2000));
+	if (argc >= 2 && !strcmp(argv[1], "-blink"))
+		return blink(argc >= 3 && !strcmp(argv[2], "off"));
+#endif
+
+#ifdef IoTPropertyPlane
+	if (argc >= 5 && !strcmp(argv[1], "-publish")) {
+		// This is what a driver would do, with no sockets involved
+		if (!mapPropertyPlane()) {
+			printf("Could not map the property plane\n");
+			return 1;
+		}
+		const uint8_t value = (uint8_t)atoi(argv[4]);
+		return (IoTServer.publishProperty((uint8_t)atoi(argv[2]), (uint8_t)atoi(argv[3]), &value, 1) ? 0 : 1);
+	}
+#endif
+
+	initializeDevice();
+
+#ifdef IoTPersistentState
+	// Must be called after all the initial values have been set
+	loadState();
+#endif
+
+	if (argc >= 3 && !strcmp(argv[1], "-capture")) {
+		if (!startCapture(argv[2])) {
+			printf("Could not open the capture file: %s\n", argv[2]);
+			return 1;
+		}
+		printf("Capturing to %s\n", argv[2]);
+	}
+
+#ifdef IoTPropertyPlane
+	if (!mapPropertyPlane())
+		printf("Could not map the property plane\n");
+#endif
 
 	WSAData data;
 	WSAStartup(MAKEWORD(2, 2), &data);
@@ -261,6 +1668,17 @@ int main() {
 		return 0;
 	}
 
+	ip_mreq group;
+	memcpy(&group.imr_multiaddr.s_addr, IoTMulticastGroupAddress, 4);
+	group.imr_interface.s_addr = INADDR_ANY;
+	if (setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&group, sizeof(group)) < 0) {
+		printf("setsockopt error IP_ADD_MEMBERSHIP: %d", WSAGetLastError());
+		system("pause");
+		closesocket(s);
+		WSACleanup();
+		return 0;
+	}
+
 	struct timeval tv;
 	tv.tv_sec = 0;
 	tv.tv_usec = 500000;
@@ -284,23 +1702,86 @@ int main() {
 
 	volatile bool alive = true;
 
+#ifdef IoTTrace
+	startTrace();
+#endif
+
+#ifdef IoTActuatorQueue
+	std::thread actuator(actuatorThread, &alive);
+#endif
+
 	std::thread t([s, &alive]() {
 		sockaddr_in remote;
 		while (alive) {
+#ifdef IoTRuleCount
+			// The last response has already been sent
+			applyRules();
+#endif
 			memset(&remote, 0, sizeof(remote));
 			int remoteLen = sizeof(remote);
+#ifdef IoTScheduleCount
+			// Wake up in time for the next scheduled scene
+			DWORD timeout = IoTServer.scheduleDelay();
+			if (timeout > 500)
+				timeout = 500;
+			else if (!timeout)
+				timeout = 1;
+			setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+#endif
 			int bytesInPacket = recvfrom(s, (char*)receivedBuffer, sizeof(receivedBuffer), 0, (sockaddr*)&remote, &remoteLen);
+			// recvfrom() returns at least every 500ms, due to SO_RCVTIMEO
+			runTimers();
+#ifdef IoTPersistentState
+			saveState(false);
+#endif
+#ifdef IoTPropertyPlane
+			uint8_t interfaceIndex, propertyIndex;
+			while (IoTServer.nextPropertyChange(interfaceIndex, propertyIndex))
+				printf("*** Property %d of interface %d published\n", propertyIndex, interfaceIndex);
+#endif
 			printf("*** Received bytes: %d\n", bytesInPacket);
 			if (bytesInPacket > 0) {
 				IoTServer.currentClientIP = remote.sin_addr.S_un.S_addr;
 				IoTServer.currentClientPort = remote.sin_port;
-				
+
+				if (captureFile)
+					captureDatagram(CaptureRequest, IoTServer.currentClientIP, IoTServer.currentClientPort, receivedBuffer, (uint16_t)bytesInPacket);
+
 				if (IoTServer.process(receivedBuffer, (uint16_t)bytesInPacket)) {
 					if (!IoTServer.responseReady())
 						handleMessage();
 
+					// Group messages are only answered when the client asks for it
+					if (!IoTServer.responseRequired())
+						continue;
+
+#ifdef IoTMulticastDiscovery
+					if (IoTServer.responseDelay()) {
+						// Send a copy of the response later, without holding up other messages
+						std::string response((const char*)IoTServer.responseBuffer(), IoTServer.responseLength());
+						const DWORD delay = IoTServer.responseDelay();
+						std::thread([s, remote, remoteLen, response, delay]() {
+							Sleep(delay);
+							sendto(s, response.data(), (int)response.length(), 0, (sockaddr*)&remote, remoteLen);
+						}).detach();
+						printf("Sending %d bytes in %d ms\n", IoTServer.responseLength(), (int)delay);
+#ifdef IoTTrace
+						IoTServer.trace(IoTServer.TraceSent, IoTServer.responseLength());
+#endif
+						if (captureFile)
+							captureDatagram(CaptureResponse, IoTServer.currentClientIP, IoTServer.currentClientPort, IoTServer.responseBuffer(), IoTServer.responseLength());
+						continue;
+					}
+#endif
+
 					printf("Sent bytes: %d\n", IoTServer.responseLength());
 					sendto(s, (char*)IoTServer.responseBuffer(), IoTServer.responseLength(), 0, (sockaddr*)&remote, remoteLen);
+#ifdef IoTTrace
+					IoTServer.trace(IoTServer.TraceSent, IoTServer.responseLength());
+#endif
+
+					if (captureFile)
+						captureDatagram(CaptureResponse, IoTServer.currentClientIP, IoTServer.currentClientPort, IoTServer.responseBuffer(), IoTServer.responseLength());
 				}
 			}
 		}
@@ -318,5 +1799,20 @@ int main() {
 
 	t.join();
 
+#ifdef IoTActuatorQueue
+	actuator.join();
+#endif
+
+	if (captureFile)
+		fclose(captureFile);
+
+#ifdef IoTTrace
+	dumpTrace();
+#endif
+
+#ifdef IoTPersistentState
+	saveState(true);
+#endif
+
 	return 0;
 }